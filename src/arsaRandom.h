@@ -0,0 +1,53 @@
+#ifndef MPMAP2_ARSA_RANDOM_HEADER_GUARD
+#define MPMAP2_ARSA_RANDOM_HEADER_GUARD
+#include <Rcpp.h>
+#include <stdint.h>
+//Draws from R's random number generator. This must only be used between calls to GetRNGstate and PutRNGstate, and only from the main thread.
+struct rUnifRand
+{
+	double operator()()
+	{
+		return unif_rand();
+	}
+};
+/* Independent random number generator, for running annealing replicates on separate threads.
+ *
+ * This is xoshiro256+, with the state initialised from a single 64-bit seed using splitmix64. Every replicate gets its own generator, with a seed drawn from R's random number generator, so the results only depend on R's seed.
+ */
+class xoshiro256Plus
+{
+public:
+	explicit xoshiro256Plus(uint64_t seed)
+	{
+		for(int i = 0; i < 4; i++)
+		{
+			seed += 0x9e3779b97f4a7c15ULL;
+			uint64_t z = seed;
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			state[i] = z ^ (z >> 31);
+		}
+	}
+	//Uniform on [0, 1), using the upper 53 bits
+	double operator()()
+	{
+		const uint64_t result = state[0] + state[3];
+		const uint64_t t = state[1] << 17;
+		state[2] ^= state[0];
+		state[3] ^= state[1];
+		state[1] ^= state[2];
+		state[0] ^= state[3];
+		state[2] ^= t;
+		state[3] = (state[3] << 45) | (state[3] >> 19);
+		return (double)(result >> 11) * (1.0 / 9007199254740992.0);
+	}
+	//Construct a seed from two draws from R's random number generator. Must be called between GetRNGstate and PutRNGstate.
+	static uint64_t seedFromR()
+	{
+		uint64_t upper = (uint64_t)(unif_rand() * 4294967296.0), lower = (uint64_t)(unif_rand() * 4294967296.0);
+		return (upper << 32) | (lower & 0xffffffffULL);
+	}
+private:
+	uint64_t state[4];
+};
+#endif
@@ -1,5 +1,8 @@
 #include "arsaRaw.h"
+#include "arsaRandom.h"
+#include "permutedDistanceRows.h"
 #include <Rcpp.h>
+#include <memory>
 #ifdef USE_OPENMP
 #include <omp.h>
 #endif
@@ -8,7 +11,9 @@ void arsaRawExported(arsaRawArgs& args)
 #ifdef USE_OPENMP
 	if(omp_get_max_threads() > 1)
 	{
-		arsaRawParallel(args);
+		//With multiple replicates it's more efficient to run the replicates in parallel, than to parallelise within each replicate
+		if(args.nReps > 1) arsaRawReplicatesParallel(args);
+		else arsaRawParallel(args);
 	}
 	else
 #endif
@@ -21,31 +26,31 @@ inline bool descendingComparer(double i, double j)
 {
 	return i > j;
 }
-inline void getPairForSwap(R_xlen_t n, R_xlen_t& swap1, R_xlen_t& swap2)
+template<typename rng> inline void getPairForSwap(R_xlen_t n, R_xlen_t& swap1, R_xlen_t& swap2, rng& random)
 {
 	do
 	{
-		swap1 = (R_xlen_t)(unif_rand()*n);
-		swap2 = (R_xlen_t)(unif_rand()*n);
+		swap1 = (R_xlen_t)(random()*n);
+		swap2 = (R_xlen_t)(random()*n);
 		if(swap1 == n) swap1--;
 		if(swap2 == n) swap2--;
 	}
 	while(swap1 == swap2);
 }
-inline void getPairForMove(R_xlen_t n, R_xlen_t& swap1, R_xlen_t& swap2, int maxMove)
+template<typename rng> inline void getPairForMove(R_xlen_t n, R_xlen_t& swap1, R_xlen_t& swap2, int maxMove, rng& random)
 {
 	do
 	{
-		swap1 = (R_xlen_t)(unif_rand()*n);
+		swap1 = (R_xlen_t)(random()*n);
 		if(maxMove > 0)
 		{
 			int minSwap2 = std::max((int)swap1 - maxMove, 0);
 			int maxSwap2 = std::min((int)swap1 + maxMove, (int)n);
-			swap2 = (R_xlen_t)(minSwap2 + unif_rand()*(maxSwap2 - minSwap2));
+			swap2 = (R_xlen_t)(minSwap2 + random()*(maxSwap2 - minSwap2));
 		}
 		else
 		{
-			swap2 = (R_xlen_t)(unif_rand()*n);
+			swap2 = (R_xlen_t)(random()*n);
 		}
 		if(swap1 == n) swap1--;
 		if(swap2 == n) swap2--;
@@ -163,6 +168,98 @@ inline double computeMoveDelta(std::vector<int>& deltaComponents, int swap1, int
 	}
 	return deltaFromComponents(levels, deltaComponents);
 }
+//Sum of values[start], ..., values[end-1]. Independent partial sums let the compiler vectorise this. 
+inline double sumRange(const double* values, R_xlen_t start, R_xlen_t end)
+{
+	double partial[4] = {0, 0, 0, 0};
+	R_xlen_t i = start;
+	for(; i + 4 <= end; i += 4)
+	{
+		partial[0] += values[i];
+		partial[1] += values[i+1];
+		partial[2] += values[i+2];
+		partial[3] += values[i+3];
+	}
+	for(; i < end; i++) partial[0] += values[i];
+	return (partial[0] + partial[1]) + (partial[2] + partial[3]);
+}
+//Sum of values2[i] - values1[i], for i from start to end-1
+inline double sumDifferenceRange(const double* values1, const double* values2, R_xlen_t start, R_xlen_t end)
+{
+	double partial[4] = {0, 0, 0, 0};
+	R_xlen_t i = start;
+	for(; i + 4 <= end; i += 4)
+	{
+		partial[0] += values2[i] - values1[i];
+		partial[1] += values2[i+1] - values1[i+1];
+		partial[2] += values2[i+2] - values1[i+2];
+		partial[3] += values2[i+3] - values1[i+3];
+	}
+	for(; i < end; i++) partial[0] += values2[i] - values1[i];
+	return (partial[0] + partial[1]) + (partial[2] + partial[3]);
+}
+//Same as computeDelta, but using the cached permuted rows. The weight |i - swap1| - |i - swap2| is constant outside the two positions, so most of the work is two contiguous sums. 
+inline double computeDelta(const std::vector<int>& currentPermutation, R_xlen_t swap1, R_xlen_t swap2, permutedDistanceRows& rows)
+{
+	R_xlen_t n = currentPermutation.size();
+	const double* row1 = rows.row(currentPermutation, swap1);
+	const double* row2 = rows.row(currentPermutation, swap2);
+	R_xlen_t lower = std::min(swap1, swap2), upper = std::max(swap1, swap2);
+	double delta = (double)(swap1 - swap2) * sumDifferenceRange(row1, row2, 0, lower) + (double)(swap2 - swap1) * sumDifferenceRange(row1, row2, upper + 1, n);
+	for(R_xlen_t i = lower + 1; i < upper; i++)
+	{
+		delta += (double)(std::abs(i - swap1) - std::abs(i - swap2)) * (row2[i] - row1[i]);
+	}
+	return delta;
+}
+//Same as computeMoveDelta, but using the cached permuted rows. The part involving every pair of markers in and outside the moved range needs one row per marker in the range, so if they can't all be cached at once that part is computed directly from rawDist. 
+inline double computeMoveDelta(std::vector<int>& deltaComponents, int swap1, int swap2, const std::vector<int>& currentPermutation, const Rbyte* rawDist, R_xlen_t n, const std::vector<double>& levels, permutedDistanceRows& rows)
+{
+	int span = (int)abs(swap1 - swap2);
+	double delta = 0;
+	//delta2 and delta3
+	const double* rowSwap1 = rows.row(currentPermutation, swap1);
+	if(swap2 > swap1)
+	{
+		delta += span * (sumRange(rowSwap1, 0, swap1) - sumRange(rowSwap1, swap2 + 1, n));
+		for(R_xlen_t counter1 = swap1+1; counter1 <= swap2; counter1++)
+		{
+			delta += (span + 1 - 2*(counter1 - swap1)) * rowSwap1[counter1];
+		}
+	}
+	else
+	{
+		delta += span * (sumRange(rowSwap1, swap1 + 1, n) - sumRange(rowSwap1, 0, swap2));
+		for(R_xlen_t counter1 = swap2; counter1 < swap1; counter1++)
+		{
+			delta -= (span - 1 - 2*(counter1 - swap2)) * rowSwap1[counter1];
+		}
+	}
+	//delta1
+	R_xlen_t rangeStart = std::min(swap1, swap2) + (swap2 > swap1 ? 1 : 0), rangeEnd = std::max(swap1, swap2) + (swap2 > swap1 ? 1 : 0);
+	R_xlen_t outsideLower = std::min(swap1, swap2), outsideUpper = std::max(swap1, swap2) + 1;
+	double sign = swap2 > swap1 ? 1 : -1;
+	if(rows.holdsAllRows())
+	{
+		for(R_xlen_t counter1 = rangeStart; counter1 < rangeEnd; counter1++)
+		{
+			const double* row = rows.row(currentPermutation, counter1);
+			delta += sign * (sumRange(row, outsideUpper, n) - sumRange(row, 0, outsideLower));
+		}
+	}
+	else
+	{
+		std::fill(deltaComponents.begin(), deltaComponents.end(), 0);
+		for(R_xlen_t counter1 = rangeStart; counter1 < rangeEnd; counter1++)
+		{
+			const Rbyte* row = rawDist + currentPermutation[counter1]*n;
+			for(R_xlen_t counter2 = outsideUpper; counter2 < n; counter2++) deltaComponents[row[currentPermutation[counter2]]]++;
+			for(R_xlen_t counter2 = 0; counter2 < outsideLower; counter2++) deltaComponents[row[currentPermutation[counter2]]]--;
+		}
+		delta += sign * deltaFromComponents(levels, deltaComponents);
+	}
+	return delta;
+}
 SEXP arsaRaw(SEXP n_, SEXP rawDist_, SEXP levels_, SEXP cool_, SEXP temperatureMin_, SEXP nReps_, SEXP maxMove_sexp, SEXP effortMultiplier_sexp, SEXP randomStart_sexp)
 {
 BEGIN_RCPP
@@ -293,58 +390,212 @@ BEGIN_RCPP
 	args.randomStart = randomStart;
 	args.maxMove = maxMove;
 	args.effortMultiplier = effortMultiplier;
-#ifdef USE_OPENMP
-	if(omp_get_max_threads() > 1)
-	{
-		arsaRawParallel(args);
-	}
-	else
-#endif
-	{
-		arsaRaw(args);
-	}
+	arsaRawExported(args);
 	return Rcpp::wrap(permutation);
 END_RCPP
 }
-void arsaRaw(arsaRawArgs& args)
+//Check the arguments shared by all the versions of the annealing. Returns false if there is nothing to do, because there is only one marker. 
+bool checkArsaRawArgs(arsaRawArgs& args)
 {
-	long n = args.n;
-	Rbyte* rawDist = args.rawDist;
-	std::vector<double>& levels = args.levels;
-	double cool = args.cool;
-	double temperatureMin = args.temperatureMin;
-	if(temperatureMin <= 0)
+	if(args.temperatureMin <= 0)
 	{
 		throw std::runtime_error("Input temperatureMin must be positive");
 	}
-	
-	long nReps = args.nReps;
-	std::vector<int>& permutation = args.permutation;
-	std::function<void(unsigned long, unsigned long)> progressFunction = args.progressFunction;
-	bool randomStart = args.randomStart;
-
-	int maxMove = args.maxMove;
-	if(maxMove < 0)
+	if(args.maxMove < 0)
 	{
 		throw std::runtime_error("Input maxMove must be non-negative");
 	}
-
-	double effortMultiplier = args.effortMultiplier;
-	if(effortMultiplier <= 0)
+	if(args.effortMultiplier <= 0)
 	{
 		throw std::runtime_error("Input effortMultiplier must be positive");
 	}
-
-	permutation.resize(n);
-	if(n == 1)
+	args.permutation.resize(args.n);
+	if(args.n == 1)
 	{
-		permutation[0] = 0;
-		return;
+		args.permutation[0] = 0;
+		return false;
 	}
-	else if(n < 1)
+	else if(args.n < 1)
 	{
 		throw std::runtime_error("Input n must be positive");
 	}
+	return true;
+}
+//The maximum amount of memory used to cache rows of rawDist, in bytes. If all the rows fit, every change in the objective function can be computed from the cache. This can be changed by arsaRawRowCacheBytes, so that the tests can use a cache which holds only a few rows. 
+static const std::size_t defaultRowCacheBytes = 256 * 1024 * 1024;
+static std::size_t rowCacheBytes = defaultRowCacheBytes;
+//Value of the objective function for a permutation
+inline double arsaObjective(const std::vector<int>& permutation, const Rbyte* rawDist, const std::vector<double>& levels, long n)
+{
+	double z = 0;
+	for(R_xlen_t i = 0; i < n-1; i++)
+	{
+		R_xlen_t k = permutation[i];
+		for(R_xlen_t j = i+1; j < n; j++)
+		{
+			R_xlen_t l = permutation[j];
+			z += (j-i) * levels[rawDist[l*n + k]];
+		}
+	}
+	return z;
+}
+//Create the initial permutation. This is random if we decided to use a random initial permutation, and every marker is movable. See arsaRawReplicate for the meaning of the arguments. 
+template<typename rng> inline void initialPermutation(const arsaRawArgs& args, rng& random, std::vector<int>& consecutive, std::vector<int>& permutation, R_xlen_t nMovable)
+{
+	long n = args.n;
+	if(args.randomStart && nMovable == n)
+	{
+		for(R_xlen_t i = 0; i < n; i++)
+		{
+			double rand = random();
+			R_xlen_t index = (R_xlen_t)(rand*(n-i));
+			if(index == n-i) index--;
+			permutation[i] = consecutive[index];
+			std::swap(consecutive[index], *(consecutive.rbegin()+i));
+		}
+	}
+	else
+	{
+		for(R_xlen_t i = 0; i < n; i++)
+		{
+			permutation[i] = consecutive[i];
+		}
+	}
+}
+//The starting temperature is the largest decrease in the objective function, over 5000 random swaps
+template<typename rng> inline double initialTemperature(const arsaRawArgs& args, rng& random, const std::vector<int>& permutation, permutedDistanceRows& rows, R_xlen_t firstMovable, R_xlen_t nMovable)
+{
+	double temperatureMax = 0;
+	for(R_xlen_t swapCounter = 0; swapCounter < (R_xlen_t)(5000*args.effortMultiplier); swapCounter++)
+	{
+		R_xlen_t swap1, swap2;
+		getPairForSwap(nMovable, swap1, swap2, random);
+		swap1 += firstMovable;
+		swap2 += firstMovable;
+		double delta = computeDelta(permutation, swap1, swap2, rows);
+		if(delta < 0)
+		{
+			if(fabs(delta) > temperatureMax) temperatureMax = fabs(delta);
+		}
+	}
+	return temperatureMax;
+}
+/* Propose a random swap or insertion, and accept or reject it at this temperature. The objective function z is updated if the change is accepted. 
+ *
+ * @return True if the change was accepted and did not make the objective function worse, in which case the caller should check whether this is the best permutation so far. 
+ */
+template<typename rng> inline bool annealingStep(const arsaRawArgs& args, rng& random, std::vector<int>& currentPermutation, double& z, double temperature, std::vector<int>& deltaComponents, permutedDistanceRows& rows, R_xlen_t firstMovable, R_xlen_t nMovable)
+{
+	R_xlen_t swap1, swap2;
+	//swap
+	if(random() <= 0.5)
+	{
+		getPairForSwap(nMovable, swap1, swap2, random);
+		swap1 += firstMovable;
+		swap2 += firstMovable;
+		double delta = computeDelta(currentPermutation, swap1, swap2, rows);
+		if(delta > -1e-8)
+		{
+			z += delta;
+			std::swap(currentPermutation[swap1], currentPermutation[swap2]);
+			rows.swapped(swap1, swap2);
+			return true;
+		}
+		else
+		{
+			if(random() <= exp(delta / temperature))
+			{
+				z += delta;
+				std::swap(currentPermutation[swap1], currentPermutation[swap2]);
+				rows.swapped(swap1, swap2);
+			}
+			return false;
+		}
+	}
+	//insertion
+	else
+	{
+		getPairForMove(nMovable, swap1, swap2, args.maxMove, random);
+		swap1 += firstMovable;
+		swap2 += firstMovable;
+		double delta = computeMoveDelta(deltaComponents, swap1, swap2, currentPermutation, args.rawDist, args.n, args.levels, rows);
+		int permutedSwap1 = currentPermutation[swap1];
+		if(delta > -1e-8 || random() <= exp(delta / temperature))
+		{
+			z += delta;
+			if(swap2 > swap1)
+			{
+				for(R_xlen_t i = swap1; i < swap2; i++)
+				{
+					currentPermutation[i] = currentPermutation[i+1];
+				}
+				currentPermutation[swap2] = (int)permutedSwap1;
+			}
+			else
+			{
+				for(R_xlen_t i = swap1; i > swap2; i--)
+				{
+					currentPermutation[i] = currentPermutation[i-1];
+				}
+				currentPermutation[swap2] = (int)permutedSwap1; 
+			}
+			rows.moved(swap1, swap2);
+		}
+		return delta > -1e-8;
+	}
+}
+/* Run a single replicate of the annealing. 
+ *
+ * @param random The source of random numbers
+ * @param consecutive Used to construct the random initial permutation. Must contain a permutation of 0, ..., n-1. It is permuted further by this function. 
+ * @param bestPermutationThisRep Overwritten with the best permutation found
+ * @param deltaComponents Working storage, with one entry for every level
+ * @param rows Working storage for the rows of rawDist. Any rows it contains are discarded. 
+ * @param firstMovable, nMovable Only the markers at positions firstMovable, ..., firstMovable + nMovable - 1 are moved. The rest stay where they are, but still count towards the objective function. A random start is only used if every marker is movable. 
+ * @return The value of the objective function for bestPermutationThisRep
+ */
+template<typename rng> double arsaRawReplicate(const arsaRawArgs& args, rng& random, std::vector<int>& consecutive, std::vector<int>& bestPermutationThisRep, std::vector<int>& deltaComponents, permutedDistanceRows& rows, R_xlen_t firstMovable, R_xlen_t nMovable, const std::function<void(unsigned long, unsigned long)>& progressFunction)
+{
+	double cool = args.cool;
+	double temperatureMin = args.temperatureMin;
+	double effortMultiplier = args.effortMultiplier;
+	initialPermutation(args, random, consecutive, bestPermutationThisRep, nMovable);
+	rows.reset();
+	//calculate value of z
+	double z = arsaObjective(bestPermutationThisRep, args.rawDist, args.levels, args.n);
+	double zbestThisRep = z;
+	double temperatureMax = initialTemperature(args, random, bestPermutationThisRep, rows, firstMovable, nMovable);
+	double temperature = temperatureMax;
+	std::vector<int> currentPermutation = bestPermutationThisRep;
+	//If no swap made things worse, there's nothing to anneal
+	int nloop = temperatureMax > 0 ? (int)((log(temperatureMin) - log(temperatureMax)) / log(cool)) : 0;
+	long totalSteps = (long)(nloop * 100 * nMovable * effortMultiplier);
+	long done = 0;
+	long threadZeroCounter = 0;
+	for(R_xlen_t idk = 0; idk < nloop; idk++)
+	{
+		for(R_xlen_t k = 0; k < (R_xlen_t)(100*nMovable*effortMultiplier); k++)
+		{
+			if(annealingStep(args, random, currentPermutation, z, temperature, deltaComponents, rows, firstMovable, nMovable) && z > zbestThisRep)
+			{
+				zbestThisRep = z;
+				bestPermutationThisRep = currentPermutation;
+			}
+			done++;
+			threadZeroCounter++;
+			if(threadZeroCounter % 100 == 0)
+			{
+				progressFunction(done, totalSteps);
+			}
+		}
+		temperature *= cool;
+	}
+	return zbestThisRep;
+}
+void arsaRaw(arsaRawArgs& args)
+{
+	if(!checkArsaRawArgs(args)) return;
+	long n = args.n;
 	//We skip the initialisation of D, R1 and R2 from arsa.f, and the computation of asum. 
 	//Next the original arsa.f code creates nReps random permutations, and holds them all at once. This doesn't seem necessary, we create them one at a time and discard them
 	double zbestAllReps = -std::numeric_limits<double>::infinity();
@@ -353,141 +604,472 @@ void arsaRaw(arsaRawArgs& args)
 	//We use this to build the random permutations
 	std::vector<int> consecutive(n);
 	for(R_xlen_t i = 0; i < n; i++) consecutive[i] = (int)i;
-	std::vector<int> deltaComponents(levels.size());
+	std::vector<int> deltaComponents(args.levels.size());
+	permutedDistanceRows rows(args.rawDist, args.levels, n, rowCacheBytes);
 	//We're doing lots of simulation, so we use the old-fashioned approach to dealing with Rs random number generation
 	GetRNGstate();
+	rUnifRand random;
+	for(int repCounter = 0; repCounter < args.nReps; repCounter++)
+	{
+		double zbestThisRep = arsaRawReplicate(args, random, consecutive, bestPermutationThisRep, deltaComponents, rows, 0, n, args.progressFunction);
+		if(zbestThisRep > zbestAllReps)
+		{
+			zbestAllReps = zbestThisRep;
+			args.permutation.swap(bestPermutationThisRep);
+		}
+	}
+	PutRNGstate();
+}
+inline Rbyte packedDistance(const Rbyte* packedDist, R_xlen_t i, R_xlen_t j)
+{
+	if(i < j) std::swap(i, j);
+	return packedDist[(i*(i+1ULL))/2ULL + j];
+}
+//Copy the distances between a subset of markers from the packed lower triangle into a dense symmetric matrix
+void unpackSubset(const Rbyte* packedDist, const std::vector<int>& markers, std::vector<Rbyte>& dense)
+{
+	std::size_t nMarkers = markers.size();
+	dense.resize(nMarkers * nMarkers);
+	for(std::size_t i = 0; i < nMarkers; i++)
+	{
+		for(std::size_t j = 0; j <= i; j++)
+		{
+			dense[i * nMarkers + j] = dense[j * nMarkers + i] = packedDistance(packedDist, markers[i], markers[j]);
+		}
+	}
+}
+void arsaRawWindowed(arsaRawArgs& args, int windowSize)
+{
+	if(windowSize < 2)
+	{
+		throw std::runtime_error("Input windowSize must be at least 2");
+	}
+	if(!checkArsaRawArgs(args)) return;
+	long n = args.n;
+	const Rbyte* packedDist = args.rawDist;
+	const std::vector<double>& levels = args.levels;
+	std::vector<int>& order = args.permutation;
+	std::function<void(unsigned long, unsigned long)> noProgress = [](unsigned long, unsigned long){};
 
-	for(int repCounter = 0; repCounter < nReps; repCounter++)
+	//Choose the markers for the coarse ordering. If the group is small enough this is every marker, and there's nothing else to do. 
+	long nAnchors = std::min(n, (long)windowSize);
+	std::vector<int> anchors(n);
+	for(long i = 0; i < n; i++) anchors[i] = (int)i;
+	if(nAnchors < n)
 	{
-		//create the random permutation, if we decided to use a random initial permutation
-		if(randomStart)
+		GetRNGstate();
+		for(long i = 0; i < nAnchors; i++)
 		{
-			for(R_xlen_t i = 0; i < n; i++)
-			{
-				double rand = unif_rand();
-				R_xlen_t index = (R_xlen_t)(rand*(n-i));
-				if(index == n-i) index--;
-				bestPermutationThisRep[i] = consecutive[index];
-				std::swap(consecutive[index], *(consecutive.rbegin()+i));
-			}
+			long index = i + (long)(unif_rand() * (n - i));
+			if(index == n) index--;
+			std::swap(anchors[i], anchors[index]);
 		}
-		else
+		PutRNGstate();
+		anchors.resize(nAnchors);
+	}
+	std::vector<Rbyte> denseDist;
+	unpackSubset(packedDist, anchors, denseDist);
+	std::vector<int> anchorPermutation;
+	{
+		arsaRawArgs anchorArgs(args, anchorPermutation);
+		anchorArgs.n = nAnchors;
+		anchorArgs.rawDist = &(denseDist[0]);
+		anchorArgs.progressFunction = nAnchors < n ? noProgress : args.progressFunction;
+		arsaRawExported(anchorArgs);
+	}
+	if(nAnchors == n)
+	{
+		order.swap(anchorPermutation);
+		return;
+	}
+	//Put every other marker next to the closest anchor, on the side of whichever neighbouring anchor is closer. The position within the gap depends on the relative distances to the two anchors. 
+	std::vector<double> positions(n);
+	std::vector<bool> isAnchor(n, false);
+	std::vector<int> orderedAnchors(nAnchors);
+	for(long i = 0; i < nAnchors; i++)
+	{
+		orderedAnchors[i] = anchors[anchorPermutation[i]];
+		positions[orderedAnchors[i]] = (double)i;
+		isAnchor[orderedAnchors[i]] = true;
+	}
+	std::vector<double> anchorDistances(nAnchors);
+	for(long marker = 0; marker < n; marker++)
+	{
+		if(isAnchor[marker]) continue;
+		long closest = 0;
+		for(long i = 0; i < nAnchors; i++)
 		{
-			for(R_xlen_t i = 0; i < n; i++)
-			{
-				bestPermutationThisRep[i] = consecutive[i];
-			}
+			anchorDistances[i] = levels[packedDistance(packedDist, marker, orderedAnchors[i])];
+			if(anchorDistances[i] < anchorDistances[closest]) closest = i;
 		}
-		//calculate value of z
-		double z = 0;
-		for(R_xlen_t i = 0; i < n-1; i++)
+		double left = closest > 0 ? anchorDistances[closest-1] : std::numeric_limits<double>::infinity();
+		double right = closest < nAnchors - 1 ? anchorDistances[closest+1] : std::numeric_limits<double>::infinity();
+		double neighbour = std::min(left, right), total = anchorDistances[closest] + neighbour;
+		double offset = total > 0 ? 0.5 * anchorDistances[closest] / total : 0.25;
+		positions[marker] = closest + (left < right ? -offset : offset);
+	}
+	order.resize(n);
+	for(long i = 0; i < n; i++) order[i] = (int)i;
+	std::stable_sort(order.begin(), order.end(), [&positions](int a, int b){ return positions[a] < positions[b]; });
+
+	//Refine the order using overlapping windows
+	long step = std::max(windowSize / 2, 1), margin = windowSize / 2;
+	long nWindows = 1 + (std::max(n - windowSize, 0L) + step - 1) / step;
+	std::vector<int> bandMarkers, bandPermutation, consecutive, deltaComponents(levels.size());
+	GetRNGstate();
+	rUnifRand random;
+	for(long windowCounter = 0; windowCounter < nWindows; windowCounter++)
+	{
+		long windowStart = std::min(windowCounter * step, n - windowSize), windowEnd = windowStart + windowSize;
+		long bandStart = std::max(windowStart - margin, 0L), bandEnd = std::min(windowEnd + margin, n), bandSize = bandEnd - bandStart;
+		bandMarkers.assign(order.begin() + bandStart, order.begin() + bandEnd);
+		unpackSubset(packedDist, bandMarkers, denseDist);
+
+		arsaRawArgs windowArgs(args, bandPermutation);
+		windowArgs.n = bandSize;
+		windowArgs.rawDist = &(denseDist[0]);
+		windowArgs.randomStart = false;
+		bandPermutation.resize(bandSize);
+		consecutive.resize(bandSize);
+		for(long i = 0; i < bandSize; i++) consecutive[i] = (int)i;
+		permutedDistanceRows rows(windowArgs.rawDist, levels, bandSize, rowCacheBytes);
+		arsaRawReplicate(windowArgs, random, consecutive, bandPermutation, deltaComponents, rows, windowStart - bandStart, windowSize, noProgress);
+		for(long i = 0; i < bandSize; i++) order[bandStart + i] = bandMarkers[bandPermutation[i]];
+		args.progressFunction(windowCounter + 1, nWindows);
+	}
+	PutRNGstate();
+}
+void arsaRawTempering(arsaRawArgs& args, int nChains)
+{
+	if(nChains < 2)
+	{
+		throw std::runtime_error("Input nChains must be at least 2");
+	}
+	if(!checkArsaRawArgs(args)) return;
+	long n = args.n;
+	//Every chain has its own random number generator, and the exchanges between chains use another one. These are all seeded from R's random number generator, so the result only depends on R's seed. 
+	std::vector<uint64_t> seeds(nChains + 1);
+	GetRNGstate();
+	for(int i = 0; i < nChains + 1; i++) seeds[i] = xoshiro256Plus::seedFromR();
+	PutRNGstate();
+	xoshiro256Plus exchangeRandom(seeds[nChains]);
+
+	struct chain
+	{
+		chain(const arsaRawArgs& args, uint64_t seed, std::size_t maxBytes)
+			: random(seed), rows(new permutedDistanceRows(args.rawDist, args.levels, args.n, maxBytes)), currentPermutation(args.n), bestPermutation(args.n), deltaComponents(args.levels.size())
+		{}
+		xoshiro256Plus random;
+		std::unique_ptr<permutedDistanceRows> rows;
+		std::vector<int> currentPermutation, bestPermutation, deltaComponents;
+		double z, zbest;
+	};
+	std::vector<chain> chains;
+	chains.reserve(nChains);
+	std::vector<int> consecutive(n);
+	for(int i = 0; i < nChains; i++)
+	{
+		chains.push_back(chain(args, seeds[i], rowCacheBytes / nChains));
+		chain& current = chains.back();
+		for(R_xlen_t j = 0; j < n; j++) consecutive[j] = (int)j;
+		initialPermutation(args, current.random, consecutive, current.currentPermutation, n);
+		current.bestPermutation = current.currentPermutation;
+		current.z = current.zbest = arsaObjective(current.currentPermutation, args.rawDist, args.levels, n);
+	}
+	//The temperatures are spaced geometrically between the usual starting temperature and temperatureMin. The number of steps for each chain is the same as for a single replicate of the annealing. 
+	double temperatureMax = initialTemperature(args, chains[0].random, chains[0].currentPermutation, *chains[0].rows, 0, n);
+	int nloop = temperatureMax > 0 ? (int)((log(args.temperatureMin) - log(temperatureMax)) / log(args.cool)) : 0;
+	long nRounds = std::max(0L, (long)(nloop * 100 * args.effortMultiplier));
+	std::vector<double> temperatures(nChains);
+	for(int i = 0; i < nChains; i++) temperatures[i] = temperatureMax * pow(args.temperatureMin / temperatureMax, (double)i / (double)(nChains - 1));
+	//chainAtTemperature[i] is the chain currently at temperatures[i]. Exchanging configurations between two temperatures just exchanges these entries. 
+	std::vector<int> chainAtTemperature(nChains);
+	for(int i = 0; i < nChains; i++) chainAtTemperature[i] = i;
+
+	for(long round = 0; round < nRounds; round++)
+	{
+		//Every chain makes n moves at its current temperature
+#ifdef USE_OPENMP
+		#pragma omp parallel for schedule(static, 1)
+#endif
+		for(int temperatureIndex = 0; temperatureIndex < nChains; temperatureIndex++)
 		{
-			R_xlen_t k = bestPermutationThisRep[i];
-			for(R_xlen_t j = i+1; j < n; j++)
+			chain& current = chains[chainAtTemperature[temperatureIndex]];
+			double temperature = temperatures[temperatureIndex];
+			for(R_xlen_t k = 0; k < n; k++)
 			{
-				R_xlen_t l = bestPermutationThisRep[j];
-				z += (j-i) * levels[rawDist[l*n + k]];
+				if(annealingStep(args, current.random, current.currentPermutation, current.z, temperature, current.deltaComponents, *current.rows, 0, n) && current.z > current.zbest)
+				{
+					current.zbest = current.z;
+					current.bestPermutation = current.currentPermutation;
+				}
 			}
 		}
-		double zbestThisRep = z;
-		double temperatureMax = 0;
-		//Now try 5000 random swaps
-		for(R_xlen_t swapCounter = 0; swapCounter < (R_xlen_t)(5000*effortMultiplier); swapCounter++)
+		//Propose exchanges between neighbouring temperatures, alternating between the even and odd pairs
+		for(int i = (int)(round % 2); i + 1 < nChains; i += 2)
 		{
-			R_xlen_t swap1, swap2;
-			getPairForSwap(n, swap1, swap2);
-			double delta = computeDelta(bestPermutationThisRep, swap1, swap2, rawDist, levels, deltaComponents);
-			if(delta < 0)
-			{
-				if(fabs(delta) > temperatureMax) temperatureMax = fabs(delta);
-			}
+			double logRatio = (chains[chainAtTemperature[i+1]].z - chains[chainAtTemperature[i]].z) * (1 / temperatures[i] - 1 / temperatures[i+1]);
+			if(logRatio >= 0 || exchangeRandom() <= exp(logRatio)) std::swap(chainAtTemperature[i], chainAtTemperature[i+1]);
 		}
-		double temperature = temperatureMax;
-		std::vector<int> currentPermutation = bestPermutationThisRep;
-		int nloop = (int)((log(temperatureMin) - log(temperatureMax)) / log(cool));
-		long totalSteps = (long)(nloop * 100 * n * effortMultiplier);
-		long done = 0;
-		long threadZeroCounter = 0;
-		//Rcpp::Rcout << "Steps needed: " << nloop << std::endl;
-		for(R_xlen_t idk = 0; idk < nloop; idk++)
+		args.progressFunction(round + 1, nRounds);
+	}
+	//Ties go to the first chain
+	int bestChain = 0;
+	for(int i = 1; i < nChains; i++)
+	{
+		if(chains[i].zbest > chains[bestChain].zbest) bestChain = i;
+	}
+	args.permutation.swap(chains[bestChain].bestPermutation);
+}
+SEXP arsaRawRowCacheBytes(SEXP bytes_)
+{
+BEGIN_RCPP
+	double bytes;
+	try
+	{
+		bytes = Rcpp::as<double>(bytes_);
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Input bytes must be a number");
+	}
+	if(bytes != bytes || bytes < 0) throw std::runtime_error("Input bytes must be non-negative");
+	double previous = (double)rowCacheBytes;
+	rowCacheBytes = bytes == 0 ? defaultRowCacheBytes : (std::size_t)bytes;
+	return Rcpp::wrap(previous);
+END_RCPP
+}
+SEXP arsaRawCompareDeltas(SEXP n_, SEXP rawDist_, SEXP levels_, SEXP nChanges_)
+{
+BEGIN_RCPP
+	R_xlen_t n;
+	try
+	{
+		n = Rcpp::as<int>(n_);
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Input n must be an integer");
+	}
+	if(n < 2)
+	{
+		throw std::runtime_error("Input n must be at least 2");
+	}
+
+	Rcpp::RawVector rawDist;
+	try
+	{
+		rawDist = Rcpp::as<Rcpp::RawVector>(rawDist_);
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Input rawDist must be a raw vector");
+	}
+	if(rawDist.size() != (n*(n+1))/2)
+	{
+		throw std::runtime_error("Input rawDist must have n*(n+1)/2 entries");
+	}
+
+	std::vector<double> levels;
+	try
+	{
+		levels = Rcpp::as<std::vector<double> >(levels_);
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Input levels must be a numeric vector");
+	}
+	for(R_xlen_t i = 0; i < rawDist.size(); i++)
+	{
+		if(rawDist[i] >= levels.size()) throw std::runtime_error("Input rawDist contained a value with no corresponding level");
+	}
+
+	int nChanges;
+	try
+	{
+		nChanges = Rcpp::as<int>(nChanges_);
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Input nChanges must be an integer");
+	}
+
+	std::vector<Rbyte> distMatrix(n*n);
+	for(R_xlen_t i = 0; i < n; i++)
+	{
+		for(R_xlen_t j = 0; j <= i; j++)
 		{
-			//Rcpp::Rcout << "Temp = " << temperature << std::endl;
-			for(R_xlen_t k = 0; k < (R_xlen_t)(100*n*effortMultiplier); k++)
+			distMatrix[i * n + j] = distMatrix[j * n + i] = rawDist((i *(i + 1))/2 + j);
+		}
+	}
+	std::vector<int> permutation(n), deltaComponents(levels.size());
+	for(R_xlen_t i = 0; i < n; i++) permutation[i] = (int)i;
+	permutedDistanceRows rows(&(distMatrix[0]), levels, n, rowCacheBytes);
+	//Every change is made, whatever the change in the objective function, so the cached rows are constantly updated, evicted and rebuilt
+	Rcpp::NumericMatrix result(nChanges, 2);
+	GetRNGstate();
+	rUnifRand random;
+	for(int changeCounter = 0; changeCounter < nChanges; changeCounter++)
+	{
+		R_xlen_t swap1, swap2;
+		if(random() <= 0.5)
+		{
+			getPairForSwap(n, swap1, swap2, random);
+			result(changeCounter, 0) = computeDelta(permutation, swap1, swap2, rows);
+			result(changeCounter, 1) = computeDelta(permutation, swap1, swap2, &(distMatrix[0]), levels, deltaComponents);
+			std::swap(permutation[swap1], permutation[swap2]);
+			rows.swapped(swap1, swap2);
+		}
+		else
+		{
+			getPairForMove(n, swap1, swap2, 0, random);
+			result(changeCounter, 0) = computeMoveDelta(deltaComponents, (int)swap1, (int)swap2, permutation, &(distMatrix[0]), n, levels, rows);
+			result(changeCounter, 1) = computeMoveDelta(deltaComponents, (int)swap1, (int)swap2, permutation, &(distMatrix[0]), n, levels);
+			int permutedSwap1 = permutation[swap1];
+			if(swap2 > swap1) std::copy(permutation.begin() + swap1 + 1, permutation.begin() + swap2 + 1, permutation.begin() + swap1);
+			else std::copy_backward(permutation.begin() + swap2, permutation.begin() + swap1, permutation.begin() + swap1 + 1);
+			permutation[swap2] = permutedSwap1;
+			rows.moved(swap1, swap2);
+		}
+	}
+	PutRNGstate();
+	return result;
+END_RCPP
+}
+#ifdef USE_OPENMP
+void arsaRawReplicatesParallel(arsaRawArgs& args)
+{
+	std::vector<arsaRawArgs*> groupArgs(1, &args);
+	arsaRawReplicatesParallel(groupArgs, args.progressFunction, std::function<void(std::size_t, std::vector<Rbyte>&)>());
+}
+void arsaRawReplicatesParallel(std::vector<arsaRawArgs*>& groupArgs, const std::function<void(unsigned long, unsigned long)>& progressFunction, const std::function<void(std::size_t, std::vector<Rbyte>&)>& unpackGroup)
+{
+	//Groups with a single marker need no annealing, and use no random numbers
+	std::vector<std::size_t> groupsToOrder;
+	for(std::size_t group = 0; group < groupArgs.size(); group++)
+	{
+		if(checkArsaRawArgs(*groupArgs[group])) groupsToOrder.push_back(group);
+	}
+	//Every replicate has its own random number generator, seeded from R's random number generator. The seeds are drawn group by group, so the result depends only on R's seed, and not on the number of threads, the order in which replicates are run, or whether the groups are ordered together or one at a time. 
+	struct replicate
+	{
+		std::size_t group;
+		long index;
+		uint64_t seed;
+		double work;
+	};
+	std::vector<replicate> replicates;
+	std::vector<std::vector<double> > zbest(groupArgs.size());
+	std::vector<std::vector<std::vector<int> > > bestPermutations(groupArgs.size());
+	//The unpacked distance matrices, and the number of replicates of each group which haven't finished yet. 
+	std::vector<std::unique_ptr<std::vector<Rbyte> > > distMatrices(groupArgs.size());
+	std::vector<long> remainingReplicates(groupArgs.size(), 0);
+	double totalWork = 0;
+	GetRNGstate();
+	for(std::size_t counter = 0; counter < groupsToOrder.size(); counter++)
+	{
+		std::size_t group = groupsToOrder[counter];
+		long n = groupArgs[group]->n, nReps = groupArgs[group]->nReps;
+		zbest[group].resize(nReps);
+		bestPermutations[group].resize(nReps);
+		remainingReplicates[group] = nReps;
+		for(long repCounter = 0; repCounter < nReps; repCounter++)
+		{
+			replicate current;
+			current.group = group;
+			current.index = repCounter;
+			current.seed = xoshiro256Plus::seedFromR();
+			current.work = (double)n * (double)n;
+			totalWork += current.work;
+			replicates.push_back(current);
+		}
+	}
+	PutRNGstate();
+	//Start the replicates for the largest groups first, so that the small groups fill in the gaps at the end. The replicates of a group stay together, so a group is only unpacked while some thread is working on it. 
+	std::stable_sort(replicates.begin(), replicates.end(), [](const replicate& a, const replicate& b){ return a.work > b.work; });
+
+	double finishedWork = 0;
+	long nReplicates = (long)replicates.size();
+	#pragma omp parallel
+	{
+		std::vector<int> consecutive, deltaComponents;
+		//The memory for cached rows is split between the threads. The cache is kept while a thread works on the same group. 
+		std::unique_ptr<permutedDistanceRows> rows;
+		std::size_t rowsGroup = groupArgs.size();
+		long nThreads = omp_get_num_threads();
+		double currentWork = 0;
+		std::function<void(unsigned long, unsigned long)> replicateProgressFunction = [&progressFunction, &finishedWork, &currentWork, totalWork](unsigned long done, unsigned long totalSteps)
+		{
+			//The progress function calls back into R, so only the main thread can use it
+			if(omp_get_thread_num() != 0) return;
+			double finished;
+			#pragma omp atomic read
+			finished = finishedWork;
+			finished += currentWork * (double)done / (double)totalSteps;
+			progressFunction((unsigned long)(1000 * std::min(finished / totalWork, 1.0)), 1000);
+		};
+		#pragma omp for schedule(dynamic)
+		for(long replicateCounter = 0; replicateCounter < nReplicates; replicateCounter++)
+		{
+			const replicate& current = replicates[replicateCounter];
+			const arsaRawArgs& args = *groupArgs[current.group];
+			long n = args.n;
+			if(unpackGroup)
 			{
-				R_xlen_t swap1, swap2;
-				//swap
-				if(unif_rand() <= 0.5)
+				//The first thread to reach a group unpacks it, for every thread working on that group
+				#pragma omp critical(arsaRawUnpackGroup)
 				{
-					getPairForSwap(n, swap1, swap2);
-					double delta = computeDelta(currentPermutation, swap1, swap2, rawDist, levels, deltaComponents);
-					if(delta > -1e-8)
+					if(!distMatrices[current.group])
 					{
-						z += delta;
-						std::swap(currentPermutation[swap1], currentPermutation[swap2]);
-						if(z > zbestThisRep)
-						{
-							zbestThisRep = z;
-							bestPermutationThisRep = currentPermutation;
-						}
-					}
-					else
-					{
-						if(unif_rand() <= exp(delta / temperature))
-						{
-							z += delta;
-							std::swap(currentPermutation[swap1], currentPermutation[swap2]);
-						}
+						distMatrices[current.group].reset(new std::vector<Rbyte>());
+						unpackGroup(current.group, *distMatrices[current.group]);
+						groupArgs[current.group]->rawDist = &((*distMatrices[current.group])[0]);
 					}
 				}
-				//insertion
-				else
+			}
+			if(rowsGroup != current.group)
+			{
+				rows.reset(new permutedDistanceRows(args.rawDist, args.levels, n, rowCacheBytes / nThreads));
+				rowsGroup = current.group;
+			}
+			consecutive.resize(n);
+			for(R_xlen_t i = 0; i < n; i++) consecutive[i] = (int)i;
+			deltaComponents.assign(args.levels.size(), 0);
+			xoshiro256Plus random(current.seed);
+			std::vector<int>& bestPermutation = bestPermutations[current.group][current.index];
+			bestPermutation.resize(n);
+			currentWork = current.work;
+			zbest[current.group][current.index] = arsaRawReplicate(args, random, consecutive, bestPermutation, deltaComponents, *rows, 0, n, replicateProgressFunction);
+			currentWork = 0;
+			#pragma omp atomic
+			finishedWork += current.work;
+			if(unpackGroup)
+			{
+				//Free the matrix after the last replicate of the group
+				#pragma omp critical(arsaRawUnpackGroup)
 				{
-					getPairForMove(n, swap1, swap2, maxMove);
-					double delta = computeMoveDelta(deltaComponents, swap1, swap2, currentPermutation, rawDist, n, levels);
-					int permutedSwap1 = currentPermutation[swap1];
-					if(delta > -1e-8 || unif_rand() <= exp(delta / temperature))
+					if(--remainingReplicates[current.group] == 0)
 					{
-						z += delta;
-						if(swap2 > swap1)
-						{
-							for(R_xlen_t i = swap1; i < swap2; i++)
-							{
-								currentPermutation[i] = currentPermutation[i+1];
-							}
-							currentPermutation[swap2] = (int)permutedSwap1;
-						}
-						else
-						{
-							for(R_xlen_t i = swap1; i > swap2; i--)
-							{
-								currentPermutation[i] = currentPermutation[i-1];
-							}
-							currentPermutation[swap2] = (int)permutedSwap1; 
-						}
+						distMatrices[current.group].reset();
+						groupArgs[current.group]->rawDist = NULL;
 					}
-					if(delta > -1e-8 && z > zbestThisRep)
-					{
-						bestPermutationThisRep = currentPermutation;
-						zbestThisRep = z;
-					}
-				}
-				done++;
-				threadZeroCounter++;
-				if(threadZeroCounter % 100 == 0)
-				{
-					progressFunction(done, totalSteps);
 				}
 			}
-			temperature *= cool;
 		}
-		if(zbestThisRep > zbestAllReps)
+	}
+	//Ties go to the first replicate, as for the serial version
+	for(std::size_t counter = 0; counter < groupsToOrder.size(); counter++)
+	{
+		std::size_t group = groupsToOrder[counter];
+		long bestRep = 0;
+		for(long repCounter = 1; repCounter < groupArgs[group]->nReps; repCounter++)
 		{
-			zbestAllReps = zbestThisRep;
-			permutation.swap(bestPermutationThisRep);
+			if(zbest[group][repCounter] > zbest[group][bestRep]) bestRep = repCounter;
 		}
+		groupArgs[group]->permutation.swap(bestPermutations[group][bestRep]);
 	}
-	PutRNGstate();
 }
+#endif
 #ifdef USE_OPENMP
 //Related to parallel version
 struct change
@@ -617,6 +1199,7 @@ void arsaRawParallel(arsaRawArgs& args)
 	std::vector<int> deltaComponents(levels.size());
 	//We're doing lots of simulation, so we use the old-fashioned approach to dealing with Rs random number generation
 	GetRNGstate();
+	rUnifRand random;
 
 	std::vector<change> stackOfChanges;
 	std::vector<bool> dirty(n, false);
@@ -658,7 +1241,7 @@ void arsaRawParallel(arsaRawArgs& args)
 		for(R_xlen_t swapCounter = 0; swapCounter < (R_xlen_t)(5000*effortMultiplier); swapCounter++)
 		{
 			R_xlen_t swap1, swap2;
-			getPairForSwap(n, swap1, swap2);
+			getPairForSwap(n, swap1, swap2, random);
 			double delta = computeDelta(bestPermutationThisRep, swap1, swap2, rawDist, levels, deltaComponents);
 			if(delta < 0)
 			{
@@ -680,7 +1263,7 @@ void arsaRawParallel(arsaRawArgs& args)
 				//swap
 				if(unif_rand() <= 0.5)
 				{
-					getPairForSwap(n, swap1, swap2);
+					getPairForSwap(n, swap1, swap2, random);
 					change newChange;
 					newChange.isMove = false;
 					newChange.swap1 = swap1; newChange.swap2 = swap2;
@@ -707,7 +1290,7 @@ void arsaRawParallel(arsaRawArgs& args)
 				//insertion
 				else
 				{
-					getPairForMove(n, swap1, swap2, maxMove);
+					getPairForMove(n, swap1, swap2, maxMove, random);
 					bool canDefer = true;
 					for(R_xlen_t i = std::min(swap1, swap2); i != std::max(swap1, swap2)+1; i++) canDefer &= !dirty[i];
 					change newChange;
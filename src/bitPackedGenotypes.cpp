@@ -0,0 +1,210 @@
+#include "bitPackedGenotypes.h"
+#include <stdexcept>
+#include <algorithm>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BIT_PACKED_X86_DISPATCH
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+namespace
+{
+	inline uint64_t popcountGeneric(uint64_t x)
+	{
+#if defined(__GNUC__)
+		return (uint64_t)__builtin_popcountll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+		return (uint64_t)__popcnt64(x);
+#else
+		x = x - ((x >> 1) & 0x5555555555555555ULL);
+		x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+		x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+		return (x * 0x0101010101010101ULL) >> 56;
+#endif
+	}
+	//Output is the number of lines observed for both markers, the number with allele 1 for both markers, the number with allele 1 for the first marker and observed for the second, and the number observed for the first marker with allele 1 for the second.
+	void countGeneric(const uint64_t* observed1, const uint64_t* allele1_1, const uint64_t* observed2, const uint64_t* allele1_2, std::size_t nWords, uint64_t* output)
+	{
+		uint64_t both = 0, ones = 0, firstOne = 0, secondOne = 0;
+		for(std::size_t i = 0; i < nWords; i++)
+		{
+			both += popcountGeneric(observed1[i] & observed2[i]);
+			ones += popcountGeneric(allele1_1[i] & allele1_2[i]);
+			firstOne += popcountGeneric(allele1_1[i] & observed2[i]);
+			secondOne += popcountGeneric(observed1[i] & allele1_2[i]);
+		}
+		output[0] = both; output[1] = ones; output[2] = firstOne; output[3] = secondOne;
+	}
+#ifdef BIT_PACKED_X86_DISPATCH
+	//Same as countGeneric, but compiled so that __builtin_popcountll becomes the popcnt instruction
+	__attribute__((target("popcnt"))) void countPopcnt(const uint64_t* observed1, const uint64_t* allele1_1, const uint64_t* observed2, const uint64_t* allele1_2, std::size_t nWords, uint64_t* output)
+	{
+		uint64_t both = 0, ones = 0, firstOne = 0, secondOne = 0;
+		for(std::size_t i = 0; i < nWords; i++)
+		{
+			both += (uint64_t)__builtin_popcountll(observed1[i] & observed2[i]);
+			ones += (uint64_t)__builtin_popcountll(allele1_1[i] & allele1_2[i]);
+			firstOne += (uint64_t)__builtin_popcountll(allele1_1[i] & observed2[i]);
+			secondOne += (uint64_t)__builtin_popcountll(observed1[i] & allele1_2[i]);
+		}
+		output[0] = both; output[1] = ones; output[2] = firstOne; output[3] = secondOne;
+	}
+	//Popcount of each byte using a nibble lookup table, then summed into 64-bit lanes.
+	__attribute__((target("avx2"))) inline __m256i popcountAVX2(__m256i value)
+	{
+		const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+		const __m256i lowMask = _mm256_set1_epi8(0x0f);
+		__m256i low = _mm256_and_si256(value, lowMask);
+		__m256i high = _mm256_and_si256(_mm256_srli_epi16(value, 4), lowMask);
+		__m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, low), _mm256_shuffle_epi8(lookup, high));
+		return _mm256_sad_epu8(bytes, _mm256_setzero_si256());
+	}
+	__attribute__((target("avx2"))) inline uint64_t horizontalSumAVX2(__m256i value)
+	{
+		__m128i sum = _mm_add_epi64(_mm256_castsi256_si128(value), _mm256_extracti128_si256(value, 1));
+		return (uint64_t)_mm_cvtsi128_si64(sum) + (uint64_t)_mm_extract_epi64(sum, 1);
+	}
+	__attribute__((target("avx2,popcnt"))) void countAVX2(const uint64_t* observed1, const uint64_t* allele1_1, const uint64_t* observed2, const uint64_t* allele1_2, std::size_t nWords, uint64_t* output)
+	{
+		__m256i both = _mm256_setzero_si256(), ones = _mm256_setzero_si256(), firstOne = _mm256_setzero_si256(), secondOne = _mm256_setzero_si256();
+		std::size_t i = 0;
+		for(; i + 4 <= nWords; i += 4)
+		{
+			__m256i o1 = _mm256_loadu_si256((const __m256i*)(observed1 + i));
+			__m256i a1 = _mm256_loadu_si256((const __m256i*)(allele1_1 + i));
+			__m256i o2 = _mm256_loadu_si256((const __m256i*)(observed2 + i));
+			__m256i a2 = _mm256_loadu_si256((const __m256i*)(allele1_2 + i));
+			both = _mm256_add_epi64(both, popcountAVX2(_mm256_and_si256(o1, o2)));
+			ones = _mm256_add_epi64(ones, popcountAVX2(_mm256_and_si256(a1, a2)));
+			firstOne = _mm256_add_epi64(firstOne, popcountAVX2(_mm256_and_si256(a1, o2)));
+			secondOne = _mm256_add_epi64(secondOne, popcountAVX2(_mm256_and_si256(o1, a2)));
+		}
+		uint64_t tail[4];
+		countPopcnt(observed1 + i, allele1_1 + i, observed2 + i, allele1_2 + i, nWords - i, tail);
+		output[0] = horizontalSumAVX2(both) + tail[0];
+		output[1] = horizontalSumAVX2(ones) + tail[1];
+		output[2] = horizontalSumAVX2(firstOne) + tail[2];
+		output[3] = horizontalSumAVX2(secondOne) + tail[3];
+	}
+	__attribute__((target("avx512f"))) inline uint64_t horizontalSumAVX512(__m512i value)
+	{
+		uint64_t lanes[8];
+		_mm512_storeu_si512((void*)lanes, value);
+		return lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] + lanes[7];
+	}
+	__attribute__((target("avx512f,avx512vpopcntdq"))) void countAVX512(const uint64_t* observed1, const uint64_t* allele1_1, const uint64_t* observed2, const uint64_t* allele1_2, std::size_t nWords, uint64_t* output)
+	{
+		__m512i both = _mm512_setzero_si512(), ones = _mm512_setzero_si512(), firstOne = _mm512_setzero_si512(), secondOne = _mm512_setzero_si512();
+		for(std::size_t i = 0; i < nWords; i += 8)
+		{
+			__mmask8 mask = (nWords - i >= 8) ? (__mmask8)0xff : (__mmask8)((1U << (nWords - i)) - 1U);
+			__m512i o1 = _mm512_maskz_loadu_epi64(mask, observed1 + i);
+			__m512i a1 = _mm512_maskz_loadu_epi64(mask, allele1_1 + i);
+			__m512i o2 = _mm512_maskz_loadu_epi64(mask, observed2 + i);
+			__m512i a2 = _mm512_maskz_loadu_epi64(mask, allele1_2 + i);
+			both = _mm512_add_epi64(both, _mm512_popcnt_epi64(_mm512_and_si512(o1, o2)));
+			ones = _mm512_add_epi64(ones, _mm512_popcnt_epi64(_mm512_and_si512(a1, a2)));
+			firstOne = _mm512_add_epi64(firstOne, _mm512_popcnt_epi64(_mm512_and_si512(a1, o2)));
+			secondOne = _mm512_add_epi64(secondOne, _mm512_popcnt_epi64(_mm512_and_si512(o1, a2)));
+		}
+		output[0] = horizontalSumAVX512(both);
+		output[1] = horizontalSumAVX512(ones);
+		output[2] = horizontalSumAVX512(firstOne);
+		output[3] = horizontalSumAVX512(secondOne);
+	}
+#endif
+}
+bitPackedGenotypes::modeType bitPackedGenotypes::mode = bitPackedGenotypes::automaticMode;
+bool bitPackedGenotypes::shouldUse(const std::vector<int>& lineClasses, int nClasses)
+{
+	if(mode == neverPacked) return false;
+	if(mode == alwaysPackedPortable || mode == alwaysPackedFastest) return true;
+	return worthwhile(lineClasses, nClasses);
+}
+bool bitPackedGenotypes::worthwhile(const std::vector<int>& lineClasses, int nClasses)
+{
+	std::vector<std::size_t> classSizes(nClasses, 0);
+	for(std::vector<int>::const_iterator i = lineClasses.begin(); i != lineClasses.end(); i++) classSizes[*i]++;
+	std::size_t nWords = 0;
+	for(int i = 0; i < nClasses; i++) nWords += (classSizes[i] + 63) / 64;
+	//The scalar code does one pass over the lines. Each word here requires four popcounts, so require that on average each word is at least a quarter full.
+	return nWords * 16 <= lineClasses.size();
+}
+bitPackedGenotypes::bitPackedGenotypes(Rcpp::IntegerMatrix finals, const std::vector<int>& lineClasses, int nClasses)
+	: nClasses(nClasses), classWordStart(nClasses + 1, 0), kernel(&countGeneric)
+{
+	int nFinals = finals.nrow(), nMarkers = finals.ncol();
+	if((int)lineClasses.size() != nFinals) throw std::runtime_error("Internal error");
+	std::vector<std::size_t> classSizes(nClasses, 0);
+	for(int line = 0; line < nFinals; line++) classSizes[lineClasses[line]]++;
+	for(int i = 0; i < nClasses; i++) classWordStart[i+1] = classWordStart[i] + (classSizes[i] + 63) / 64;
+	wordsPerMarker = classWordStart[nClasses];
+	//Bit position of every line, in the re-ordered data
+	std::vector<std::size_t> linePositions(nFinals), nextPosition(nClasses);
+	for(int i = 0; i < nClasses; i++) nextPosition[i] = classWordStart[i] * 64;
+	for(int line = 0; line < nFinals; line++) linePositions[line] = nextPosition[lineClasses[line]]++;
+
+	observed.assign(wordsPerMarker * nMarkers, 0);
+	allele1.assign(wordsPerMarker * nMarkers, 0);
+	for(int marker = 0; marker < nMarkers; marker++)
+	{
+		uint64_t* observedMarker = &(observed[0]) + marker * wordsPerMarker;
+		uint64_t* allele1Marker = &(allele1[0]) + marker * wordsPerMarker;
+		for(int line = 0; line < nFinals; line++)
+		{
+			int value = finals(line, marker);
+			if(value == NA_INTEGER) continue;
+			if(value != 0 && value != 1) throw std::runtime_error("Internal error - Bit packed genotypes require at most two alleles per marker");
+			std::size_t position = linePositions[line];
+			uint64_t bit = (uint64_t)1 << (position % 64);
+			observedMarker[position / 64] |= bit;
+			if(value == 1) allele1Marker[position / 64] |= bit;
+		}
+	}
+#ifdef BIT_PACKED_X86_DISPATCH
+	if(mode == alwaysPackedPortable) {}
+	else if(__builtin_cpu_supports("avx512vpopcntdq")) kernel = &countAVX512;
+	else if(__builtin_cpu_supports("avx2")) kernel = &countAVX2;
+	else if(__builtin_cpu_supports("popcnt")) kernel = &countPopcnt;
+#endif
+}
+void bitPackedGenotypes::countPair(int marker1, int marker2, int* counts) const
+{
+	const uint64_t* observed1 = &(observed[0]) + marker1 * wordsPerMarker, *observed2 = &(observed[0]) + marker2 * wordsPerMarker;
+	const uint64_t* allele1_1 = &(allele1[0]) + marker1 * wordsPerMarker, *allele1_2 = &(allele1[0]) + marker2 * wordsPerMarker;
+	uint64_t output[4];
+	for(int currentClass = 0; currentClass < nClasses; currentClass++)
+	{
+		std::size_t start = classWordStart[currentClass], nWords = classWordStart[currentClass+1] - start;
+		if(nWords == 0)
+		{
+			counts[currentClass] = counts[nClasses + currentClass] = counts[2*nClasses + currentClass] = counts[3*nClasses + currentClass] = 0;
+			continue;
+		}
+		kernel(observed1 + start, allele1_1 + start, observed2 + start, allele1_2 + start, nWords, output);
+		int both = (int)output[0], ones = (int)output[1], oneZero = (int)(output[2] - output[1]), zeroOne = (int)(output[3] - output[1]);
+		counts[currentClass] = both - ones - oneZero - zeroOne;
+		counts[nClasses + currentClass] = zeroOne;
+		counts[2*nClasses + currentClass] = oneZero;
+		counts[3*nClasses + currentClass] = ones;
+	}
+}
+SEXP bitPackedGenotypesMode(SEXP mode_)
+{
+BEGIN_RCPP
+	int mode;
+	try
+	{
+		mode = Rcpp::as<int>(mode_);
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Input mode must be an integer");
+	}
+	if(mode < 0 || mode > 3) throw std::runtime_error("Input mode must be 0, 1, 2 or 3");
+	int previous = bitPackedGenotypes::mode;
+	bitPackedGenotypes::mode = (bitPackedGenotypes::modeType)mode;
+	return Rcpp::wrap(previous);
+END_RCPP
+}
@@ -0,0 +1,47 @@
+#ifndef BIT_PACKED_GENOTYPES_HEADER_GUARD
+#define BIT_PACKED_GENOTYPES_HEADER_GUARD
+#include <Rcpp.h>
+#include <vector>
+#include <cstdint>
+/* Bit-packed storage of bi-allelic genotype data, for fast computation of the 2x2 tables of genotype pair counts.
+ *
+ * Every line is assigned to a class (E.g. a combination of funnel and number of selfing generations). Lines are re-ordered so that the lines of each class are contiguous, and each class starts on a 64-bit word boundary. For every marker we store a bitset indicating which lines have an observed value, and a bitset indicating which lines have allele 1. Allele 0 is then the observed lines which do not have allele 1.
+ *
+ * The counts for a pair of markers are computed with AND and popcount over the words of each class. The popcount kernel is selected at runtime, depending on whether the CPU supports AVX-512, AVX2 or the popcnt instruction.
+ */
+class bitPackedGenotypes
+{
+public:
+	/* @param finals The recoded genotype data. Every value must be 0, 1 or NA.
+	 * @param lineClasses The class of every line, which must be in [0, nClasses).
+	 * @param nClasses The number of classes
+	 */
+	bitPackedGenotypes(Rcpp::IntegerMatrix finals, const std::vector<int>& lineClasses, int nClasses);
+	/* Compute the table of genotype pair counts for a pair of markers.
+	 *
+	 * On exit counts[(allele1 * 2 + allele2) * nClasses + class] contains the number of lines of the specified class which have value allele1 for the first marker and allele2 for the second marker. Every entry is overwritten.
+	 */
+	void countPair(int marker1, int marker2, int* counts) const;
+	/* Padding every class to a word boundary wastes space when there are many small classes (E.g. designs with many funnels and few lines per funnel). In that case it's better to use the unpacked data.
+	 */
+	static bool worthwhile(const std::vector<int>& lineClasses, int nClasses);
+	/* Normally the packed data is used whenever it's worthwhile, with the fastest kernel the CPU supports. For testing this can be overridden, so that the scalar code and every kernel can be compared on the same data.
+	 */
+	enum modeType
+	{
+		automaticMode = 0, neverPacked = 1, alwaysPackedPortable = 2, alwaysPackedFastest = 3
+	};
+	static modeType mode;
+	//Whether to use the packed data, taking into account the current mode
+	static bool shouldUse(const std::vector<int>& lineClasses, int nClasses);
+private:
+	int nClasses;
+	std::size_t wordsPerMarker;
+	//The words for class i are [classWordStart[i], classWordStart[i+1])
+	std::vector<std::size_t> classWordStart;
+	std::vector<uint64_t> observed, allele1;
+	typedef void (*countFunction)(const uint64_t* observed1, const uint64_t* allele1_1, const uint64_t* observed2, const uint64_t* allele1_2, std::size_t nWords, uint64_t* output);
+	countFunction kernel;
+};
+SEXP bitPackedGenotypesMode(SEXP mode);
+#endif
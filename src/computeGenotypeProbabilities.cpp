@@ -15,7 +15,8 @@
 #include "forwardsBackwards.hpp"
 #include "recodeHetsAsNA.h"
 #include "impossibleDataException.h"
-template<int nFounders, bool infiniteSelfing> void computeFounderGenotypesInternal2(Rcpp::IntegerMatrix founders, Rcpp::IntegerMatrix finals, Rcpp::S4 pedigree, Rcpp::List hetData, Rcpp::List map, Rcpp::NumericMatrix results, double homozygoteMissingProb, double heterozygoteMissingProb, Rcpp::IntegerMatrix key)
+#include "genotypeProbabilitiesOutput.hpp"
+template<int nFounders, bool infiniteSelfing> void computeFounderGenotypesInternal2(Rcpp::IntegerMatrix founders, Rcpp::IntegerMatrix finals, Rcpp::S4 pedigree, Rcpp::List hetData, Rcpp::List map, genotypeProbabilitiesOutput& results, double homozygoteMissingProb, double heterozygoteMissingProb, Rcpp::IntegerMatrix key)
 {
 	//Work out maximum number of markers per chromosome
 	int maxChromosomeMarkers = 0;
@@ -177,7 +178,7 @@ template<int nFounders, bool infiniteSelfing> void computeFounderGenotypesIntern
 		cumulativeMarkerCounter += (int)positions.size();
 	}
 }
-template<int nFounders> void computeGenotypeProbabilitiesInternal1(Rcpp::IntegerMatrix founders, Rcpp::IntegerMatrix finals, Rcpp::S4 pedigree, Rcpp::List hetData, Rcpp::List map, Rcpp::NumericMatrix results, bool infiniteSelfing, double homozygoteMissingProb, double heterozygoteMissingProb, Rcpp::IntegerMatrix key)
+template<int nFounders> void computeGenotypeProbabilitiesInternal1(Rcpp::IntegerMatrix founders, Rcpp::IntegerMatrix finals, Rcpp::S4 pedigree, Rcpp::List hetData, Rcpp::List map, genotypeProbabilitiesOutput& results, bool infiniteSelfing, double homozygoteMissingProb, double heterozygoteMissingProb, Rcpp::IntegerMatrix key)
 {
 	if(infiniteSelfing)
 	{
@@ -188,7 +189,7 @@ template<int nFounders> void computeGenotypeProbabilitiesInternal1(Rcpp::Integer
 		computeFounderGenotypesInternal2<nFounders, false>(founders, finals, pedigree, hetData, map, results, homozygoteMissingProb, heterozygoteMissingProb, key);
 	}
 }
-SEXP computeGenotypeProbabilities(SEXP geneticData_sexp, SEXP map_sexp, SEXP homozygoteMissingProb_sexp, SEXP heterozygoteMissingProb_sexp)
+SEXP computeGenotypeProbabilities(SEXP geneticData_sexp, SEXP map_sexp, SEXP homozygoteMissingProb_sexp, SEXP heterozygoteMissingProb_sexp, SEXP encoding_sexp)
 {
 BEGIN_RCPP
 	Rcpp::S4 geneticData;
@@ -296,6 +297,18 @@ BEGIN_RCPP
 	}
 	if(heterozygoteMissingProb < 0 || heterozygoteMissingProb > 1) throw std::runtime_error("Input heterozygoteMissingProb must be a number between 0 and 1");
 
+	probabilitiesEncoding encoding;
+	std::string encodingName;
+	try
+	{
+		encodingName = Rcpp::as<std::string>(encoding_sexp);
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Input encoding must be a string");
+	}
+	if(!genotypeProbabilitiesOutput::parseEncoding(encodingName, encoding)) throw std::runtime_error("Input encoding must be one of \"double\", \"float\", \"uint16\" or \"uint8\"");
+
 	std::vector<std::string> foundersMarkers = Rcpp::as<std::vector<std::string> >(Rcpp::colnames(founders));
 	std::vector<std::string> finalsMarkers = Rcpp::as<std::vector<std::string> >(Rcpp::colnames(finals));
 	std::vector<std::string> lineNames = Rcpp::as<std::vector<std::string> >(Rcpp::rownames(finals));
@@ -362,15 +375,16 @@ BEGIN_RCPP
 	}
 
 	int nFinals = finals.nrow();
-	Rcpp::NumericMatrix results;
+	int nGenotypes;
 	if(!infiniteSelfing)
 	{
-		results = Rcpp::NumericMatrix(nFinals*nFounders*(nFounders+1)/2, (int)mapMarkers.size());
+		nGenotypes = nFounders*(nFounders+1)/2;
 	}
 	else
 	{
-		results = Rcpp::NumericMatrix(nFinals*nFounders, (int)mapMarkers.size());
+		nGenotypes = nFounders;
 	}
+	genotypeProbabilitiesOutput results(encoding, nFinals*nGenotypes, (int)mapMarkers.size());
 	try
 	{
 		if(nFounders == 2)
@@ -400,7 +414,7 @@ BEGIN_RCPP
 		ss << "Impossible data may have been detected for markers " << mapMarkers[err.marker] << " and " << mapMarkers[err.marker+1] << " for line " << lineNames[err.line] << ". Are these markers at the same location, and if so does this line have a recombination event between these markers?"; 
 		throw std::runtime_error(ss.str().c_str());
 	}
-	return Rcpp::List::create(Rcpp::Named("data") = results, Rcpp::Named("key") = outputKey);
+	return Rcpp::List::create(Rcpp::Named("data") = results.data, Rcpp::Named("key") = outputKey);
 END_RCPP
 }
 
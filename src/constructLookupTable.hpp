@@ -4,48 +4,16 @@
 #include "probabilities.hpp"
 #include "intercrossingHaplotypeToMarker.hpp"
 #include "funnelHaplotypeToMarker.hpp"
-template<int maxAlleles> struct singleMarkerPairData
+#include "lookupTableCache.h"
+#include "lookupTable.h"
+#include <cstring>
+struct constructLookupTableArgs
 {
 public:
-	singleMarkerPairData(int nRecombLevels, int nDifferentFunnels, int nDifferentAIGenerations, int nDifferentSelfingGenerations)
-		: perFunnelData(nRecombLevels, nDifferentFunnels, nDifferentSelfingGenerations), perAIGenerationData(nRecombLevels, nDifferentAIGenerations, nDifferentSelfingGenerations), allowableFunnel(nDifferentFunnels, nDifferentSelfingGenerations), allowableAI(nDifferentAIGenerations, nDifferentSelfingGenerations)
+	constructLookupTableArgs(allMarkerPairData& computedContributions, markerPatternsToUniqueValuesArgs& markerPatternData)
+		: computedContributions(computedContributions), markerPatternData(markerPatternData), cache(NULL)
 	{}
-	void swap(singleMarkerPairData<maxAlleles>& other)
-	{
-		perFunnelData.swap(other.perFunnelData);
-		perAIGenerationData.swap(other.perAIGenerationData);
-		allowableFunnel.swap(other.allowableFunnel);
-		allowableAI.swap(other.allowableAI);
-	}
-	xMajorMatrix<array2<maxAlleles> > perFunnelData;
-	xMajorMatrix<array2<maxAlleles> > perAIGenerationData;
-
-	rowMajorMatrix<bool> allowableFunnel;
-	rowMajorMatrix<bool> allowableAI;
-};
-template<int maxAlleles> class allMarkerPairData : protected std::vector<singleMarkerPairData<maxAlleles> >
-{
-public:
-	typedef typename std::vector<singleMarkerPairData<maxAlleles> > parent;
-	allMarkerPairData(int nMarkerPatternIDs)
-		: parent((std::size_t)((nMarkerPatternIDs * nMarkerPatternIDs - nMarkerPatternIDs)/2 + nMarkerPatternIDs), singleMarkerPairData<maxAlleles> (0, 0, 0, 0))
-	{}
-	singleMarkerPairData<maxAlleles>& operator()(int markerPattern1ID, int markerPattern2ID)
-	{
-		if(markerPattern1ID < markerPattern2ID) std::swap(markerPattern1ID, markerPattern2ID);
-		//Ensure that nMarkerPattern1ID > nMarkerPattern2ID
-		int index = markerPattern1ID * (markerPattern1ID + 1) / 2;
-		index += markerPattern2ID;
-		return parent::operator[](index);
-	}
-};
-template<int maxAlleles> struct constructLookupTableArgs
-{
-public:
-	constructLookupTableArgs(allMarkerPairData<maxAlleles>& computedContributions, markerPatternsToUniqueValuesArgs& markerPatternData)
-		: computedContributions(computedContributions), markerPatternData(markerPatternData)
-	{}
-	allMarkerPairData<maxAlleles>& computedContributions;
+	allMarkerPairData& computedContributions;
 	markerPatternsToUniqueValuesArgs& markerPatternData;
 	std::vector<funnelEncoding>* lineFunnelEncodings;
 	std::vector<funnelEncoding>* allFunnelEncodings;
@@ -53,6 +21,8 @@ public:
 	const std::vector<double>* recombinationFractions;
 	std::vector<int>* intercrossingGenerations;
 	std::vector<int>* selfingGenerations;
+	//If not NULL, entries are taken from this cache where possible, and newly computed entries are added to it
+	lookupTableCache* cache;
 };
 template<int maxAlleles> bool isValid(std::vector<array2<maxAlleles> >& markerProbabilities, int nPoints, int nFirstMarkerAlleles, int nSecondMarkerAlleles, std::vector<double>& recombLevels)
 {
@@ -80,7 +50,20 @@ template<int maxAlleles> bool isValid(std::vector<array2<maxAlleles> >& markerPr
 	}
 	return true;
 }
-template<int nFounders, int maxAlleles, bool infiniteSelfing> void constructLookupTable(constructLookupTableArgs<maxAlleles>& args)
+//Copy the values computed for every recombination fraction into the lookup table, where the values for each pair of alleles are contiguous. destination is the start of the entry for the first pair of alleles. 
+template<int maxAlleles> void copyRecombValues(double* destination, const std::vector<array2<maxAlleles> >& recombValues, int nFirstAlleles, int nSecondAlleles)
+{
+	std::size_t nRecombLevels = recombValues.size();
+	for(int allele1 = 0; allele1 < nFirstAlleles; allele1++)
+	{
+		for(int allele2 = 0; allele2 < nSecondAlleles; allele2++)
+		{
+			for(std::size_t recombCounter = 0; recombCounter < nRecombLevels; recombCounter++) destination[recombCounter] = recombValues[recombCounter].values[allele1][allele2];
+			destination += nRecombLevels;
+		}
+	}
+}
+template<int nFounders, int maxAlleles, bool infiniteSelfing> void constructLookupTable(constructLookupTableArgs& args)
 {
 	int nMarkerPatternIDs = (int)args.markerPatternData.allMarkerPatterns.size();
 	int nRecombLevels = (int)args.recombinationFractions->size();
@@ -90,6 +73,29 @@ template<int nFounders, int maxAlleles, bool infiniteSelfing> void constructLook
 	int maxSelfing = *std::max_element(args.selfingGenerations->begin(), args.selfingGenerations->end());
 	int minSelfing = *std::min_element(args.selfingGenerations->begin(), args.selfingGenerations->end());
 
+	//Take whatever entries we can from the cache. Entry (firstPattern, secondPattern) is at index secondPattern*(secondPattern+1)/2 + firstPattern
+	std::vector<bool> cached;
+	if(args.cache)
+	{
+		std::size_t nMissing = 0;
+		cached.resize((std::size_t)nMarkerPatternIDs * (std::size_t)(nMarkerPatternIDs + 1) / 2, false);
+		for(int secondPattern = 0; secondPattern < nMarkerPatternIDs; secondPattern++)
+		{
+			const int* secondPatternValues = &(args.markerPatternData.allMarkerPatterns[secondPattern].hetData(0, 0));
+			for(int firstPattern = 0; firstPattern <= secondPattern; firstPattern++)
+			{
+				const int* firstPatternValues = &(args.markerPatternData.allMarkerPatterns[firstPattern].hetData(0, 0));
+				std::size_t entryBytes;
+				const unsigned char* entry = args.cache->find(firstPatternValues, secondPatternValues, entryBytes);
+				if(entry && args.computedContributions(firstPattern, secondPattern).deserialise(entry, entryBytes))
+				{
+					cached[(std::size_t)secondPattern * (std::size_t)(secondPattern + 1) / 2 + (std::size_t)firstPattern] = true;
+				}
+				else nMissing++;
+			}
+		}
+		if(nMissing == 0) return;
+	}
 	//Only compute the compressed haplotype probabilities once. This is for the no intercrossing case
 	typedef std::array<double, compressedProbabilities<nFounders, infiniteSelfing>::nDifferentProbs> compressedProbabilitiesType;
 	rowMajorMatrix<compressedProbabilitiesType> funnelHaplotypeProbabilities(nRecombLevels, maxSelfing-minSelfing+1);
@@ -135,6 +141,8 @@ template<int nFounders, int maxAlleles, bool infiniteSelfing> void constructLook
 #endif
 	{
 		std::vector<array2<maxAlleles> > markerProbabilities(nFinerPoints);
+		//The values for the input recombination fractions, before they're copied into the lookup table
+		std::vector<array2<maxAlleles> > recombValues(nRecombLevels);
 		//This next loop is a big chunk of code, but does NOT grow with problem size (number of markers, number of lines). Well, it grows but to some fixed limit, because there are only so many marker patterns. 
 #ifdef USE_OPENMP
 #pragma omp for schedule(dynamic)
@@ -144,9 +152,11 @@ template<int nFounders, int maxAlleles, bool infiniteSelfing> void constructLook
 			markerData& firstMarkerPatternData = args.markerPatternData.allMarkerPatterns[firstPattern];
 			for(int secondPattern = firstPattern; secondPattern < nMarkerPatternIDs; secondPattern++)
 			{
+				if(args.cache && cached[(std::size_t)secondPattern * (std::size_t)(secondPattern + 1) / 2 + (std::size_t)firstPattern]) continue;
 				markerData& secondMarkerPatternData = args.markerPatternData.allMarkerPatterns[secondPattern];
-				//The data for this pair of markers
-				singleMarkerPairData<maxAlleles> thisMarkerPairData(nRecombLevels, nDifferentFunnels, maxAIGenerations, maxSelfing - minSelfing + 1);
+				//The data for this pair of markers. This is cleared by the thread that computes it, so that the memory is first touched by that thread. 
+				singleMarkerPairData thisMarkerPairData = args.computedContributions(firstPattern, secondPattern);
+				thisMarkerPairData.clear();
 				for(int selfingCounter = minSelfing; selfingCounter <= maxSelfing; selfingCounter++)
 				{
 					//Compute marker probabilities for a finer grid. If me seem to see a repeated probability model (numerically, up to a tolerance), then in that particular situtation this pair of markers is no good
@@ -160,26 +170,42 @@ template<int nFounders, int maxAlleles, bool infiniteSelfing> void constructLook
 						intercrossingHaplotypeToMarker<nFounders, maxAlleles, infiniteSelfing>::template convert<false>(finerIntercrossingHaplotypeProbabilities, &(markerProbabilities[0]), intercrossingGeneration, firstMarkerPatternData, secondMarkerPatternData, selfingCounter - minSelfing, (*args.allFunnelEncodings)[0]);
 						thisMarkerPairData.allowableAI(intercrossingGeneration-1, selfingCounter - minSelfing) = isValid<maxAlleles>(markerProbabilities, nFinerPoints, firstMarkerPatternData.nObservedValues, secondMarkerPatternData.nObservedValues, finerRecombLevels);
 					}
-					//The next two loops relate to the input recombination fractions
+					//The next two loops relate to the input recombination fractions. Combinations which are not allowable are left as zero. 
 					for(int intercrossingGeneration = 1; intercrossingGeneration <= maxAIGenerations; intercrossingGeneration++)
 					{
-						array2<maxAlleles>* markerProbabilitiesThisIntercrossing = &(thisMarkerPairData.perAIGenerationData(0, intercrossingGeneration-1, selfingCounter - minSelfing));
 						if(thisMarkerPairData.allowableAI(intercrossingGeneration-1, selfingCounter - minSelfing))
 						{
-							intercrossingHaplotypeToMarker<nFounders, maxAlleles, infiniteSelfing>::template convert<true>(intercrossingHaplotypeProbabilities, markerProbabilitiesThisIntercrossing, intercrossingGeneration, firstMarkerPatternData, secondMarkerPatternData, selfingCounter - minSelfing, (*args.allFunnelEncodings)[0]);
+							memset(recombValues[0].values, 0, sizeof(array2<maxAlleles>)*nRecombLevels);
+							intercrossingHaplotypeToMarker<nFounders, maxAlleles, infiniteSelfing>::template convert<true>(intercrossingHaplotypeProbabilities, &(recombValues[0]), intercrossingGeneration, firstMarkerPatternData, secondMarkerPatternData, selfingCounter - minSelfing, (*args.allFunnelEncodings)[0]);
+							copyRecombValues(thisMarkerPairData.perAIGenerationData(intercrossingGeneration-1, selfingCounter - minSelfing, 0, 0), recombValues, firstMarkerPatternData.nObservedValues, secondMarkerPatternData.nObservedValues);
 						}
 					}
 					for(int funnelCounter = 0; funnelCounter < nDifferentFunnels; funnelCounter++)
 					{
-						array2<maxAlleles>* markerProbabilitiesThisFunnel = &(thisMarkerPairData.perFunnelData(0, funnelCounter, selfingCounter - minSelfing));
-						memset(markerProbabilitiesThisFunnel, 0, sizeof(array2<maxAlleles>));
 						if(thisMarkerPairData.allowableFunnel(funnelCounter, selfingCounter - minSelfing))
 						{
-							funnelHaplotypeToMarker<nFounders, maxAlleles, infiniteSelfing>::template convert<true>(funnelHaplotypeProbabilities, markerProbabilitiesThisFunnel, (*args.lineFunnelEncodings)[funnelCounter], firstMarkerPatternData, secondMarkerPatternData, selfingCounter - minSelfing);
+							memset(recombValues[0].values, 0, sizeof(array2<maxAlleles>)*nRecombLevels);
+							funnelHaplotypeToMarker<nFounders, maxAlleles, infiniteSelfing>::template convert<true>(funnelHaplotypeProbabilities, &(recombValues[0]), (*args.lineFunnelEncodings)[funnelCounter], firstMarkerPatternData, secondMarkerPatternData, selfingCounter - minSelfing);
+							copyRecombValues(thisMarkerPairData.perFunnelData(funnelCounter, selfingCounter - minSelfing, 0, 0), recombValues, firstMarkerPatternData.nObservedValues, secondMarkerPatternData.nObservedValues);
 						}
 					}
 				}
-				args.computedContributions(firstPattern, secondPattern).swap(thisMarkerPairData);
+			}
+		}
+	}
+	if(args.cache)
+	{
+		std::vector<unsigned char> serialised;
+		for(int secondPattern = 0; secondPattern < nMarkerPatternIDs; secondPattern++)
+		{
+			const int* secondPatternValues = &(args.markerPatternData.allMarkerPatterns[secondPattern].hetData(0, 0));
+			for(int firstPattern = 0; firstPattern <= secondPattern; firstPattern++)
+			{
+				if(cached[(std::size_t)secondPattern * (std::size_t)(secondPattern + 1) / 2 + (std::size_t)firstPattern]) continue;
+				singleMarkerPairData entry = args.computedContributions(firstPattern, secondPattern);
+				serialised.resize(entry.serialisedSize());
+				entry.serialise(&(serialised[0]));
+				args.cache->add(&(args.markerPatternData.allMarkerPatterns[firstPattern].hetData(0, 0)), secondPatternValues, &(serialised[0]), serialised.size());
 			}
 		}
 	}
@@ -23,12 +23,12 @@ BEGIN_RCPP
 	}
 
 	triangularIterator iterator(markerRows, markerColumns);
-	int counter = 0;
+	R_xlen_t counter = 0;
 	for(; !iterator.isDone(); iterator.next())
 	{
 		std::pair<int, int> markerPair = iterator.get();
-		int markerRow = markerPair.first, markerColumn = markerPair.second;
-		destinationData((markerColumn*(markerColumn-1))/2 + (markerRow - 1)) = source(counter);
+		R_xlen_t markerRow = markerPair.first, markerColumn = markerPair.second;
+		destinationData((markerColumn*(markerColumn-(R_xlen_t)1))/(R_xlen_t)2 + (markerRow - (R_xlen_t)1)) = source(counter);
 		counter++;
 	}
 	return R_NilValue;
@@ -0,0 +1,262 @@
+#include "estimateMapNNLS.h"
+#include "rawSymmetricMatrix.h"
+#include <vector>
+#include <string>
+#include <sstream>
+#include <cmath>
+#ifdef USE_OPENMP
+#include <omp.h>
+#endif
+/* A symmetric positive definite matrix with bandwidth bandwidth - 1. Entry (i, j) with j <= i is stored at i * bandwidth + (i - j). 
+ *
+ * For estimateMap this is A^T A, where every row of the design matrix A has ones for a run of at most bandwidth consecutive intervals. 
+ */
+struct bandedMatrix
+{
+	bandedMatrix(int n, int bandwidth)
+		: n(n), bandwidth(bandwidth), values((std::size_t)n * bandwidth, 0)
+	{}
+	double operator()(int i, int j) const
+	{
+		if(i < j) std::swap(i, j);
+		if(i - j >= bandwidth) return 0;
+		return values[(std::size_t)i * bandwidth + (i - j)];
+	}
+	int n, bandwidth;
+	std::vector<double> values;
+};
+/* Solve the restriction of Q x = c to the indices in subset, which must be sorted. The restriction of a banded matrix is banded with the same bandwidth, so this is a banded Cholesky decomposition. 
+ *
+ * @param factor Working storage
+ * @return False if the matrix was not numerically positive definite
+ */
+bool solveBandedSubset(const bandedMatrix& Q, const std::vector<double>& c, const std::vector<int>& subset, std::vector<double>& factor, std::vector<double>& solution)
+{
+	int size = (int)subset.size(), bandwidth = Q.bandwidth;
+	factor.assign((std::size_t)size * bandwidth, 0);
+	solution.resize(size);
+	for(int i = 0; i < size; i++)
+	{
+		for(int j = std::max(0, i - bandwidth + 1); j <= i; j++)
+		{
+			double sum = Q(subset[i], subset[j]);
+			for(int k = std::max(0, i - bandwidth + 1); k < j; k++)
+			{
+				if(j - k < bandwidth) sum -= factor[(std::size_t)i * bandwidth + (i - k)] * factor[(std::size_t)j * bandwidth + (j - k)];
+			}
+			if(j == i)
+			{
+				if(sum <= 0) return false;
+				factor[(std::size_t)i * bandwidth] = sqrt(sum);
+			}
+			else factor[(std::size_t)i * bandwidth + (i - j)] = sum / factor[(std::size_t)j * bandwidth];
+		}
+	}
+	//Forward substitution
+	for(int i = 0; i < size; i++)
+	{
+		double sum = c[subset[i]];
+		for(int k = std::max(0, i - bandwidth + 1); k < i; k++) sum -= factor[(std::size_t)i * bandwidth + (i - k)] * solution[k];
+		solution[i] = sum / factor[(std::size_t)i * bandwidth];
+	}
+	//Back substitution
+	for(int i = size - 1; i >= 0; i--)
+	{
+		double sum = solution[i];
+		for(int k = i + 1; k < std::min(size, i + bandwidth); k++) sum -= factor[(std::size_t)k * bandwidth + (k - i)] * solution[k];
+		solution[i] = sum / factor[(std::size_t)i * bandwidth];
+	}
+	return true;
+}
+/* Non-negative least squares, given the normal equations Q = A^T A and c = A^T b. This uses block principal pivoting (Kim and Park, 2011), which exchanges many variables between the free and constrained sets in each iteration, and terminates in a finite number of steps. 
+ *
+ * @return False if the algorithm failed
+ */
+bool bandedNNLS(const bandedMatrix& Q, const std::vector<double>& c, std::vector<double>& x)
+{
+	int n = Q.n;
+	double tolerance = 0;
+	for(int i = 0; i < n; i++) tolerance = std::max(tolerance, fabs(c[i]));
+	tolerance = 1e-10 * std::max(tolerance, 1.0);
+	//Initially every variable is free
+	std::vector<bool> isFree(n, true);
+	std::vector<int> freeIndices, infeasible;
+	std::vector<double> factor, solution, gradient(n);
+	int alpha = 3, beta = n + 1;
+	x.assign(n, 0);
+	for(long iteration = 0; iteration < 100L * n + 100; iteration++)
+	{
+		freeIndices.clear();
+		for(int i = 0; i < n; i++)
+		{
+			if(isFree[i]) freeIndices.push_back(i);
+		}
+		if(!solveBandedSubset(Q, c, freeIndices, factor, solution)) return false;
+		std::fill(x.begin(), x.end(), 0);
+		for(std::size_t i = 0; i < freeIndices.size(); i++) x[freeIndices[i]] = solution[i];
+		//The gradient Qx - c, for the constrained variables
+		infeasible.clear();
+		for(int i = 0; i < n; i++)
+		{
+			if(isFree[i])
+			{
+				if(x[i] < -tolerance) infeasible.push_back(i);
+				continue;
+			}
+			double value = -c[i];
+			for(int j = std::max(0, i - Q.bandwidth + 1); j < std::min(n, i + Q.bandwidth); j++) value += Q(i, j) * x[j];
+			gradient[i] = value;
+			if(value < -tolerance) infeasible.push_back(i);
+		}
+		if(infeasible.size() == 0)
+		{
+			for(int i = 0; i < n; i++) x[i] = std::max(x[i], 0.0);
+			return true;
+		}
+		if((int)infeasible.size() < beta)
+		{
+			beta = (int)infeasible.size();
+			alpha = 3;
+		}
+		else if(alpha > 0) alpha--;
+		else
+		{
+			//Fall back to exchanging a single variable, which guarantees termination
+			int last = infeasible.back();
+			infeasible.assign(1, last);
+		}
+		for(std::vector<int>::iterator i = infeasible.begin(); i != infeasible.end(); i++) isFree[*i] = !isFree[*i];
+	}
+	return false;
+}
+/* Estimate the distances between adjacent markers of a single group, from the recombination fractions between markers at most maxOffset positions apart. 
+ *
+ * Each such pair (i, i + offset) gives an equation saying that the sum of the lengths of the intervals i, ..., i + offset - 1 is the mapped recombination fraction. These are solved by non-negative least squares, using the banded normal equations instead of the design matrix. 
+ */
+bool estimateGroupMap(const Rbyte* theta, int nMarkers, const std::vector<double>& mappedLevels, int maxOffset, std::vector<double>& positions, std::string& error)
+{
+	positions.assign(nMarkers, 0);
+	int nIntervals = nMarkers - 1;
+	if(nIntervals < 1) return true;
+	int bandwidth = std::min(maxOffset, nIntervals);
+	bandedMatrix Q(nIntervals, bandwidth);
+	//Entry (k, l) of A^T A is the number of runs that contain both intervals
+	for(int k = 0; k < nIntervals; k++)
+	{
+		for(int l = std::max(0, k - bandwidth + 1); l <= k; l++)
+		{
+			int count = 0;
+			for(int offset = k - l + 1; offset <= bandwidth; offset++)
+			{
+				int first = std::max(0, k - offset + 1), last = std::min(l, nIntervals - offset);
+				if(last >= first) count += last - first + 1;
+			}
+			Q.values[(std::size_t)k * bandwidth + (k - l)] = count;
+		}
+	}
+	//A^T b, accumulated as differences
+	std::vector<double> c(nIntervals + 1, 0);
+	for(int offset = 1; offset <= bandwidth; offset++)
+	{
+		for(int i = 0; i + offset < nMarkers; i++)
+		{
+			std::size_t column = i + offset;
+			Rbyte value = theta[(column * (column + 1)) / 2 + i];
+			if(value == 0xFF)
+			{
+				error = "Imputed recombination fractions cannot contain missing values";
+				return false;
+			}
+			c[i] += mappedLevels[value];
+			c[i + offset] -= mappedLevels[value];
+		}
+	}
+	for(int i = 1; i < nIntervals; i++) c[i] += c[i-1];
+	c.resize(nIntervals);
+	std::vector<double> lengths;
+	if(!bandedNNLS(Q, c, lengths))
+	{
+		error = "Non-negative least squares failed to converge";
+		return false;
+	}
+	for(int i = 0; i < nIntervals; i++) positions[i+1] = positions[i] + lengths[i];
+	return true;
+}
+SEXP estimateMapNNLS(SEXP imputedTheta_sexp, SEXP mappedLevels_sexp, SEXP maxOffset_sexp)
+{
+BEGIN_RCPP
+	Rcpp::List imputedTheta;
+	try
+	{
+		imputedTheta = Rcpp::as<Rcpp::List>(imputedTheta_sexp);
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Input imputedTheta must be a list");
+	}
+	Rcpp::List mappedLevelsList;
+	try
+	{
+		mappedLevelsList = Rcpp::as<Rcpp::List>(mappedLevels_sexp);
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Input mappedLevels must be a list");
+	}
+	if(mappedLevelsList.size() != imputedTheta.size())
+	{
+		throw std::runtime_error("Inputs imputedTheta and mappedLevels must have the same length");
+	}
+	int maxOffset;
+	try
+	{
+		maxOffset = Rcpp::as<int>(maxOffset_sexp);
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Input maxOffset must be an integer");
+	}
+	if(maxOffset < 1)
+	{
+		throw std::runtime_error("Input maxOffset must be positive");
+	}
+	//Extract everything from R before starting any threads
+	int nGroups = (int)imputedTheta.size();
+	std::vector<rawSymmetricMatrixData> thetaData(nGroups);
+	std::vector<int> nMarkers(nGroups);
+	std::vector<std::vector<double> > mappedLevels(nGroups);
+	for(int group = 0; group < nGroups; group++)
+	{
+		Rcpp::S4 currentTheta = Rcpp::as<Rcpp::S4>(imputedTheta(group));
+		thetaData[group] = rawSymmetricMatrixData(currentTheta);
+		nMarkers[group] = (int)Rcpp::as<Rcpp::CharacterVector>(currentTheta.slot("markers")).size();
+		mappedLevels[group] = Rcpp::as<std::vector<double> >(mappedLevelsList(group));
+		for(std::vector<double>::iterator i = mappedLevels[group].begin(); i != mappedLevels[group].end(); i++)
+		{
+			if(!std::isfinite(*i)) throw std::runtime_error("Input mappedLevels must contain finite values");
+		}
+	}
+	std::vector<std::vector<double> > positions(nGroups);
+	std::vector<std::string> errors(nGroups);
+	std::vector<char> succeeded(nGroups);
+#ifdef USE_OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for(int group = 0; group < nGroups; group++)
+	{
+		succeeded[group] = estimateGroupMap(thetaData[group].data(), nMarkers[group], mappedLevels[group], maxOffset, positions[group], errors[group]);
+	}
+	Rcpp::List result(nGroups);
+	for(int group = 0; group < nGroups; group++)
+	{
+		if(!succeeded[group])
+		{
+			std::stringstream ss;
+			ss << "Error in group " << (group + 1) << ": " << errors[group];
+			throw std::runtime_error(ss.str());
+		}
+		result(group) = Rcpp::wrap(positions[group]);
+	}
+	return result;
+END_RCPP
+}
@@ -0,0 +1,5 @@
+#ifndef ESTIMATE_MAP_NNLS_HEADER_GUARD
+#define ESTIMATE_MAP_NNLS_HEADER_GUARD
+#include <Rcpp.h>
+SEXP estimateMapNNLS(SEXP imputedTheta, SEXP mappedLevels, SEXP maxOffset);
+#endif
@@ -4,7 +4,9 @@
 #include "estimateRFSpecificDesign.h"
 #include <stdexcept>
 #include "matrixChunks.h"
-SEXP estimateRF(SEXP object_, SEXP recombinationFractions_, SEXP markerRows_, SEXP markerColumns_, SEXP lineWeights_, SEXP keepLod_, SEXP keepLkhd_, SEXP gbLimit_, SEXP verbose_)
+#include "mappedTriangularStore.h"
+#include <memory>
+SEXP estimateRF(SEXP object_, SEXP recombinationFractions_, SEXP markerRows_, SEXP markerColumns_, SEXP lineWeights_, SEXP keepLod_, SEXP keepLkhd_, SEXP gbLimit_, SEXP verbose_, SEXP tileSize_, SEXP spillFile_, SEXP spillBytes_, SEXP lookupCache_, SEXP adaptive_, SEXP screenThreshold_)
 {
 	BEGIN_RCPP
 		Rcpp::NumericVector recombinationFractions;
@@ -138,6 +140,69 @@ SEXP estimateRF(SEXP object_, SEXP recombinationFractions_, SEXP markerRows_, SE
 		{
 			throw std::runtime_error("Input verbose$progressStyle must be 1, 2 or 3");
 		}
+		int tileSize;
+		try
+		{
+			tileSize = Rcpp::as<int>(tileSize_);
+		}
+		catch(...)
+		{
+			throw std::runtime_error("Input tileSize must be a single integer");
+		}
+		if(tileSize < 0) throw std::runtime_error("Input tileSize must be a non-negative integer");
+		std::vector<std::string> spillFileVector;
+		try
+		{
+			spillFileVector = Rcpp::as<std::vector<std::string> >(spillFile_);
+		}
+		catch(...)
+		{
+			throw std::runtime_error("Input spillFile must be a character vector");
+		}
+		if(spillFileVector.size() > 1) throw std::runtime_error("Input spillFile must have length zero or one");
+		bool spill = spillFileVector.size() == 1;
+		int spillBytes;
+		try
+		{
+			spillBytes = Rcpp::as<int>(spillBytes_);
+		}
+		catch(...)
+		{
+			throw std::runtime_error("Input spillBytes must be a single integer");
+		}
+		if(spillBytes != 4 && spillBytes != 8) throw std::runtime_error("Input spillBytes must be 4 or 8");
+		std::vector<std::string> lookupCacheVector;
+		try
+		{
+			lookupCacheVector = Rcpp::as<std::vector<std::string> >(lookupCache_);
+		}
+		catch(...)
+		{
+			throw std::runtime_error("Input lookupCache must be a character vector");
+		}
+		if(lookupCacheVector.size() > 1) throw std::runtime_error("Input lookupCache must have length zero or one");
+		bool adaptive;
+		try
+		{
+			adaptive = Rcpp::as<bool>(adaptive_);
+		}
+		catch(...)
+		{
+			throw std::runtime_error("Input adaptive must be a boolean");
+		}
+		std::vector<double> screenThresholdVector;
+		try
+		{
+			screenThresholdVector = Rcpp::as<std::vector<double> >(screenThreshold_);
+		}
+		catch(...)
+		{
+			throw std::runtime_error("Input screenThreshold must be a numeric vector");
+		}
+		if(screenThresholdVector.size() > 1) throw std::runtime_error("Input screenThreshold must have length zero or one");
+		bool screen = screenThresholdVector.size() == 1;
+		double screenThreshold = screen ? screenThresholdVector[0] : 1;
+		if(screen && !(screenThreshold > 0 && screenThreshold < 1)) throw std::runtime_error("Input screenThreshold must be between 0 and 1");
 		if(nDesigns <= 0) throw std::runtime_error("There must be at least one design");
 		if(markerRows.size() == 0) throw std::runtime_error("Input markerRows must have at least one entry");
 		if(markerColumns.size() == 0) throw std::runtime_error("Input markerColumns must have at least one entry");
@@ -184,7 +249,7 @@ SEXP estimateRF(SEXP object_, SEXP recombinationFractions_, SEXP markerRows_, SE
 			}
 		}
 		//Construct vector of rfhaps_internal_args objects
-		triangularIterator startPosition(markerRows, markerColumns);
+		triangularIndex pairIndex(markerRows, markerColumns);
 		std::vector<rfhaps_internal_args> internalArgumentObjects;
 		for(int i = 0; i < nDesigns; i++)
 		{
@@ -234,7 +299,11 @@ SEXP estimateRF(SEXP object_, SEXP recombinationFractions_, SEXP markerRows_, SE
 			}
 			//This has to be copied / swapped in, because it's a local temporary at the moment
 			args.lineWeights.swap(lineWeightsThisDesign);
-			rfhaps_internal_args internalArgs(args.recombinationFractions, startPosition);
+			rfhaps_internal_args internalArgs(args.recombinationFractions, pairIndex);
+			internalArgs.tileSize = tileSize;
+			//The adaptive search leaves some values at -Inf, which would be wrong if the values for another design were added afterwards
+			internalArgs.adaptive = adaptive && nDesigns == 1;
+			if(lookupCacheVector.size() == 1) internalArgs.lookupCacheDirectory = lookupCacheVector[0];
 			bool converted = toInternalArgs(std::move(args), internalArgs, error);
 			if(!converted)
 			{
@@ -257,10 +326,35 @@ SEXP estimateRF(SEXP object_, SEXP recombinationFractions_, SEXP markerRows_, SE
 			Rcpp::Rcout << "Total lookup table size of " << lookupBytes << " bytes" << std::endl;
 		}
 		Rcpp::NumericVector lod, lkhd;
-		Rcpp::RawVector theta(nValuesToEstimate);
-		if(keepLod) lod = Rcpp::NumericVector(nValuesToEstimate);
-		if(keepLkhd) lkhd = Rcpp::NumericVector(nValuesToEstimate);
+		Rcpp::RawVector theta;
+		//In spill mode the results of every chunk are written straight into the file, so the full results are never held in memory
+		std::unique_ptr<mappedTriangularStore> spillStore;
+		if(spill)
+		{
+			spillStore.reset(new mappedTriangularStore(spillFileVector[0], nValuesToEstimate, keepLod ? spillBytes : 0, keepLkhd ? spillBytes : 0));
+		}
+		else
+		{
+			theta = Rcpp::RawVector(nValuesToEstimate);
+			if(keepLod) lod = Rcpp::NumericVector(nValuesToEstimate);
+			if(keepLkhd) lkhd = Rcpp::NumericVector(nValuesToEstimate);
+		}
+		//Non-zero for pairs which were screened out. This is held in memory even in spill mode. 
+		Rcpp::RawVector screened;
+		if(screen) screened = Rcpp::RawVector(nValuesToEstimate);
 		double* resultPtr = &(result[0]);
+		//Working memory for the screening pass. skipPairs is non-zero for pairs in the current chunk which were screened out
+		std::vector<double> screenStatistics;
+		std::vector<int> screenDegreesOfFreedom;
+		std::vector<unsigned char> skipPairs;
+		if(screen)
+		{
+			screenStatistics.resize(valuesToEstimateInChunk);
+			screenDegreesOfFreedom.resize(valuesToEstimateInChunk);
+			skipPairs.resize(valuesToEstimateInChunk);
+		}
+		//The screening pass goes through every pair a second time
+		int nPasses = screen ? 2 : 1;
 
 		Rcpp::Function txtProgressBar("txtProgressBar");
 		Rcpp::Function setTxtProgressBar("setTxtProgressBar");
@@ -270,14 +364,14 @@ SEXP estimateRF(SEXP object_, SEXP recombinationFractions_, SEXP markerRows_, SE
 		if(verbose)
 		{
 			barHandle = txtProgressBar(Rcpp::Named("style") = progressStyle, Rcpp::Named("min") = 0, Rcpp::Named("max") = 1000, Rcpp::Named("initial") = 0);
-			updateProgress = [barHandle,nDesigns,nValuesToEstimate,setTxtProgressBar](unsigned long long value)
+			updateProgress = [barHandle,nDesigns,nPasses,nValuesToEstimate,setTxtProgressBar](unsigned long long value)
 				{
 					try
 					{
 #ifdef CUSTOM_STATIC_RCPP
-						setTxtProgressBar.topLevelExec(barHandle, (int)((double)(1000*value) / (double)(nDesigns*nValuesToEstimate)));
+						setTxtProgressBar.topLevelExec(barHandle, (int)((double)(1000*value) / (double)(nPasses*nDesigns*nValuesToEstimate)));
 #else
-						setTxtProgressBar(barHandle, (int)((double)(1000*value) / (double)(nDesigns*nValuesToEstimate)));
+						setTxtProgressBar(barHandle, (int)((double)(1000*value) / (double)(nPasses*nDesigns*nValuesToEstimate)));
 #endif
 					}
 					catch(...)
@@ -290,12 +384,38 @@ SEXP estimateRF(SEXP object_, SEXP recombinationFractions_, SEXP markerRows_, SE
 		{
 			R_xlen_t valuesToEstimateInCurrentChunk = std::min(valuesToEstimateInChunk, nValuesToEstimate - offset);
 			if(offset != 0) memset(resultPtr, 0, result.size() * sizeof(double));
+			//Screen out pairs with no evidence of association in any design. The statistics are summed over the designs. 
+			if(screen)
+			{
+				std::fill(screenStatistics.begin(), screenStatistics.end(), 0);
+				std::fill(screenDegreesOfFreedom.begin(), screenDegreesOfFreedom.end(), 0);
+				for(int i = 0; i < nDesigns; i++)
+				{
+					internalArgumentObjects[i].result = resultPtr;
+					internalArgumentObjects[i].valuesToEstimateInChunk = valuesToEstimateInCurrentChunk;
+					internalArgumentObjects[i].startIndex = offset;
+					internalArgumentObjects[i].updateProgress = updateProgress;
+					internalArgumentObjects[i].screenStatistics = &(screenStatistics[0]);
+					internalArgumentObjects[i].screenDegreesOfFreedom = &(screenDegreesOfFreedom[0]);
+					internalArgumentObjects[i].skipPairs = NULL;
+					bool successful = estimateRFSpecificDesign(internalArgumentObjects[i], counter);
+					if(!successful) throw std::runtime_error("Internal error");
+					internalArgumentObjects[i].screenStatistics = NULL;
+					internalArgumentObjects[i].screenDegreesOfFreedom = NULL;
+					internalArgumentObjects[i].skipPairs = &(skipPairs[0]);
+				}
+				//Pairs without any informative lines are still estimated, so that they are reported as NA in the same way as before
+				for(R_xlen_t pairCounter = 0; pairCounter < valuesToEstimateInCurrentChunk; pairCounter++)
+				{
+					skipPairs[pairCounter] = screenDegreesOfFreedom[pairCounter] > 0 && R::pchisq(screenStatistics[pairCounter], screenDegreesOfFreedom[pairCounter], 0, 0) > screenThreshold;
+				}
+			}
 			//Now the actual computation)
 			for(int i = 0; i < nDesigns; i++)
 			{
 				internalArgumentObjects[i].result = resultPtr;
 				internalArgumentObjects[i].valuesToEstimateInChunk = valuesToEstimateInCurrentChunk;
-				internalArgumentObjects[i].startPosition = startPosition;
+				internalArgumentObjects[i].startIndex = offset;
 				internalArgumentObjects[i].updateProgress = updateProgress;
 				std::string error;
 				bool successful = estimateRFSpecificDesign(internalArgumentObjects[i], counter);
@@ -311,8 +431,16 @@ SEXP estimateRF(SEXP object_, SEXP recombinationFractions_, SEXP markerRows_, SE
 				double max = *maxPtr, min = *minPtr;
 				int currentTheta;
 				double currentLod;
+				//Pairs which were screened out are recorded as unlinked
+				if(screen && skipPairs[counter - offset])
+				{
+					max = std::numeric_limits<double>::quiet_NaN();
+					currentLod = 0;
+					currentTheta = halfIndex;
+					screened(counter) = 1;
+				}
 				//This is the case where no data was available, across any of the experiments. This is precise, no numerical error involved
-				if(max == 0 && min == 0)
+				else if(max == 0 && min == 0)
 				{
 					max = currentLod = std::numeric_limits<double>::quiet_NaN();
 					currentTheta = 0xff;
@@ -322,20 +450,33 @@ SEXP estimateRF(SEXP object_, SEXP recombinationFractions_, SEXP markerRows_, SE
 					currentTheta = (int)(maxPtr - start);
 					currentLod = max - resultPtr[(counter - offset)* (std::ptrdiff_t)nRecombLevels + halfIndex];
 				}
-				theta(counter) = currentTheta;
-				if(keepLkhd) lkhd(counter) = max;
-				if(keepLod) lod(counter) = currentLod;
-			}
-			while(valuesToEstimateInCurrentChunk > 0)
-			{
-				startPosition.next();
-				valuesToEstimateInCurrentChunk--;
+				if(spill)
+				{
+					spillStore->theta()[counter] = (Rbyte)currentTheta;
+					if(keepLkhd) spillStore->setLkhd(counter, max);
+					if(keepLod) spillStore->setLod(counter, currentLod);
+				}
+				else
+				{
+					theta(counter) = currentTheta;
+					if(keepLkhd) lkhd(counter) = max;
+					if(keepLod) lod(counter) = currentLod;
+				}
 			}
 		}
 		if(verbose)
 		{
 			close(barHandle);
 		}
+		Rcpp::RObject screenedRet;
+		if(screen) screenedRet = screened;
+		else screenedRet = R_NilValue;
+		if(spill)
+		{
+			spillStore->flush();
+			spillStore.reset();
+			return Rcpp::List::create(Rcpp::Named("theta") = R_NilValue, Rcpp::Named("lod") = R_NilValue, Rcpp::Named("lkhd") = R_NilValue, Rcpp::Named("r") = recombinationFractions, Rcpp::Named("file") = spillFileVector[0], Rcpp::Named("screened") = screenedRet);
+		}
 		Rcpp::RObject lodRet, lkhdRet;
 		
 		if(keepLod) lodRet = lod;
@@ -344,6 +485,6 @@ SEXP estimateRF(SEXP object_, SEXP recombinationFractions_, SEXP markerRows_, SE
 		if(keepLkhd) lkhdRet = lkhd;
 		else lkhdRet = R_NilValue;
 
-		return Rcpp::List::create(Rcpp::Named("theta") = theta, Rcpp::Named("lod") = lodRet, Rcpp::Named("lkhd") = lkhdRet, Rcpp::Named("r") = recombinationFractions);
+		return Rcpp::List::create(Rcpp::Named("theta") = theta, Rcpp::Named("lod") = lodRet, Rcpp::Named("lkhd") = lkhdRet, Rcpp::Named("r") = recombinationFractions, Rcpp::Named("screened") = screenedRet);
 	END_RCPP
 }
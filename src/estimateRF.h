@@ -17,7 +17,13 @@ struct funnelType
   * @param gbLimit The number of gigabytes to use for the results matrix. A value of negative 1 indicates no limit.
   * @param keepLkhd Boolean telling whether or not to return the maximum likelihood value
   * @param verbose Boolean telling whether or not to output diagnostic and progress information
+  * @param tileSize If positive, the pairs are processed in square blocks of tileSize x tileSize markers, which keeps the genotype data and lookup table entries for a block in cache. A value of 0 processes the pairs in column-major order.
+  * @param spillFile A character vector of length zero or one. If a file is given, the results are written to this file one chunk at a time, as a memory-mapped packed upper triangular matrix, instead of being returned as R vectors. 
+  * @param spillBytes The number of bytes (4 or 8) used to store every lod and lkhd value in spillFile.
+  * @param lookupCache A character vector of length zero or one. If a directory is given, the lookup table entries for every pair of marker patterns are cached in files in this directory, and re-used by later calls with the same design. 
+  * @param screenThreshold A numeric vector of length zero or one. If a value is given, every pair is first tested for association between the two markers, using a chi-squared test computed from the counts of the allele combinations. Pairs with a p-value above this threshold are not estimated, and are recorded as having a recombination fraction of 0.5 and a lod of 0, with lkhd NA. These pairs are marked by a non-zero value in the entry screened of the result, which is in the same order as theta. 
+  * @param adaptive Boolean telling whether to use a two-stage search over the recombination fractions, instead of evaluating every recombination fraction. This gives the same results whenever the likelihood is unimodal, and is ignored if there is more than one design. 
   * @return A list returning the specified data. In the case of theta, the values are returned as a raw vector. Each entry is an index into the possible recombination fractions. This saves us a factor of 8 in terms of memory usage. The raw vector is indexed column-major, but only contains the values for the upper triangular part of the matrix. 
  **/
-SEXP estimateRF(SEXP object, SEXP recombinationFractions, SEXP markerRows, SEXP markerColumns, SEXP lineWeights, SEXP keepLod, SEXP keepLkhd, SEXP gbLimit, SEXP verbose);
+SEXP estimateRF(SEXP object, SEXP recombinationFractions, SEXP markerRows, SEXP markerColumns, SEXP lineWeights, SEXP keepLod, SEXP keepLkhd, SEXP gbLimit, SEXP verbose, SEXP tileSize, SEXP spillFile, SEXP spillBytes, SEXP lookupCache, SEXP adaptive, SEXP screenThreshold);
 #endif
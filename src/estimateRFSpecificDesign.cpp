@@ -1,5 +1,6 @@
 #include "estimateRFSpecificDesign.h"
 #include <math.h>
+#include <algorithm>
 #include "intercrossingAndSelfingGenerations.h"
 #include "estimateRFCheckFunnels.h"
 #include <map>
@@ -15,257 +16,418 @@
 #include "recodeHetsAsNA.h"
 #include "estimateRF.h"
 #include "matrixChunks.h"
+#include "bitPackedGenotypes.h"
 #ifdef USE_OPENMP
 #include "mpMap2_openmp.h"
 #include <omp.h>
 #endif
-template<int nFounders, int maxAlleles, bool infiniteSelfing> bool estimateRFSpecificDesign(rfhaps_internal_args& args, unsigned long long& progressCounter)
+//Number of consecutive marker pairs assigned to a thread in one go
+const unsigned long long pairTileSize = 256;
+static unsigned long long countPairTiles(unsigned long long nPairs)
 {
-	std::size_t nFinals = args.finals.nrow(), nRecombLevels = args.recombinationFractions.size();
-	std::vector<double>& lineWeights = args.lineWeights;
-	Rcpp::List finalDimNames = args.finals.attr("dimnames");
-	Rcpp::CharacterVector finalNames = finalDimNames[0];
-
-	int nMarkerPatternIDs = (int)args.markerPatternData.allMarkerPatterns.size();
-	int minSelfing = *std::min_element(args.selfingGenerations.begin(), args.selfingGenerations.end());
-
-	//This is basically just a huge lookup table
-	allMarkerPairData<maxAlleles> computedContributions(nMarkerPatternIDs);
-	
-	constructLookupTableArgs<maxAlleles> lookupArgs(computedContributions, args.markerPatternData);
-	lookupArgs.recombinationFractions = &args.recombinationFractions;
-	lookupArgs.lineFunnelEncodings = &args.lineFunnelEncodings;
-	lookupArgs.intercrossingGenerations = &args.intercrossingGenerations;
-	lookupArgs.selfingGenerations = &args.selfingGenerations;
-	lookupArgs.allFunnelEncodings = &args.allFunnelEncodings;
-	constructLookupTable<nFounders, maxAlleles, infiniteSelfing>(lookupArgs);
-
-	//We parallelise this array, even though it's over an iterator not an integer. So we use an integer and use that to work out how many steps forwards we need to move the iterator. We assume that the values are strictly increasing, otherwise this will never work. 
-	//Use this to only call setTxtProgressBar every 10 calls to updateProgress. Probably no point in updating status more frequently than that.
-	unsigned long long updateProgressCounter = 0;
+	return (nPairs + pairTileSize - 1) / pairTileSize;
+}
+static inline void prefetchRead(const void* address)
+{
+#if defined(__GNUC__)
+	__builtin_prefetch(address, 0, 3);
+#else
+	(void)address;
+#endif
+}
+/* Call processPair(counter, markerRow, markerColumn, rowValues, columnValues) for every pair of markers in the current chunk, where counter is the index of the pair within the chunk and rowValues / columnValues point to the genotype data of the two markers.
+ *
+ * This must be called from within a parallel region, by every thread. The work is split using orphaned omp for constructs. 
+ *
+ * If blocks is empty the pairs are processed in the order of triangularIterator, in contiguous tiles of pairTileSize pairs. Otherwise each block of markers is processed in turn, with the genotype data for the markers of the block copied into the contiguous buffer blockData (one per thread). Before processing a pair, prefetchPair(markerRow, markerColumn) is called for the next pair of the block. 
+ */
+template<typename pairFunction, typename prefetchFunction> void forEachPairInChunk(const rfhaps_internal_args& args, const std::vector<markerBlock>& blocks, const int* finalsData, std::vector<int>& blockData, pairFunction& processPair, prefetchFunction& prefetchPair)
+{
+	const std::size_t nFinals = args.finals.nrow();
+	const unsigned long long chunkStart = args.startIndex, chunkEnd = args.startIndex + args.valuesToEstimateInChunk;
+	const triangularIndex& pairIndex = args.pairIndex;
+	if(blocks.size() == 0)
+	{
+		//The pairs in this chunk are split into contiguous tiles. Each thread jumps straight to the start of a tile using the triangular index, and then steps the iterator within the tile.
+		const long long nTiles = (long long)countPairTiles(args.valuesToEstimateInChunk);
 #ifdef USE_OPENMP
-	#pragma omp parallel 
+		#pragma omp for schedule(dynamic)
 #endif
+		for(long long tile = 0; tile < nTiles; tile++)
+		{
+			unsigned long long tileStart = tile * pairTileSize, tileEnd = std::min(args.valuesToEstimateInChunk, tileStart + pairTileSize);
+			triangularIterator indexIterator = pairIndex.iteratorAt(args.startIndex + tileStart);
+			for(unsigned long long counter = tileStart; counter < tileEnd; counter++, indexIterator.next())
+			{
+				std::pair<int, int> markerIndices = indexIterator.get();
+				processPair(counter, markerIndices.first, markerIndices.second, finalsData + (std::size_t)markerIndices.first * nFinals, finalsData + (std::size_t)markerIndices.second * nFinals);
+			}
+		}
+	}
+	else
 	{
-		triangularIterator indexIterator = args.startPosition;
-		unsigned long long previousCounter = 0;
 #ifdef USE_OPENMP
 		#pragma omp for schedule(dynamic)
 #endif
-		for(unsigned long long counter = 0; counter < args.valuesToEstimateInChunk; counter++)
+		for(long long blockCounter = 0; blockCounter < (long long)blocks.size(); blockCounter++)
 		{
-			signed long long difference = counter - previousCounter;
-			if(difference < 0LL) throw std::runtime_error("Internal error");
-			while(difference > 0LL) 
+			const markerBlock& block = blocks[blockCounter];
+			std::size_t nBlockRows = block.rowEnd - block.rowStart, nBlockColumns = block.columnEnd - block.columnStart;
+			//Stage the genotype data for this block. Rows first, then columns. 
+			blockData.resize((nBlockRows + nBlockColumns) * nFinals);
+			for(std::size_t rowPosition = block.rowStart; rowPosition < block.rowEnd; rowPosition++)
 			{
-				indexIterator.next();
-				difference--;
+				const int* source = finalsData + (std::size_t)pairIndex.rowMarker(rowPosition) * nFinals;
+				std::copy(source, source + nFinals, blockData.begin() + (rowPosition - block.rowStart) * nFinals);
 			}
-			previousCounter = counter;
-
-			std::pair<int, int> markerIndices = indexIterator.get();
-			int markerCounterRow = markerIndices.first, markerCounterColumn = markerIndices.second;
-
-			int markerPatternID1 = args.markerPatternData.markerPatternIDs[markerCounterRow];
-			int markerPatternID2 = args.markerPatternData.markerPatternIDs[markerCounterColumn];
-
-			singleMarkerPairData<maxAlleles>& markerPairData = computedContributions(markerPatternID1, markerPatternID2);
-			//We only calculated tabels for markerPattern1 <= markerPattern2. So if we want things the other way around we have to swap the data for markers 1 and 2 later on. 
-			bool swap = markerPatternID1 > markerPatternID2;
-			for(int recombCounter = 0; recombCounter < (int)nRecombLevels; recombCounter++)
+			for(std::size_t columnPosition = block.columnStart; columnPosition < block.columnEnd; columnPosition++)
 			{
-				for(int finalCounter = 0; finalCounter < (int)nFinals; finalCounter++)
+				const int* source = finalsData + (std::size_t)pairIndex.columnMarker(columnPosition) * nFinals;
+				std::copy(source, source + nFinals, blockData.begin() + (nBlockRows + columnPosition - block.columnStart) * nFinals);
+			}
+			for(std::size_t columnPosition = block.columnStart; columnPosition < block.columnEnd; columnPosition++)
+			{
+				unsigned long long columnStart = pairIndex.columnStart(columnPosition);
+				std::size_t rowEnd = std::min(block.rowEnd, pairIndex.columnCount(columnPosition));
+				int markerColumn = pairIndex.columnMarker(columnPosition);
+				const int* columnValues = &(blockData[0]) + (nBlockRows + columnPosition - block.columnStart) * nFinals;
+				for(std::size_t rowPosition = block.rowStart; rowPosition < rowEnd; rowPosition++)
 				{
-					int marker1Value = args.finals(finalCounter, markerCounterRow);
-					int marker2Value = args.finals(finalCounter, markerCounterColumn);
-					//If necessary swap the data
-					if(swap) std::swap(marker1Value, marker2Value);
-					if(marker1Value != NA_INTEGER && marker2Value != NA_INTEGER)
-					{
-						double contribution = 0;
-						bool allowable = false;
-						int intercrossingGenerations = args.intercrossingGenerations[finalCounter];
-						int selfingGenerations = args.selfingGenerations[finalCounter];
-						if(intercrossingGenerations == 0)
-						{
-							funnelID currentLineFunnelID = args.lineFunnelIDs[finalCounter];
-							allowable = markerPairData.allowableFunnel(currentLineFunnelID, selfingGenerations - minSelfing);
-							if(allowable)
-							{
-								array2<maxAlleles>& perMarkerGenotypeValues = markerPairData.perFunnelData(recombCounter, currentLineFunnelID, selfingGenerations - minSelfing);
-								contribution = perMarkerGenotypeValues.values[marker1Value][marker2Value];
-							}
-						}
-						else if(intercrossingGenerations > 0)
-						{
-							allowable = markerPairData.allowableAI(intercrossingGenerations-1, selfingGenerations - minSelfing);
-							if(allowable)
-							{
-								array2<maxAlleles>& perMarkerGenotypeValues = markerPairData.perAIGenerationData(recombCounter, intercrossingGenerations-1, selfingGenerations-minSelfing);
-								contribution = perMarkerGenotypeValues.values[marker1Value][marker2Value];
-							}
-						}
-						//We get an NA from trying to take the logarithm of zero - That is, this parameter is completely impossible for the given data, so put in -Inf
-						if(contribution != contribution || contribution == -std::numeric_limits<double>::infinity()) args.result[(long)counter *(long)nRecombLevels + (long)recombCounter] = -std::numeric_limits<double>::infinity();
-						else if(contribution != 0 && allowable) args.result[(long)counter * (long)nRecombLevels + (long)recombCounter] += lineWeights[finalCounter] * contribution;
-					}
+					unsigned long long index = columnStart + rowPosition;
+					if(index < chunkStart || index >= chunkEnd) continue;
+					if(rowPosition + 1 < rowEnd) prefetchPair(pairIndex.rowMarker(rowPosition + 1), markerColumn);
+					processPair(index - chunkStart, pairIndex.rowMarker(rowPosition), markerColumn, &(blockData[0]) + (rowPosition - block.rowStart) * nFinals, columnValues);
 				}
 			}
-#ifdef USE_OPENMP
-			#pragma omp critical
-#endif
+		}
+	}
+}
+//Construct the lookup table, using the on-disk cache if one was specified
+template<int nFounders, int maxAlleles, bool infiniteSelfing> void buildLookupTable(rfhaps_internal_args& args, allMarkerPairData& computedContributions)
+{
+	constructLookupTableArgs lookupArgs(computedContributions, args.markerPatternData);
+	lookupArgs.recombinationFractions = &args.recombinationFractions;
+	lookupArgs.lineFunnelEncodings = &args.lineFunnelEncodings;
+	lookupArgs.intercrossingGenerations = &args.intercrossingGenerations;
+	lookupArgs.selfingGenerations = &args.selfingGenerations;
+	lookupArgs.allFunnelEncodings = &args.allFunnelEncodings;
+	if(args.lookupCacheDirectory.empty())
+	{
+		constructLookupTable<nFounders, maxAlleles, infiniteSelfing>(lookupArgs);
+		return;
+	}
+	int maxAIGenerations = *std::max_element(args.intercrossingGenerations.begin(), args.intercrossingGenerations.end());
+	int minSelfing = *std::min_element(args.selfingGenerations.begin(), args.selfingGenerations.end());
+	int maxSelfing = *std::max_element(args.selfingGenerations.begin(), args.selfingGenerations.end());
+	std::vector<unsigned char> designKey = lookupTableDesignKey(nFounders, maxAlleles, infiniteSelfing, args.recombinationFractions, args.lineFunnelEncodings, args.allFunnelEncodings, maxAIGenerations, minSelfing, maxSelfing);
+	lookupTableCache cache(args.lookupCacheDirectory, designKey, nFounders*nFounders);
+	lookupArgs.cache = &cache;
+	constructLookupTable<nFounders, maxAlleles, infiniteSelfing>(lookupArgs);
+	if(!cache.save())
+	{
+		Rcpp::warning("Unable to write lookup table cache in directory %s", args.lookupCacheDirectory.c_str());
+	}
+}
+//A single entry of the lookup table (for every recombination fraction) which contributes to the likelihood of a pair of markers, and the number of lines (or the total weight) it applies to
+struct lookupTerm
+{
+	lookupTerm(const double* values, double multiple)
+		: values(values), multiple(multiple)
+	{}
+	const double* values;
+	double multiple;
+};
+static inline double sumTerms(const std::vector<lookupTerm>& terms, int recombCounter)
+{
+	double sum = 0;
+	for(std::vector<lookupTerm>::const_iterator term = terms.begin(); term != terms.end(); term++) sum += term->multiple * term->values[recombCounter];
+	return sum;
+}
+//Choose the levels used for the first stage of the adaptive search. These are evenly spaced, with spacing approximately sqrt(nRecombLevels / 2) so that the two stages take similar amounts of work, and always include the first and last levels and 0.5. If the grid is too small for this to help, coarseLevels is left empty. 
+static void getCoarseRecombLevels(const std::vector<double>& recombinationFractions, std::vector<int>& coarseLevels)
+{
+	coarseLevels.clear();
+	int nRecombLevels = (int)recombinationFractions.size();
+	int step = (int)(sqrt(nRecombLevels / 2.0) + 0.5);
+	if(step < 2) return;
+	for(int recombCounter = 0; recombCounter < nRecombLevels; recombCounter += step) coarseLevels.push_back(recombCounter);
+	coarseLevels.push_back(nRecombLevels - 1);
+	coarseLevels.push_back((int)std::distance(recombinationFractions.begin(), std::find(recombinationFractions.begin(), recombinationFractions.end(), 0.5)));
+	std::sort(coarseLevels.begin(), coarseLevels.end());
+	coarseLevels.erase(std::unique(coarseLevels.begin(), coarseLevels.end()), coarseLevels.end());
+}
+/* Evaluate the likelihood at the coarse levels, and then at every level between the neighbours of the best coarse level. The levels which are not evaluated are set to -Inf, so they are never chosen as the maximum. If the likelihood is unimodal over the grid, the maximum and the value at 0.5 are the same as for the full grid. 
+ *
+ * If the coarse levels all have the same value (for example, if there is no data for this pair) nothing is evaluated and false is returned, in which case the caller should evaluate every level.
+ */
+static bool evaluateAdaptive(const std::vector<lookupTerm>& terms, const std::vector<int>& coarseLevels, std::vector<double>& contributions)
+{
+	std::fill(contributions.begin(), contributions.end(), -std::numeric_limits<double>::infinity());
+	std::size_t bestCoarse = 0;
+	double max = 0, min = 0;
+	for(std::size_t coarseCounter = 0; coarseCounter < coarseLevels.size(); coarseCounter++)
+	{
+		double value = contributions[coarseLevels[coarseCounter]] = sumTerms(terms, coarseLevels[coarseCounter]);
+		//Impossible values are NaN here, but are -Inf in the final results
+		if(value != value) value = -std::numeric_limits<double>::infinity();
+		if(coarseCounter == 0 || value > max)
+		{
+			if(coarseCounter == 0) min = value;
+			max = value;
+			bestCoarse = coarseCounter;
+		}
+		min = std::min(min, value);
+	}
+	if(max == min) return false;
+	int lower = bestCoarse == 0 ? coarseLevels[0] : coarseLevels[bestCoarse - 1] + 1;
+	int upper = bestCoarse + 1 == coarseLevels.size() ? coarseLevels[bestCoarse] : coarseLevels[bestCoarse + 1] - 1;
+	for(int recombCounter = lower; recombCounter <= upper; recombCounter++) contributions[recombCounter] = sumTerms(terms, recombCounter);
+	return true;
+}
+/* Add Pearson's chi-squared statistic for independence of the alleles of the two markers to statistic, and the corresponding degrees of freedom to degreesOfFreedom. The statistic is computed separately for every class of lines (funnel or number of intercrossing generations, and number of selfing generations) and then summed, because the association between linked markers can differ between funnels. Classes and alleles without any lines don't contribute. 
+ */
+static void addScreenStatistic(const std::vector<int>& table, int nFirstAlleles, int nSecondAlleles, R_xlen_t product1, R_xlen_t product2, double& statistic, int& degreesOfFreedom)
+{
+	int rowTotals[64], columnTotals[64];
+	for(R_xlen_t classIndex = 0; classIndex < product2; classIndex++)
+	{
+		int total = 0;
+		std::fill(rowTotals, rowTotals + nFirstAlleles, 0);
+		std::fill(columnTotals, columnTotals + nSecondAlleles, 0);
+		for(int marker1Value = 0; marker1Value < nFirstAlleles; marker1Value++)
+		{
+			for(int marker2Value = 0; marker2Value < nSecondAlleles; marker2Value++)
 			{
-				progressCounter++;
+				int count = table[marker1Value*product1 + marker2Value*product2 + classIndex];
+				rowTotals[marker1Value] += count;
+				columnTotals[marker2Value] += count;
+				total += count;
 			}
-#ifdef USE_OPENMP
-			if(omp_get_thread_num() == 0)
-#endif
+		}
+		int nonZeroRows = (int)(nFirstAlleles - std::count(rowTotals, rowTotals + nFirstAlleles, 0)), nonZeroColumns = (int)(nSecondAlleles - std::count(columnTotals, columnTotals + nSecondAlleles, 0));
+		if(nonZeroRows < 2 || nonZeroColumns < 2) continue;
+		for(int marker1Value = 0; marker1Value < nFirstAlleles; marker1Value++)
+		{
+			if(rowTotals[marker1Value] == 0) continue;
+			for(int marker2Value = 0; marker2Value < nSecondAlleles; marker2Value++)
 			{
-				updateProgressCounter++;
-				if(updateProgressCounter % 100 == 0) args.updateProgress(progressCounter);
+				if(columnTotals[marker2Value] == 0) continue;
+				double expected = (double)rowTotals[marker1Value] * (double)columnTotals[marker2Value] / (double)total;
+				double difference = table[marker1Value*product1 + marker2Value*product2 + classIndex] - expected;
+				statistic += difference * difference / expected;
 			}
 		}
+		degreesOfFreedom += (nonZeroRows - 1) * (nonZeroColumns - 1);
 	}
-	return true;
 }
-template<int nFounders, int maxAlleles, bool infiniteSelfing> bool estimateRFSpecificDesignNoLineWeights(rfhaps_internal_args& args, unsigned long long& progressCounter)
+/* Compute the likelihoods by counting the lines with each combination of marker alleles, selfing generations and funnel (or number of intercrossing generations). Each entry of the lookup table is then used once per recombination fraction, rather than once per line.
+ *
+ * If weighted is true, the sum of the line weights is accumulated for each combination as well, and used in place of the count. The counts are still needed, so that a combination which has lines but a total weight of zero is still checked for impossible values. 
+ *
+ * If args.screenStatistics is not NULL, the lookup table is not built, and only the statistics used to screen out unlinked pairs are computed (see addScreenStatistic). 
+ */
+template<int nFounders, int maxAlleles, bool infiniteSelfing, bool weighted> bool estimateRFSpecificDesignCounts(rfhaps_internal_args& args, unsigned long long& progressCounter)
 {
+	const std::vector<double>& lineWeights = args.lineWeights;
 	std::size_t nFinals = args.finals.nrow(), nRecombLevels = args.recombinationFractions.size();
 	std::size_t nDifferentFunnels = args.lineFunnelEncodings.size();
 	Rcpp::List finalDimNames = args.finals.attr("dimnames");
 	Rcpp::CharacterVector finalNames = finalDimNames[0];
 
-	int nMarkerPatternIDs = (int)args.markerPatternData.allMarkerPatterns.size();
 	int maxAIGenerations = *std::max_element(args.intercrossingGenerations.begin(), args.intercrossingGenerations.end());
 	int minAIGenerations = *std::min_element(args.intercrossingGenerations.begin(), args.intercrossingGenerations.end());
 	int minSelfing = *std::min_element(args.selfingGenerations.begin(), args.selfingGenerations.end());
 	int maxSelfing = *std::max_element(args.selfingGenerations.begin(), args.selfingGenerations.end());
 
+	//If we're only screening the pairs, only the counts are needed
+	const bool screening = args.screenStatistics != NULL;
 	//This is basically just a huge lookup table
-	allMarkerPairData<maxAlleles> computedContributions(nMarkerPatternIDs);
-	
-	constructLookupTableArgs<maxAlleles> lookupArgs(computedContributions, args.markerPatternData);
-	lookupArgs.recombinationFractions = &args.recombinationFractions;
-	lookupArgs.lineFunnelEncodings = &args.lineFunnelEncodings;
-	lookupArgs.intercrossingGenerations = &args.intercrossingGenerations;
-	lookupArgs.selfingGenerations = &args.selfingGenerations;
-	lookupArgs.allFunnelEncodings = &args.allFunnelEncodings;
-	constructLookupTable<nFounders, maxAlleles, infiniteSelfing>(lookupArgs);
+	std::unique_ptr<allMarkerPairData> computedContributions;
+	if(!screening)
+	{
+		computedContributions.reset(new allMarkerPairData(args.markerPatternData.allMarkerPatterns, (int)nRecombLevels, (int)nDifferentFunnels, maxAIGenerations, maxSelfing - minSelfing + 1));
+		buildLookupTable<nFounders, maxAlleles, infiniteSelfing>(args, *computedContributions);
+	}
 
 	const R_xlen_t product1 = maxAlleles*(maxSelfing-minSelfing + 1) *(nDifferentFunnels + maxAIGenerations - minAIGenerations+1);
 	const R_xlen_t product2 = (maxSelfing - minSelfing + 1) *(nDifferentFunnels + maxAIGenerations - minAIGenerations + 1);
 	const R_xlen_t product3 = nDifferentFunnels + maxAIGenerations - minAIGenerations + 1;
 
-	//We parallelise this array, even though it's over an iterator not an integer. So we use an integer and use that to work out how many steps forwards we need to move the iterator. We assume that the values are strictly increasing, otherwise this will never work.
+	//For bi-allelic data the table can be computed from bit-packed genotypes, using popcount. Here a class is the value (selfingGenerations - minSelfing) * product3 + (ai OR funnel), so that the counts can be written straight into table. 
+	std::unique_ptr<bitPackedGenotypes> packedGenotypes;
+	if(maxAlleles == 2 && !weighted)
+	{
+		std::vector<int> lineClasses(nFinals);
+		bool allClassesValid = true;
+		for(int finalCounter = 0; finalCounter < (int)nFinals; finalCounter++)
+		{
+			int intercrossingGenerations = args.intercrossingGenerations[finalCounter];
+			int selfingGenerations = args.selfingGenerations[finalCounter];
+			if(intercrossingGenerations == 0) lineClasses[finalCounter] = (selfingGenerations - minSelfing)*product3 + args.lineFunnelIDs[finalCounter];
+			else if(intercrossingGenerations > 0) lineClasses[finalCounter] = (selfingGenerations - minSelfing)*product3 + nDifferentFunnels + intercrossingGenerations - minAIGenerations;
+			else allClassesValid = false;
+		}
+		if(allClassesValid && bitPackedGenotypes::shouldUse(lineClasses, (int)product2))
+		{
+			packedGenotypes.reset(new bitPackedGenotypes(args.finals, lineClasses, (int)product2));
+		}
+	}
+
+	std::vector<int> coarseLevels;
+	if(args.adaptive) getCoarseRecombLevels(args.recombinationFractions, coarseLevels);
+
+	const int* finalsData = &(args.finals(0, 0));
+	//If requested (and possible) process the pairs in square blocks of markers. The bit-packed data doesn't use the staged genotype data, but still benefits from the locality of the lookup table entries. 
+	std::vector<markerBlock> blocks;
+	if(args.tileSize > 0) args.pairIndex.getBlocks(args.startIndex, args.valuesToEstimateInChunk, args.tileSize, blocks);
 	//Use this to only call setTxtProgressBar every 10 calls to updateProgress. Probably no point in updating status more frequently than that.
 	unsigned long long updateProgressCounter = 0;
 #ifdef USE_OPENMP
 	#pragma omp parallel 
 #endif
 	{
-		triangularIterator indexIterator = args.startPosition;
 		//Indexing is of the form table[allele1 * product1 + allele2*product2 + selfingGenerations * product3 + (ai OR funnel)]. Funnels come first. 
 		std::vector<int> table(maxAlleles*product1);
-
-		int previousCounter = 0;
+		//The same, but containing the sum of the line weights. Only used if weighted is true. 
+		std::vector<double> weightTable(weighted ? maxAlleles*product1 : 0);
+		std::vector<int> blockData;
+		//The log-likelihood of every recombination level for the current pair
+		std::vector<double> contributions(nRecombLevels);
+		//The entries of the lookup table which contribute to the current pair
+		std::vector<lookupTerm> terms;
+		auto prefetchPair = [&](int markerCounterRow, int markerCounterColumn)
+		{
+			if(computedContributions) prefetchRead(computedContributions->valuesStart(args.markerPatternData.markerPatternIDs[markerCounterRow], args.markerPatternData.markerPatternIDs[markerCounterColumn]));
+		};
+		auto reportProgress = [&]()
+		{
 #ifdef USE_OPENMP
-		#pragma omp for schedule(dynamic)
+			#pragma omp critical
+#endif
+			{
+				progressCounter++;
+			}
+#ifdef USE_OPENMP
+			if(omp_get_thread_num() == 0)
 #endif
-		for(int counter = 0; counter < (int)args.valuesToEstimateInChunk; counter++)
+			{
+				updateProgressCounter++;
+				if(updateProgressCounter % 100 == 0) args.updateProgress(progressCounter);
+			}
+		};
+		auto processPair = [&](unsigned long long counter, int markerCounterRow, int markerCounterColumn, const int* rowValues, const int* columnValues)
 		{
-			std::fill(table.begin(), table.end(), 0);
-			int difference = counter - previousCounter;
-			if(difference < 0) throw std::runtime_error("Internal error");
-			while(difference > 0) 
+			//Pairs which were screened out are left as zero
+			if(args.skipPairs && args.skipPairs[counter])
 			{
-				indexIterator.next();
-				difference--;
+				reportProgress();
+				return;
 			}
-			previousCounter = counter;
-
-			std::pair<int, int> markerIndices = indexIterator.get();
-			int markerCounterRow = markerIndices.first, markerCounterColumn = markerIndices.second;
-
 			int markerPatternID1 = args.markerPatternData.markerPatternIDs[markerCounterRow];
 			int markerPatternID2 = args.markerPatternData.markerPatternIDs[markerCounterColumn];
 
-			singleMarkerPairData<maxAlleles>& markerPairData = computedContributions(markerPatternID1, markerPatternID2);
 			//We only calculated tabels for markerPattern1 <= markerPattern2. So if we want things the other way around we have to swap the data for markers 1 and 2 later on. 
 			bool swap = markerPatternID1 > markerPatternID2;
-			for(int finalCounter = 0; finalCounter < (int)nFinals; finalCounter++)
+			//This overwrites every entry of table, so there's no need to zero it.
+			if(packedGenotypes)
 			{
-				int marker1Value = args.finals(finalCounter, markerCounterRow);
-				int marker2Value = args.finals(finalCounter, markerCounterColumn);
-				//If necessary swap the data
-				if(swap) std::swap(marker1Value, marker2Value);
-				if(marker1Value != NA_INTEGER && marker2Value != NA_INTEGER)
+				if(swap) packedGenotypes->countPair(markerCounterColumn, markerCounterRow, &(table[0]));
+				else packedGenotypes->countPair(markerCounterRow, markerCounterColumn, &(table[0]));
+			}
+			else
+			{
+				std::fill(table.begin(), table.end(), 0);
+				if(weighted) std::fill(weightTable.begin(), weightTable.end(), 0);
+				for(int finalCounter = 0; finalCounter < (int)nFinals; finalCounter++)
 				{
-					int intercrossingGenerations = args.intercrossingGenerations[finalCounter];
-					int selfingGenerations = args.selfingGenerations[finalCounter];
-					if(intercrossingGenerations == 0)
-					{
-						funnelID currentLineFunnelID = args.lineFunnelIDs[finalCounter];
-						table[marker1Value*product1 + marker2Value*product2 + (selfingGenerations - minSelfing)*product3 + currentLineFunnelID]++;
-					}
-					else if(intercrossingGenerations > 0)
+					int marker1Value = rowValues[finalCounter];
+					int marker2Value = columnValues[finalCounter];
+					//If necessary swap the data
+					if(swap) std::swap(marker1Value, marker2Value);
+					if(marker1Value != NA_INTEGER && marker2Value != NA_INTEGER)
 					{
-						table[marker1Value*product1 + marker2Value*product2 + (selfingGenerations - minSelfing)*product3 + nDifferentFunnels + intercrossingGenerations - minAIGenerations]++;
+						int intercrossingGenerations = args.intercrossingGenerations[finalCounter];
+						int selfingGenerations = args.selfingGenerations[finalCounter];
+						R_xlen_t index;
+						if(intercrossingGenerations == 0)
+						{
+							funnelID currentLineFunnelID = args.lineFunnelIDs[finalCounter];
+							index = marker1Value*product1 + marker2Value*product2 + (selfingGenerations - minSelfing)*product3 + currentLineFunnelID;
+						}
+						else if(intercrossingGenerations > 0)
+						{
+							index = marker1Value*product1 + marker2Value*product2 + (selfingGenerations - minSelfing)*product3 + nDifferentFunnels + intercrossingGenerations - minAIGenerations;
+						}
+						else continue;
+						table[index]++;
+						if(weighted) weightTable[index] += lineWeights[finalCounter];
 					}
 				}
 			}
-			for(int recombCounter = 0; recombCounter < (int)nRecombLevels; recombCounter++)
+			if(screening)
+			{
+				const std::vector<markerData>& allMarkerPatterns = args.markerPatternData.allMarkerPatterns;
+				addScreenStatistic(table, allMarkerPatterns[std::min(markerPatternID1, markerPatternID2)].nObservedValues, allMarkerPatterns[std::max(markerPatternID1, markerPatternID2)].nObservedValues, product1, product2, args.screenStatistics[counter], args.screenDegreesOfFreedom[counter]);
+				reportProgress();
+				return;
+			}
+			const singleMarkerPairData markerPairData = (*computedContributions)(markerPatternID1, markerPatternID2);
+			//Only the alleles which can be observed for these marker patterns are stored, and every other entry of table is zero. 
+			terms.clear();
+			const int nFirstAlleles = markerPairData.getNFirstAlleles(), nSecondAlleles = markerPairData.getNSecondAlleles();
+			for(int selfingGenerations = minSelfing; selfingGenerations <= maxSelfing; selfingGenerations++)
 			{
-				double contribution = 0;
-				for(int selfingGenerations = minSelfing; selfingGenerations <= maxSelfing; selfingGenerations++)
+				for(int marker1Value = 0; marker1Value < nFirstAlleles; marker1Value++)
 				{
-					for(int marker1Value = 0; marker1Value < maxAlleles; marker1Value++)
+					for(int marker2Value = 0; marker2Value < nSecondAlleles; marker2Value++)
 					{
-						for(int marker2Value = 0; marker2Value < maxAlleles; marker2Value++)
+						for(int intercrossingGenerations = std::max(minAIGenerations,1); intercrossingGenerations <= maxAIGenerations; intercrossingGenerations++)
 						{
-							for(int intercrossingGenerations = std::max(minAIGenerations,1); intercrossingGenerations <= maxAIGenerations; intercrossingGenerations++)
+							R_xlen_t index = marker1Value*product1 + marker2Value * product2 + (selfingGenerations - minSelfing)*product3 + nDifferentFunnels + intercrossingGenerations - minAIGenerations;
+							int count = table[index];
+							if(count == 0) continue;
+							bool allowable = markerPairData.allowableAI(intercrossingGenerations-1, selfingGenerations - minSelfing);
+							if(allowable)
 							{
-								int count = table[marker1Value*product1 + marker2Value * product2 + (selfingGenerations - minSelfing)*product3 + nDifferentFunnels + intercrossingGenerations - minAIGenerations];
-								if(count == 0) continue;
-								bool allowable = markerPairData.allowableAI(intercrossingGenerations-1, selfingGenerations - minSelfing);
-								if(allowable)
-								{
-									array2<maxAlleles>& perMarkerGenotypeValues = markerPairData.perAIGenerationData(recombCounter, intercrossingGenerations-1, selfingGenerations - minSelfing);
-									contribution += count * perMarkerGenotypeValues.values[marker1Value][marker2Value];
-								}
+								const double* perRecombValues = markerPairData.perAIGenerationData(intercrossingGenerations-1, selfingGenerations - minSelfing, marker1Value, marker2Value);
+								terms.push_back(lookupTerm(perRecombValues, weighted ? weightTable[index] : count));
 							}
-							for(int funnelID = 0; funnelID < (int)nDifferentFunnels; funnelID++)
+						}
+						for(int funnelID = 0; funnelID < (int)nDifferentFunnels; funnelID++)
+						{
+							R_xlen_t index = marker1Value*product1 + marker2Value * product2 + (selfingGenerations - minSelfing)*product3 + funnelID;
+							int count = table[index];
+							if(count == 0) continue;
+							bool allowable = markerPairData.allowableFunnel(funnelID, selfingGenerations - minSelfing);
+							if(allowable)
 							{
-								int count = table[marker1Value*product1 + marker2Value * product2 + (selfingGenerations - minSelfing)*product3 + funnelID];
-								if(count == 0) continue;
-								bool allowable = markerPairData.allowableFunnel(funnelID, selfingGenerations - minSelfing);
-								if(allowable)
-								{
-									array2<maxAlleles>& perMarkerGenotypeValues = markerPairData.perFunnelData(recombCounter, funnelID, selfingGenerations - minSelfing);
-									contribution += count * perMarkerGenotypeValues.values[marker1Value][marker2Value];
-								}
+								const double* perRecombValues = markerPairData.perFunnelData(funnelID, selfingGenerations - minSelfing, marker1Value, marker2Value);
+								terms.push_back(lookupTerm(perRecombValues, weighted ? weightTable[index] : count));
 							}
-
 						}
 					}
 				}
-				//We get an NA from trying to take the logarithm of zero - That is, this parameter is completely impossible for the given data, so put in -Inf
-				if(contribution != contribution || contribution == -std::numeric_limits<double>::infinity()) args.result[(long)counter *(long)nRecombLevels + (long)recombCounter] = -std::numeric_limits<double>::infinity();
-				else args.result[(long)counter * (long)nRecombLevels + (long)recombCounter] += contribution;
 			}
-#ifdef USE_OPENMP
-			#pragma omp critical
-#endif
+			//The lookup table stores each cell contiguously over the recombination levels, so accumulate all the levels at once. The terms are added in the same order for every level, so this gives the same values as evaluating the levels one at a time. 
+			if(coarseLevels.size() == 0 || !evaluateAdaptive(terms, coarseLevels, contributions))
 			{
-				progressCounter++;
+				std::fill(contributions.begin(), contributions.end(), 0);
+				for(std::vector<lookupTerm>::const_iterator term = terms.begin(); term != terms.end(); term++)
+				{
+					for(int recombCounter = 0; recombCounter < (int)nRecombLevels; recombCounter++) contributions[recombCounter] += term->multiple * term->values[recombCounter];
+				}
 			}
-#ifdef USE_OPENMP
-			if(omp_get_thread_num() == 0)
-#endif
+			double* result = &(args.result[(long)counter * (long)nRecombLevels]);
+			for(int recombCounter = 0; recombCounter < (int)nRecombLevels; recombCounter++)
 			{
-				updateProgressCounter++;
-				if(updateProgressCounter % 100 == 0) args.updateProgress(progressCounter);
+				double contribution = contributions[recombCounter];
+				//We get an NA from trying to take the logarithm of zero - That is, this parameter is completely impossible for the given data, so put in -Inf
+				if(contribution != contribution || contribution == -std::numeric_limits<double>::infinity()) result[recombCounter] = -std::numeric_limits<double>::infinity();
+				else result[recombCounter] += contribution;
 			}
-		}
+			reportProgress();
+		};
+		forEachPairInChunk(args, blocks, finalsData, blockData, processPair, prefetchPair);
 	}
 	return true;
 }
@@ -273,9 +435,9 @@ template<int nFounders, int maxAlleles, bool infiniteSelfing> bool estimateRFSpe
 {
 	for(std::vector<double>::iterator i = args.lineWeights.begin(); i != args.lineWeights.end(); i++)
 	{
-		if(*i != 1) return estimateRFSpecificDesign<nFounders, maxAlleles, infiniteSelfing>(args, counter);
+		if(*i != 1) return estimateRFSpecificDesignCounts<nFounders, maxAlleles, infiniteSelfing, true>(args, counter);
 	}
-	return estimateRFSpecificDesignNoLineWeights<nFounders, maxAlleles, infiniteSelfing>(args, counter);
+	return estimateRFSpecificDesignCounts<nFounders, maxAlleles, infiniteSelfing, false>(args, counter);
 }
 template<int nFounders, int maxAlleles> bool estimateRFSpecificDesignInternal2(rfhaps_internal_args& args, unsigned long long& counter)
 {
@@ -287,7 +449,7 @@ template<int nFounders, int maxAlleles> bool estimateRFSpecificDesignInternal2(r
 	}
 	else return estimateRFSpecificDesign3<nFounders, maxAlleles, false>(args, counter);
 }
-//here we transfer maxAlleles over to the templated parameter section - This can make a BIG difference to memory usage if this is smaller, and it's going into a type so it has to be templated.
+//here we transfer maxAlleles over to the templated parameter section. The lookup table itself is sized according to the alleles of each marker pattern, but the counting table and the conversion from haplotype to marker probabilities still use fixed size arrays.
 template<int nFounders> bool estimateRFSpecificDesignInternal1(rfhaps_internal_args& args, unsigned long long& counter)
 {
 	//for i in `seq 1 64`; do echo -e "case $i:\n\t\treturn estimateRFSpecificDesignInternal2<nFounders, $i>(args, counter);"; done
@@ -400,143 +562,7 @@ unsigned long long estimateLookup(rfhaps_internal_args& internal_args)
 	int maxSelfing = *std::max_element(internal_args.selfingGenerations.begin(), internal_args.selfingGenerations.end());
 	std::size_t nDifferentFunnels = internal_args.lineFunnelEncodings.size();
 	std::size_t nRecombLevels = internal_args.recombinationFractions.size();
-
-	std::size_t arraySize;
-	//for i in `seq 1 64`; do echo -e "\t\tcase $i:\n\t\t\tarraySize = sizeof(array2<$i>);\n\t\t\tbreak;"; done > tmp
-	switch(internal_args.maxAlleles)
-	{
-		case 1:
-		case 2:
-			arraySize = sizeof(array2<2>);
-			break;
-		case 3:
-		case 4:
-			arraySize = sizeof(array2<4>);
-			break;
-		case 5:
-		case 6:
-			arraySize = sizeof(array2<6>);
-			break;
-		case 7:
-		case 8:
-			arraySize = sizeof(array2<8>);
-			break;
-		case 9:
-		case 10:
-			arraySize = sizeof(array2<10>);
-			break;
-		case 11:
-		case 12:
-			arraySize = sizeof(array2<12>);
-			break;
-		case 13:
-		case 14:
-			arraySize = sizeof(array2<14>);
-			break;
-		case 15:
-		case 16:
-			arraySize = sizeof(array2<16>);
-			break;
-		case 17:
-		case 18:
-			arraySize = sizeof(array2<18>);
-			break;
-		case 19:
-		case 20:
-			arraySize = sizeof(array2<20>);
-			break;
-		case 21:
-		case 22:
-			arraySize = sizeof(array2<22>);
-			break;
-		case 23:
-		case 24:
-			arraySize = sizeof(array2<24>);
-			break;
-		case 25:
-		case 26:
-			arraySize = sizeof(array2<26>);
-			break;
-		case 27:
-		case 28:
-			arraySize = sizeof(array2<28>);
-			break;
-		case 29:
-		case 30:
-			arraySize = sizeof(array2<30>);
-			break;
-		case 31:
-		case 32:
-			arraySize = sizeof(array2<32>);
-			break;
-		case 33:
-		case 34:
-			arraySize = sizeof(array2<34>);
-			break;
-		case 35:
-		case 36:
-			arraySize = sizeof(array2<36>);
-			break;
-		case 37:
-		case 38:
-			arraySize = sizeof(array2<38>);
-			break;
-		case 39:
-		case 40:
-			arraySize = sizeof(array2<40>);
-			break;
-		case 41:
-		case 42:
-			arraySize = sizeof(array2<42>);
-			break;
-		case 43:
-		case 44:
-			arraySize = sizeof(array2<44>);
-			break;
-		case 45:
-		case 46:
-			arraySize = sizeof(array2<46>);
-			break;
-		case 47:
-		case 48:
-			arraySize = sizeof(array2<48>);
-			break;
-		case 49:
-		case 50:
-			arraySize = sizeof(array2<50>);
-			break;
-		case 51:
-		case 52:
-			arraySize = sizeof(array2<52>);
-			break;
-		case 53:
-		case 54:
-			arraySize = sizeof(array2<54>);
-			break;
-		case 55:
-		case 56:
-			arraySize = sizeof(array2<56>);
-			break;
-		case 57:
-		case 58:
-			arraySize = sizeof(array2<58>);
-			break;
-		case 59:
-		case 60:
-			arraySize = sizeof(array2<60>);
-			break;
-		case 61:
-		case 62:
-			arraySize = sizeof(array2<62>);
-			break;
-		case 63:
-		case 64:
-			arraySize = sizeof(array2<64>);
-			break;
-		default:
-			throw std::runtime_error("Internal error");
-	}
-	return nRecombLevels * (maxSelfing - minSelfing + 1) * (nDifferentFunnels + maxAIGenerations) * arraySize;
+	return allMarkerPairData::requiredBytes(internal_args.markerPatternData.allMarkerPatterns, (int)nRecombLevels, (int)nDifferentFunnels, maxAIGenerations, maxSelfing - minSelfing + 1);
 }
 bool toInternalArgs(estimateRFSpecificDesignArgs&& args, rfhaps_internal_args& internal_args, std::string& error)
 {
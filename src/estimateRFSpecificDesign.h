@@ -24,11 +24,11 @@ struct estimateRFSpecificDesignArgs
 };
 struct rfhaps_internal_args
 {
-	rfhaps_internal_args(const std::vector<double>& recombinationFractions, triangularIterator& startPosition)
-	: recombinationFractions(recombinationFractions), startPosition(startPosition)
+	rfhaps_internal_args(const std::vector<double>& recombinationFractions, const triangularIndex& pairIndex)
+	: recombinationFractions(recombinationFractions), pairIndex(pairIndex), startIndex(0), tileSize(0), adaptive(false), screenStatistics(NULL), screenDegreesOfFreedom(NULL), skipPairs(NULL)
 	{}
 	rfhaps_internal_args(rfhaps_internal_args&& other)
-		:finals(other.finals), founders(other.founders), pedigree(other.pedigree), recombinationFractions(other.recombinationFractions), intercrossingGenerations(std::move(other.intercrossingGenerations)), selfingGenerations(std::move(other.selfingGenerations)), lineWeights(std::move(other.lineWeights)), markerPatternData(std::move(other.markerPatternData)), hasAI(other.hasAI), maxAlleles(other.maxAlleles), result(other.result), lineFunnelIDs(std::move(other.lineFunnelIDs)), lineFunnelEncodings(std::move(other.lineFunnelEncodings)), allFunnelEncodings(std::move(other.allFunnelEncodings)), startPosition(other.startPosition)
+		:finals(other.finals), founders(other.founders), pedigree(other.pedigree), recombinationFractions(other.recombinationFractions), intercrossingGenerations(std::move(other.intercrossingGenerations)), selfingGenerations(std::move(other.selfingGenerations)), lineWeights(std::move(other.lineWeights)), markerPatternData(std::move(other.markerPatternData)), hasAI(other.hasAI), maxAlleles(other.maxAlleles), result(other.result), lineFunnelIDs(std::move(other.lineFunnelIDs)), lineFunnelEncodings(std::move(other.lineFunnelEncodings)), allFunnelEncodings(std::move(other.allFunnelEncodings)), pairIndex(other.pairIndex), startIndex(other.startIndex), tileSize(other.tileSize), adaptive(other.adaptive), screenStatistics(other.screenStatistics), screenDegreesOfFreedom(other.screenDegreesOfFreedom), skipPairs(other.skipPairs), lookupCacheDirectory(std::move(other.lookupCacheDirectory))
 	{}
 	Rcpp::IntegerMatrix finals, founders;
 	Rcpp::S4 pedigree;
@@ -47,7 +47,21 @@ struct rfhaps_internal_args
 	std::vector<funnelID> lineFunnelIDs;
 	std::vector<funnelEncoding> lineFunnelEncodings;
 	std::vector<funnelEncoding> allFunnelEncodings;
-	triangularIterator startPosition;
+	//Random access into the region of marker pairs being estimated. 
+	const triangularIndex& pairIndex;
+	//The linear index (into pairIndex) of the first pair in the current chunk
+	unsigned long long startIndex;
+	//If positive, pairs are processed in square blocks of this many markers, with the genotype data for each block copied into a contiguous buffer. 
+	int tileSize;
+	//If true, each pair is first evaluated at a coarse subset of the recombination fractions, and then at the recombination fractions around the best of those. The recombination fractions which are not evaluated are set to -Inf, so this can only be used if there is a single design. 
+	bool adaptive;
+	//If not NULL, the likelihoods are not computed. Instead a chi-squared statistic for association between the two markers, and its degrees of freedom, are added to these (one value per pair in the current chunk). 
+	double* screenStatistics;
+	int* screenDegreesOfFreedom;
+	//If not NULL, pairs in the current chunk with a non-zero entry are skipped, leaving their entries of result as zero. 
+	const unsigned char* skipPairs;
+	//If not empty, lookup table entries are cached in this directory, and re-used by later calls
+	std::string lookupCacheDirectory;
 	std::function<void(unsigned long long)> updateProgress;
 };
 unsigned long long estimateLookup(rfhaps_internal_args& internal_args);
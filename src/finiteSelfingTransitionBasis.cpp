@@ -0,0 +1,20 @@
+#include "finiteSelfingTransitionBasis.hpp"
+finiteSelfingRecursion::modeType finiteSelfingRecursion::mode = finiteSelfingRecursion::automaticMode;
+SEXP finiteSelfingRecursionMode(SEXP mode_)
+{
+BEGIN_RCPP
+	int mode;
+	try
+	{
+		mode = Rcpp::as<int>(mode_);
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Input mode must be an integer");
+	}
+	if(mode < 0 || mode > 2) throw std::runtime_error("Input mode must be 0, 1 or 2");
+	int previous = finiteSelfingRecursion::mode;
+	finiteSelfingRecursion::mode = (finiteSelfingRecursion::modeType)mode;
+	return Rcpp::wrap(previous);
+END_RCPP
+}
@@ -0,0 +1,220 @@
+#ifndef FINITE_SELFING_TRANSITION_BASIS_HEADER_GUARD
+#define FINITE_SELFING_TRANSITION_BASIS_HEADER_GUARD
+#include "Rcpp.h"
+#include "probabilities.hpp"
+#include <vector>
+#include <cmath>
+#include <algorithm>
+/*
+ * The finite selfing transition matrix in a basis where it is sparse.
+ *
+ * The transition matrix between genotypes is sum_c P[c] M_c, where M_c is the 0/1 matrix of pairs of genotypes in transition class c. Every M_c is unchanged by the symmetries of the funnel (swapping the two founders of a cross, or the two parents of any later cross), and so is the whole transition matrix, for every interval and every line. A genotype vector is a symmetric nFounders by nFounders matrix, and applying the Haar transform of the funnel tree to both its rows and columns (sums and differences of the two halves of every cross) gives a basis which separates these symmetries. In that basis, each transition class contributes only to a few entries; for 16 founders about 11 per row, compared to 136 for the dense matrix.
+ *
+ * The entries of the sparse matrix are linear combinations of the class probabilities, with coefficients computed here once. So multiplying by the transition matrix is: transform, sum over the few classes of every sparse entry, transform back. The result equals the dense sum up to rounding.
+ */
+template<int nFounders> struct finiteSelfingTransitionBasis
+{
+public:
+	static const int nGenotypes = (nFounders*(nFounders+1))/2;
+	static const int nDifferentProbs = compressedProbabilities<nFounders, false>::nDifferentProbs;
+	static const finiteSelfingTransitionBasis<nFounders>& get()
+	{
+		static const finiteSelfingTransitionBasis<nFounders> instance;
+		return instance;
+	}
+	//Number of non-zero entries of the transition matrix in the transformed basis
+	int nEntries() const
+	{
+		return (int)entryColumns.size();
+	}
+	//Values of the non-zero entries, for the probabilities of a single interval. Output must have nEntries() values.
+	void entries(const double* classProbabilities, double* output) const
+	{
+		for(int entry = 0; entry < nEntries(); entry++)
+		{
+			double value = 0;
+			for(int term = termStart[entry]; term < termStart[entry+1]; term++)
+			{
+				value += termCoefficients[term] * classProbabilities[termClasses[term]];
+			}
+			output[entry] = value;
+		}
+	}
+	//Multiply a vector of genotype values (indexed as in finiteSelfingTransitionClasses) by the transition matrix, using the entries computed by entries(). Input and output may be the same.
+	void multiply(const double* entryValues, const double* input, double* output) const
+	{
+		double transformed[nGenotypes], result[nGenotypes];
+		toBasis(input, transformed);
+		for(int row = 0; row < nGenotypes; row++)
+		{
+			double value = 0;
+			for(int entry = rowStart[row]; entry < rowStart[row+1]; entry++)
+			{
+				value += entryValues[entry] * transformed[entryColumns[entry]];
+			}
+			result[row] = value;
+		}
+		fromBasis(result, output);
+	}
+	/* Unnormalised Haar transform of the funnel tree, applied to both sides of the symmetric matrix X of genotype values. The result H X H^T is symmetric, and equals H (H X)^T, so the transform is applied to rows twice with a transpose in between. Rows are combined as a whole, so the inner loops are contiguous.
+	 */
+	static void toBasis(const double* input, double* output)
+	{
+		double matrix[nFounders][nFounders], working[nFounders][nFounders];
+		fillSymmetric(input, matrix);
+		combineRows(matrix, working, false);
+		transpose(matrix);
+		combineRows(matrix, working, false);
+		readTriangle(matrix, output);
+	}
+	//Inverse of toBasis
+	static void fromBasis(const double* input, double* output)
+	{
+		double matrix[nFounders][nFounders], working[nFounders][nFounders];
+		fillSymmetric(input, matrix);
+		combineRows(matrix, working, true);
+		transpose(matrix);
+		combineRows(matrix, working, true);
+		readTriangle(matrix, output);
+	}
+private:
+	static void fillSymmetric(const double* input, double (&matrix)[nFounders][nFounders])
+	{
+		for(int i = 0; i < nFounders; i++)
+		{
+			for(int j = 0; j <= i; j++)
+			{
+				matrix[i][j] = matrix[j][i] = input[(i*(i+1))/2 + j];
+			}
+		}
+	}
+	static void readTriangle(const double (&matrix)[nFounders][nFounders], double* output)
+	{
+		for(int i = 0; i < nFounders; i++)
+		{
+			for(int j = 0; j <= i; j++)
+			{
+				output[(i*(i+1))/2 + j] = matrix[i][j];
+			}
+		}
+	}
+	static void transpose(double (&matrix)[nFounders][nFounders])
+	{
+		for(int i = 0; i < nFounders; i++)
+		{
+			for(int j = 0; j < i; j++)
+			{
+				std::swap(matrix[i][j], matrix[j][i]);
+			}
+		}
+	}
+	/* Founders 2k and 2k+1 are crossed first, then the results of those crosses in pairs, and so on. At every level the sums go to the start and the differences after them. The inverse undoes the levels in the opposite order.
+	 */
+	static void combineRows(double (&matrix)[nFounders][nFounders], double (&working)[nFounders][nFounders], bool inverse)
+	{
+		if(!inverse)
+		{
+			for(int length = nFounders; length > 1; length /= 2)
+			{
+				for(int i = 0; i < length/2; i++)
+				{
+					for(int column = 0; column < nFounders; column++)
+					{
+						working[i][column] = matrix[2*i][column] + matrix[2*i+1][column];
+						working[length/2 + i][column] = matrix[2*i][column] - matrix[2*i+1][column];
+					}
+				}
+				for(int i = 0; i < length; i++) std::copy(working[i], working[i] + nFounders, matrix[i]);
+			}
+		}
+		else
+		{
+			for(int length = 2; length <= nFounders; length *= 2)
+			{
+				for(int i = 0; i < length/2; i++)
+				{
+					for(int column = 0; column < nFounders; column++)
+					{
+						working[2*i][column] = 0.5*(matrix[i][column] + matrix[length/2 + i][column]);
+						working[2*i+1][column] = 0.5*(matrix[i][column] - matrix[length/2 + i][column]);
+					}
+				}
+				for(int i = 0; i < length; i++) std::copy(working[i], working[i] + nFounders, matrix[i]);
+			}
+		}
+	}
+	finiteSelfingTransitionBasis()
+	{
+		static_assert((nFounders & (nFounders - 1)) == 0, "The Haar transform requires a power of two founders");
+		const finiteSelfingTransitionClasses<nFounders>& transitionClasses = finiteSelfingTransitionClasses<nFounders>::get();
+		//coefficients[row][column][class] is the coefficient of the probability for that class, in that entry of the transformed matrix
+		std::vector<double> coefficients((std::size_t)nGenotypes * nGenotypes * nDifferentProbs, 0);
+		double unit[nGenotypes], genotypeValues[nGenotypes], perClass[nDifferentProbs][nGenotypes], transformed[nGenotypes];
+		for(int column = 0; column < nGenotypes; column++)
+		{
+			std::fill(unit, unit + nGenotypes, 0);
+			unit[column] = 1;
+			fromBasis(unit, genotypeValues);
+			for(int probability = 0; probability < nDifferentProbs; probability++) std::fill(perClass[probability], perClass[probability] + nGenotypes, 0);
+			for(int genotype = 0; genotype < nGenotypes; genotype++)
+			{
+				for(int previousGenotype = 0; previousGenotype < nGenotypes; previousGenotype++)
+				{
+					perClass[transitionClasses.classes[genotype][previousGenotype]][genotype] += genotypeValues[previousGenotype];
+				}
+			}
+			for(int probability = 0; probability < nDifferentProbs; probability++)
+			{
+				toBasis(perClass[probability], transformed);
+				for(int row = 0; row < nGenotypes; row++)
+				{
+					coefficients[((std::size_t)row * nGenotypes + column) * nDifferentProbs + probability] = transformed[row];
+				}
+			}
+		}
+		//The coefficients are sums of a few powers of two, so anything which isn't exactly zero is structural
+		rowStart.push_back(0);
+		termStart.push_back(0);
+		for(int row = 0; row < nGenotypes; row++)
+		{
+			for(int column = 0; column < nGenotypes; column++)
+			{
+				const double* current = &(coefficients[((std::size_t)row * nGenotypes + column) * nDifferentProbs]);
+				bool nonZero = false;
+				for(int probability = 0; probability < nDifferentProbs; probability++)
+				{
+					if(std::fabs(current[probability]) > 1e-12)
+					{
+						nonZero = true;
+						termClasses.push_back(probability);
+						termCoefficients.push_back(current[probability]);
+					}
+				}
+				if(nonZero)
+				{
+					entryColumns.push_back(column);
+					termStart.push_back((int)termClasses.size());
+				}
+			}
+			rowStart.push_back((int)entryColumns.size());
+		}
+	}
+	std::vector<int> rowStart, entryColumns, termStart, termClasses;
+	std::vector<double> termCoefficients;
+};
+/* Normally the recursions aggregate over the transition classes (the sparse basis above for the forwards-backwards algorithm, and visiting the previous genotypes in order of path length for the Viterbi algorithm) only for 16 founders. With fewer founders the transforms and sorting cost more than the dense sums they replace. For testing this can be overridden, so that both can be compared against the dense code on the same data.
+ */
+struct finiteSelfingRecursion
+{
+	enum modeType
+	{
+		automaticMode = 0, alwaysDense = 1, alwaysAggregated = 2
+	};
+	static modeType mode;
+	static bool aggregateClasses(int nFounders)
+	{
+		return mode == alwaysAggregated || (mode == automaticMode && nFounders >= 16);
+	}
+};
+SEXP finiteSelfingRecursionMode(SEXP mode);
+#endif
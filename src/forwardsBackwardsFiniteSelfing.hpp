@@ -13,13 +13,15 @@
 #include "markerPatternsToUniqueValues.h"
 #include "intercrossingHaplotypeToMarker.hpp"
 #include "funnelHaplotypeToMarker.hpp"
+#include "genotypeProbabilitiesOutput.hpp"
+#include "finiteSelfingTransitionBasis.hpp"
 #include <limits>
 template<int nFounders> struct forwardsBackwardsAlgorithm<nFounders, false>
 {
 	typedef typename expandedProbabilities<nFounders, false>::type expandedProbabilitiesType;
 	Rcpp::List recodedHetData;
 	Rcpp::IntegerMatrix recodedFounders, recodedFinals;
-	Rcpp::NumericMatrix results;
+	genotypeProbabilitiesOutput results;
 	xMajorMatrix<expandedProbabilitiesType>& intercrossingHaplotypeProbabilities;
 	rowMajorMatrix<expandedProbabilitiesType>& funnelHaplotypeProbabilities;
 	markerPatternsToUniqueValuesArgs& markerData;
@@ -32,11 +34,15 @@ template<int nFounders> struct forwardsBackwardsAlgorithm<nFounders, false>
 	int minAIGenerations, maxAIGenerations;
 	double heterozygoteMissingProb, homozygoteMissingProb;
 	Rcpp::IntegerMatrix key;
-	rowMajorMatrix<double> forwardProbabilities, backwardProbabilities;
+	//Size of the per-thread forward and backward probability matrices
+	int maxChromosomeSize;
 	std::vector<array2<nFounders> >* intercrossingSingleLociHaplotypeProbabilities;
 	std::vector<array2<nFounders> >* funnelSingleLociHaplotypeProbabilities;
+	//If the sparse basis is used, the entries of the transition matrix for every interval of the current chromosome. These are shared by all lines, so they are computed once per interval. 
+	bool useTransitionBasis;
+	std::vector<double> funnelTransitionEntries, intercrossingTransitionEntries;
 	forwardsBackwardsAlgorithm(markerPatternsToUniqueValuesArgs& markerData, xMajorMatrix<expandedProbabilitiesType>& intercrossingHaplotypeProbabilities, rowMajorMatrix<expandedProbabilitiesType>& funnelHaplotypeProbabilities, int maxChromosomeSize)
-		: intercrossingHaplotypeProbabilities(intercrossingHaplotypeProbabilities), funnelHaplotypeProbabilities(funnelHaplotypeProbabilities), markerData(markerData), forwardProbabilities(nFounders*(nFounders+1)/2, maxChromosomeSize), backwardProbabilities(nFounders*(nFounders+1)/2, maxChromosomeSize)
+		: intercrossingHaplotypeProbabilities(intercrossingHaplotypeProbabilities), funnelHaplotypeProbabilities(funnelHaplotypeProbabilities), markerData(markerData), maxChromosomeSize(maxChromosomeSize)
 	{}
 	void apply(int start, int end)
 	{
@@ -46,284 +52,219 @@ template<int nFounders> struct forwardsBackwardsAlgorithm<nFounders, false>
 		maxAIGenerations = *std::max_element(intercrossingGenerations->begin(), intercrossingGenerations->end());
 		minAIGenerations = std::max(minAIGenerations, 1);
 		int nFinals = recodedFinals.nrow();
-		for(int finalCounter = 0; finalCounter < nFinals; finalCounter++)
+		useTransitionBasis = finiteSelfingRecursion::aggregateClasses(nFounders);
+		if(useTransitionBasis) computeTransitionEntries(end - start - 1);
+		//Lines are independent, so they can be processed in parallel. Every thread has its own forward and backward probabilities, and the transition probabilities are shared. Each line writes to its own rows of the results, so the output does not depend on the number of threads. 
+#ifdef USE_OPENMP
+		#pragma omp parallel
+#endif
 		{
-			if((*intercrossingGenerations)[finalCounter] == 0)
+			//Stored column-major, so that the probabilities for all states at a single marker are contiguous
+			columnMajorMatrix<double> forwardProbabilities(nFounders*(nFounders+1)/2, maxChromosomeSize), backwardProbabilities(nFounders*(nFounders+1)/2, maxChromosomeSize);
+#ifdef USE_OPENMP
+			#pragma omp for schedule(dynamic)
+#endif
+			for(int finalCounter = 0; finalCounter < nFinals; finalCounter++)
 			{
-				applyFunnel(start, end, finalCounter, (*lineFunnelIDs)[finalCounter], (*selfingGenerations)[finalCounter]);
+				if((*intercrossingGenerations)[finalCounter] == 0)
+				{
+					applyFunnel(start, end, finalCounter, (*lineFunnelIDs)[finalCounter], (*selfingGenerations)[finalCounter], forwardProbabilities, backwardProbabilities);
+				}
+				else
+				{
+					applyIntercrossing(start, end, finalCounter, (*intercrossingGenerations)[finalCounter], (*selfingGenerations)[finalCounter], forwardProbabilities, backwardProbabilities);
+				}
 			}
-			else
+		}
+	}
+	void computeTransitionEntries(int nIntervals)
+	{
+		const finiteSelfingTransitionBasis<nFounders>& basis = finiteSelfingTransitionBasis<nFounders>::get();
+		const int nEntries = basis.nEntries(), nSelfing = funnelHaplotypeProbabilities.getNColumns(), nAI = intercrossingHaplotypeProbabilities.getSizeY();
+		funnelTransitionEntries.resize((std::size_t)nIntervals * nSelfing * nEntries);
+		intercrossingTransitionEntries.resize((std::size_t)nIntervals * nAI * nSelfing * nEntries);
+#ifdef USE_OPENMP
+		#pragma omp parallel for schedule(static)
+#endif
+		for(int interval = 0; interval < nIntervals; interval++)
+		{
+			for(int selfingIndex = 0; selfingIndex < nSelfing; selfingIndex++)
 			{
-				applyIntercrossing(start, end, finalCounter, (*intercrossingGenerations)[finalCounter], (*selfingGenerations)[finalCounter]);
+				basis.entries(funnelHaplotypeProbabilities(interval, selfingIndex).values, &(funnelTransitionEntries[((std::size_t)interval * nSelfing + selfingIndex) * nEntries]));
+				for(int intercrossingIndex = 0; intercrossingIndex < nAI; intercrossingIndex++)
+				{
+					basis.entries(intercrossingHaplotypeProbabilities(interval, intercrossingIndex, selfingIndex).values, &(intercrossingTransitionEntries[(((std::size_t)interval * nAI + intercrossingIndex) * nSelfing + selfingIndex) * nEntries]));
+				}
 			}
 		}
 	}
-	void applyFunnel(int start, int end, int finalCounter, int funnelID, int selfingGenerations)
+	void applyFunnel(int start, int end, int finalCounter, int funnelID, int selfingGenerations, columnMajorMatrix<double>& forwardProbabilities, columnMajorMatrix<double>& backwardProbabilities)
 	{
-		//Compute forward probabilities
-		int markerValue = recodedFinals(finalCounter, start);
 		funnelEncoding enc = (*lineFunnelEncodings)[(*lineFunnelIDs)[finalCounter]];
 		int funnel[16];
 		for(int founderCounter = 0; founderCounter < nFounders; founderCounter++)
 		{
 			funnel[founderCounter] = ((enc & (15 << (4*founderCounter))) >> (4*founderCounter));
 		}
-		{
-			::markerData& startMarkerData = markerData.allMarkerPatterns[markerData.markerPatternIDs[start]];
-			double sum = 0;
-			for(int founderCounter = 0; founderCounter < nFounders; founderCounter++)
+		const int selfingIndex = selfingGenerations - minSelfingGenerations;
+		applyLine(start, end, finalCounter, funnel, (*funnelSingleLociHaplotypeProbabilities)[selfingIndex], [&](int markerCounter) -> const expandedProbabilitiesType&
 			{
-				for(int founderCounter2 = 0; founderCounter2 <= founderCounter; founderCounter2++)
-				{
-					int markerEncodingTheseFounders = startMarkerData.hetData(funnel[founderCounter], funnel[founderCounter2]);
-					int encodingTheseFounders = key(funnel[founderCounter], funnel[founderCounter2])-1;
-					if(markerValue == markerEncodingTheseFounders)
-					{
-						forwardProbabilities(encodingTheseFounders, 0) = (*funnelSingleLociHaplotypeProbabilities)[selfingGenerations - minSelfingGenerations].values[founderCounter][founderCounter2];
-					}
-					else if(markerValue == NA_INTEGER && recodedFounders(funnel[founderCounter2], start) == recodedFounders(funnel[founderCounter], start) && homozygoteMissingProb != 0)
-					{
-						forwardProbabilities(encodingTheseFounders, 0) = (*funnelSingleLociHaplotypeProbabilities)[selfingGenerations - minSelfingGenerations].values[founderCounter][founderCounter2] * homozygoteMissingProb;
-					}
-					else if(markerValue == NA_INTEGER && recodedFounders(funnel[founderCounter2], start) != recodedFounders(funnel[founderCounter], start) && heterozygoteMissingProb != 0)
-					{
-						forwardProbabilities(encodingTheseFounders, 0) = (*funnelSingleLociHaplotypeProbabilities)[selfingGenerations - minSelfingGenerations].values[founderCounter][founderCounter2] * heterozygoteMissingProb;
-					}
-					else forwardProbabilities(encodingTheseFounders, 0) = 0;
-					sum += forwardProbabilities(encodingTheseFounders, 0);
-				}
-			}
-			for(int counter = 0; counter < (nFounders*(nFounders+1))/2; counter++)
+				return funnelHaplotypeProbabilities(markerCounter - start, selfingIndex);
+			}, [&](int markerCounter) -> const double*
 			{
-				forwardProbabilities(counter, 0) /= sum;
-			}
-		}
-		for(int markerCounter = start; markerCounter < end - 1; markerCounter++)
+				return &(funnelTransitionEntries[((std::size_t)(markerCounter - start) * funnelHaplotypeProbabilities.getNColumns() + selfingIndex) * finiteSelfingTransitionBasis<nFounders>::get().nEntries()]);
+			}, forwardProbabilities, backwardProbabilities);
+	}
+	void applyIntercrossing(int start, int end, int finalCounter, int intercrossingGeneration, int selfingGenerations, columnMajorMatrix<double>& forwardProbabilities, columnMajorMatrix<double>& backwardProbabilities)
+	{
+		//With intercrossing the founder positions are the founders themselves
+		int funnel[16];
+		for(int founderCounter = 0; founderCounter < nFounders; founderCounter++)
 		{
-			markerValue = recodedFinals(finalCounter, markerCounter+1);
-			::markerData& currentMarkerData = markerData.allMarkerPatterns[markerData.markerPatternIDs[markerCounter+1]];
-			double sum = 0;
-			//The founders at the new marker
-			for(int founderCounter = 0; founderCounter < nFounders; founderCounter++)
+			funnel[founderCounter] = founderCounter;
+		}
+		const int selfingIndex = selfingGenerations - minSelfingGenerations, intercrossingIndex = intercrossingGeneration - minAIGenerations;
+		applyLine(start, end, finalCounter, funnel, (*intercrossingSingleLociHaplotypeProbabilities)[selfingIndex], [&](int markerCounter) -> const expandedProbabilitiesType&
 			{
-				for(int founderCounter2 = 0; founderCounter2 <= founderCounter; founderCounter2++)
-				{
-					int markerEncodingTheseFounders = currentMarkerData.hetData(funnel[founderCounter], funnel[founderCounter2]);
-					int encodingTheseFounders = key(funnel[founderCounter], funnel[founderCounter2])-1;
-					forwardProbabilities(encodingTheseFounders, markerCounter - start + 1) = 0;
-					bool markerMatches = markerValue == markerEncodingTheseFounders;
-					bool missingHet = markerValue == NA_INTEGER && recodedFounders(funnel[founderCounter2], markerCounter + 1) != recodedFounders(funnel[founderCounter], markerCounter + 1) && heterozygoteMissingProb != 0;
-					bool missingHomo = markerValue == NA_INTEGER && recodedFounders(funnel[founderCounter2], markerCounter + 1) == recodedFounders(funnel[founderCounter], markerCounter + 1) && homozygoteMissingProb != 0;
-					if(markerMatches || missingHet || missingHomo)
-					{
-						double factor = 1;
-						if(missingHet) factor = heterozygoteMissingProb;
-						if(missingHomo) factor = homozygoteMissingProb;
-						//Founders at the previous marker
-						for(int founderCounterPrevious = 0; founderCounterPrevious < nFounders; founderCounterPrevious++)
-						{
-							for(int founderCounterPrevious2 = 0; founderCounterPrevious2 <= founderCounterPrevious; founderCounterPrevious2++)
-							{
-								int encodingPreviousFounders = key(funnel[founderCounterPrevious], funnel[founderCounterPrevious2])-1;
-								forwardProbabilities(encodingTheseFounders, markerCounter - start + 1) += forwardProbabilities(encodingPreviousFounders, markerCounter - start) * funnelHaplotypeProbabilities(markerCounter-start, selfingGenerations - minSelfingGenerations).values[founderCounter][founderCounter2][founderCounterPrevious][founderCounterPrevious2] * factor;
-							}
-						}
-					}
-					sum += forwardProbabilities(encodingTheseFounders, markerCounter - start + 1);
-				}
-			}
-			for(int counter = 0; counter < nFounders*(nFounders+1)/2; counter++)
+				return intercrossingHaplotypeProbabilities(markerCounter - start, intercrossingIndex, selfingIndex);
+			}, [&](int markerCounter) -> const double*
 			{
-				forwardProbabilities(counter, markerCounter - start + 1) /= sum;
-			}
-		}
-		//Now the backwards probabilities
+				return &(intercrossingTransitionEntries[(((std::size_t)(markerCounter - start) * intercrossingHaplotypeProbabilities.getSizeY() + intercrossingIndex) * intercrossingHaplotypeProbabilities.getSizeZ() + selfingIndex) * finiteSelfingTransitionBasis<nFounders>::get().nEntries()]);
+			}, forwardProbabilities, backwardProbabilities);
+	}
+	//Probability of the observed value at this marker, for every genotype (in terms of founder positions within the funnel)
+	void markerProbabilities(int markerCounter, int finalCounter, const int* funnel, double* emission)
+	{
+		int markerValue = recodedFinals(finalCounter, markerCounter);
+		::markerData& currentMarkerData = markerData.allMarkerPatterns[markerData.markerPatternIDs[markerCounter]];
 		for(int founderCounter = 0; founderCounter < nFounders; founderCounter++)
 		{
 			for(int founderCounter2 = 0; founderCounter2 <= founderCounter; founderCounter2++)
 			{
-				int encodingTheseFounders = key(funnel[founderCounter], funnel[founderCounter2])-1;
-				backwardProbabilities(encodingTheseFounders, end - start - 1) = (*funnelSingleLociHaplotypeProbabilities)[selfingGenerations - minSelfingGenerations].values[founderCounter][founderCounter2];
-			}
-		}
-		for(int markerCounter = end - 2; markerCounter >= start; markerCounter--)
-		{
-			markerValue = recodedFinals(finalCounter, markerCounter+1);
-			::markerData& currentMarkerData = markerData.allMarkerPatterns[markerData.markerPatternIDs[markerCounter+1]];
-			double sum = 0;
-			//The founder at the current marker
-			for(int founderCounter = 0; founderCounter < nFounders; founderCounter++)
-			{
-				for(int founderCounter2 = 0; founderCounter2 <= founderCounter; founderCounter2++)
+				double& value = emission[(founderCounter*(founderCounter+1))/2 + founderCounter2];
+				if(markerValue == NA_INTEGER)
 				{
-					int markerEncodingTheseFounders = currentMarkerData.hetData(funnel[founderCounter], funnel[founderCounter2]);
-					int encodingTheseFounders = key(funnel[founderCounter], funnel[founderCounter2])-1;
-					backwardProbabilities(encodingTheseFounders, markerCounter - start) = 0;
-					//The founders at the previous marker
-					for(int founderCounterPrevious = 0; founderCounterPrevious < nFounders; founderCounterPrevious++)
-					{
-						for(int founderCounterPrevious2 = 0; founderCounterPrevious2 <= founderCounterPrevious; founderCounterPrevious2++)
-						{
-							int markerEncodingPreviousFounders = currentMarkerData.hetData(funnel[founderCounterPrevious], funnel[founderCounterPrevious2]);
-							int encodingPreviousFounders = key(funnel[founderCounterPrevious], funnel[founderCounterPrevious2])-1;
-							if(markerValue == markerEncodingPreviousFounders)
-							{
-								backwardProbabilities(encodingTheseFounders, markerCounter - start) += backwardProbabilities(encodingPreviousFounders, markerCounter - start + 1) * funnelHaplotypeProbabilities(markerCounter-start, selfingGenerations - minSelfingGenerations).values[founderCounter][founderCounter2][founderCounterPrevious][founderCounterPrevious2];
-							}
-							else if(markerValue == NA_INTEGER && recodedFounders(founderCounterPrevious2, markerCounter + 1) == recodedFounders(founderCounterPrevious, markerCounter + 1) && homozygoteMissingProb != 0)
-							{
-								backwardProbabilities(encodingTheseFounders, markerCounter - start) += backwardProbabilities(encodingPreviousFounders, markerCounter - start + 1) * funnelHaplotypeProbabilities(markerCounter-start, selfingGenerations - minSelfingGenerations).values[founderCounter][founderCounter2][founderCounterPrevious][founderCounterPrevious2] * homozygoteMissingProb;
-							}
-							else if(markerValue == NA_INTEGER && recodedFounders(founderCounterPrevious2, markerCounter + 1) != recodedFounders(founderCounterPrevious, markerCounter + 1) && heterozygoteMissingProb != 0)
-							{
-								backwardProbabilities(encodingTheseFounders, markerCounter - start) += backwardProbabilities(encodingPreviousFounders, markerCounter - start + 1) * funnelHaplotypeProbabilities(markerCounter-start, selfingGenerations - minSelfingGenerations).values[founderCounter][founderCounter2][founderCounterPrevious][founderCounterPrevious2] * heterozygoteMissingProb;
-							}
-						}
-					}
-					sum += backwardProbabilities(encodingTheseFounders, markerCounter - start);
+					if(recodedFounders(funnel[founderCounter2], markerCounter) == recodedFounders(funnel[founderCounter], markerCounter)) value = homozygoteMissingProb;
+					else value = heterozygoteMissingProb;
 				}
-			}
-			for(int counter = 0; counter < (nFounders*(nFounders+1))/2; counter++)
-			{
-				backwardProbabilities(counter, markerCounter - start) /= sum;
+				else if(markerValue == currentMarkerData.hetData(funnel[founderCounter], funnel[founderCounter2])) value = 1;
+				else value = 0;
 			}
 		}
-		//Now we can compute the marginal probabilities
-		for(int markerCounter = start; markerCounter < end; markerCounter++)
+	}
+	/* Run the forwards-backwards algorithm for a single line. 
+	 *
+	 * Genotypes are unordered pairs of founder positions within the funnel, indexed as in finiteSelfingTransitionClasses. The transition probability between two genotypes is looked up through the (shared) transition classes, so the probability data for every marker interval is only a few hundred bytes. If useTransitionBasis is set, the sum over the previous genotype is instead computed in the sparse basis of finiteSelfingTransitionBasis, which aggregates the genotypes in each transition class. 
+	 * @param funnel The founder at every position of the funnel
+	 * @param singleLocus The single locus probabilities for this line
+	 * @param transition Function taking the index of the first marker of an interval, and returning the two-point probabilities for that interval
+	 * @param transitionEntries Function taking the index of the first marker of an interval, and returning the entries of the transition matrix in the sparse basis. Only called if useTransitionBasis is set. 
+	 */
+	template<typename transitionFunction, typename transitionEntriesFunction> void applyLine(int start, int end, int finalCounter, const int* funnel, const array2<nFounders>& singleLocus, transitionFunction transition, transitionEntriesFunction transitionEntries, columnMajorMatrix<double>& forwardProbabilities, columnMajorMatrix<double>& backwardProbabilities)
+	{
+		const int nGenotypes = (nFounders*(nFounders+1))/2;
+		const finiteSelfingTransitionClasses<nFounders>& transitionClasses = finiteSelfingTransitionClasses<nFounders>::get();
+		const finiteSelfingTransitionBasis<nFounders>* basis = useTransitionBasis ? &finiteSelfingTransitionBasis<nFounders>::get() : NULL;
+		//The row of the forward and backward probabilities (and the results) for every genotype, and the single locus probability of every genotype
+		int encodings[nGenotypes];
+		double initial[nGenotypes];
+		for(int founderCounter = 0; founderCounter < nFounders; founderCounter++)
 		{
-			double sum = 0;
-			for(int counter = 0; counter < (nFounders*(nFounders+1))/2; counter++)
-			{
-				results(((nFounders*(nFounders+1))/2)*finalCounter + counter, markerCounter) = backwardProbabilities(counter, markerCounter - start) * forwardProbabilities(counter, markerCounter - start);
-				sum += results(((nFounders*(nFounders+1))/2)*finalCounter + counter, markerCounter);
-			}
-			for(int counter = 0; counter < (nFounders*(nFounders+1))/2; counter++)
+			for(int founderCounter2 = 0; founderCounter2 <= founderCounter; founderCounter2++)
 			{
-				results(((nFounders*(nFounders+1))/2)*finalCounter + counter, markerCounter) /= sum;
+				int genotype = (founderCounter*(founderCounter+1))/2 + founderCounter2;
+				encodings[genotype] = key(funnel[founderCounter], funnel[founderCounter2])-1;
+				initial[genotype] = singleLocus.values[founderCounter][founderCounter2];
 			}
 		}
-	}
-	void applyIntercrossing(int start, int end, int finalCounter, int intercrossingGeneration, int selfingGenerations)
-	{
+		double emission[nGenotypes], previous[nGenotypes], propagated[nGenotypes];
+
 		//Compute forward probabilities
-		int markerValue = recodedFinals(finalCounter, start);
 		{
-			::markerData& startMarkerData = markerData.allMarkerPatterns[markerData.markerPatternIDs[start]];
+			markerProbabilities(start, finalCounter, funnel, emission);
 			double sum = 0;
-			for(int founderCounter = 0; founderCounter < nFounders; founderCounter++)
+			for(int genotype = 0; genotype < nGenotypes; genotype++)
 			{
-				for(int founderCounter2 = 0; founderCounter2 <= founderCounter; founderCounter2++)
-				{
-					int markerEncodingTheseFounders = startMarkerData.hetData(founderCounter, founderCounter2);
-					int encodingTheseFounders = key(founderCounter, founderCounter2)-1;
-					if(markerValue == markerEncodingTheseFounders)
-					{
-						forwardProbabilities(encodingTheseFounders, 0) = (*intercrossingSingleLociHaplotypeProbabilities)[selfingGenerations - minSelfingGenerations].values[founderCounter][founderCounter2];
-					}
-					else if(markerValue == NA_INTEGER && recodedFounders((std::size_t)founderCounter2, (std::size_t)start) == recodedFounders((std::size_t)founderCounter, (std::size_t)start) && homozygoteMissingProb != 0)
-					{
-						forwardProbabilities(encodingTheseFounders, 0) = (*intercrossingSingleLociHaplotypeProbabilities)[selfingGenerations - minSelfingGenerations].values[founderCounter][founderCounter2] * homozygoteMissingProb;
-					}
-					else if(markerValue == NA_INTEGER && recodedFounders((std::size_t)founderCounter2, (std::size_t)start) != recodedFounders((std::size_t)founderCounter, (std::size_t)start) && heterozygoteMissingProb != 0)
-					{
-						forwardProbabilities(encodingTheseFounders, 0) = (*intercrossingSingleLociHaplotypeProbabilities)[selfingGenerations - minSelfingGenerations].values[founderCounter][founderCounter2] * heterozygoteMissingProb;
-					}
-					else forwardProbabilities(encodingTheseFounders, 0) = 0;
-					sum += forwardProbabilities(encodingTheseFounders, 0);
-				}
+				forwardProbabilities(encodings[genotype], 0) = initial[genotype] * emission[genotype];
+				sum += forwardProbabilities(encodings[genotype], 0);
 			}
-			for(int counter = 0; counter < (nFounders*(nFounders+1))/2; counter++)
+			for(int counter = 0; counter < nGenotypes; counter++)
 			{
 				forwardProbabilities(counter, 0) /= sum;
 			}
 		}
 		for(int markerCounter = start; markerCounter < end - 1; markerCounter++)
 		{
-			markerValue = recodedFinals(finalCounter, markerCounter+1);
-			::markerData& currentMarkerData = markerData.allMarkerPatterns[markerData.markerPatternIDs[markerCounter+1]];
+			markerProbabilities(markerCounter + 1, finalCounter, funnel, emission);
+			//Copy the values for the previous marker into genotype order, so that the inner loop is contiguous
+			for(int genotype = 0; genotype < nGenotypes; genotype++)
+			{
+				previous[genotype] = forwardProbabilities(encodings[genotype], markerCounter - start);
+			}
+			const expandedProbabilitiesType& transitionProbabilities = transition(markerCounter);
+			//Rounding in the transforms can give tiny negative values where the exact sum is zero
+			if(basis != NULL) basis->multiply(transitionEntries(markerCounter), previous, propagated);
 			double sum = 0;
-			//The founders at the new marker
-			for(int founderCounter = 0; founderCounter < nFounders; founderCounter++)
+			//The genotype at the new marker
+			for(int genotype = 0; genotype < nGenotypes; genotype++)
 			{
-				for(int founderCounter2 = 0; founderCounter2 <= founderCounter; founderCounter2++)
+				double value = 0;
+				if(emission[genotype] != 0)
 				{
-					int markerEncodingTheseFounders = currentMarkerData.hetData(founderCounter, founderCounter2);
-					int encodingTheseFounders = key(founderCounter, founderCounter2)-1;
-					forwardProbabilities(encodingTheseFounders, markerCounter - start + 1) = 0;
-					bool markerMatches = markerValue == markerEncodingTheseFounders;
-					//These rather stupid std::size_t casts are necessary to prevent the comma as being interpreted as a comma, and then calling operator()(int), which returns a whole column. 
-					bool missingHet = (markerValue == NA_INTEGER) && (recodedFounders((std::size_t)founderCounter2, (std::size_t)(markerCounter + 1)) != recodedFounders((std::size_t)founderCounter, (std::size_t)(markerCounter + 1))) && (heterozygoteMissingProb != 0);
-					bool missingHomo = (markerValue == NA_INTEGER) && (recodedFounders((std::size_t)founderCounter2, (std::size_t)(markerCounter + 1)) == recodedFounders((std::size_t)founderCounter, (std::size_t)(markerCounter + 1))) && (homozygoteMissingProb != 0);
-					if(markerMatches || missingHet || missingHomo)
+					if(basis != NULL) value = std::max(propagated[genotype], 0.0);
+					else
 					{
-						double factor = 1;
-						if(missingHet) factor = heterozygoteMissingProb;
-						if(missingHomo) factor = homozygoteMissingProb;
-						//Founders at the previous marker
-						for(int founderCounterPrevious = 0; founderCounterPrevious < nFounders; founderCounterPrevious++)
+						const unsigned char* classes = transitionClasses.classes[genotype];
+						//The genotype at the previous marker
+						for(int previousGenotype = 0; previousGenotype < nGenotypes; previousGenotype++)
 						{
-							for(int founderCounterPrevious2 = 0; founderCounterPrevious2 <= founderCounterPrevious; founderCounterPrevious2++)
-							{
-								int encodingPreviousFounders = key(founderCounterPrevious, founderCounterPrevious2)-1;
-								forwardProbabilities(encodingTheseFounders, markerCounter - start + 1) += forwardProbabilities(encodingPreviousFounders, markerCounter - start) * intercrossingHaplotypeProbabilities(markerCounter-start, intercrossingGeneration - minAIGenerations, selfingGenerations - minSelfingGenerations).values[founderCounter][founderCounter2][founderCounterPrevious][founderCounterPrevious2] * factor;
-							}
+							value += previous[previousGenotype] * transitionProbabilities.values[classes[previousGenotype]];
 						}
 					}
-					sum += forwardProbabilities(encodingTheseFounders, markerCounter - start + 1);
+					value *= emission[genotype];
 				}
+				forwardProbabilities(encodings[genotype], markerCounter - start + 1) = value;
+				sum += value;
 			}
-			for(int counter = 0; counter < (nFounders*(nFounders+1))/2; counter++)
+			for(int counter = 0; counter < nGenotypes; counter++)
 			{
 				forwardProbabilities(counter, markerCounter - start + 1) /= sum;
 			}
 		}
 		//Now the backwards probabilities
-		for(int founderCounter = 0; founderCounter < nFounders; founderCounter++)
+		for(int genotype = 0; genotype < nGenotypes; genotype++)
 		{
-			for(int founderCounter2 = 0; founderCounter2 <= founderCounter; founderCounter2++)
-			{
-				int encodingTheseFounders = key(founderCounter, founderCounter2)-1;
-				backwardProbabilities(encodingTheseFounders, end - start - 1) = (*intercrossingSingleLociHaplotypeProbabilities)[selfingGenerations - minSelfingGenerations].values[founderCounter][founderCounter2];
-			}
+			backwardProbabilities(encodings[genotype], end - start - 1) = initial[genotype];
 		}
 		for(int markerCounter = end - 2; markerCounter >= start; markerCounter--)
 		{
-			markerValue = recodedFinals(finalCounter, markerCounter+1);
-			::markerData& currentMarkerData = markerData.allMarkerPatterns[markerData.markerPatternIDs[markerCounter+1]];
+			markerProbabilities(markerCounter + 1, finalCounter, funnel, emission);
+			//The observation at the next marker doesn't depend on the genotype at the current marker, so include it once
+			for(int genotype = 0; genotype < nGenotypes; genotype++)
+			{
+				previous[genotype] = backwardProbabilities(encodings[genotype], markerCounter - start + 1) * emission[genotype];
+			}
+			const expandedProbabilitiesType& transitionProbabilities = transition(markerCounter);
+			if(basis != NULL) basis->multiply(transitionEntries(markerCounter), previous, propagated);
 			double sum = 0;
-			//The founder at the current marker
-			for(int founderCounter = 0; founderCounter < nFounders; founderCounter++)
+			//The genotype at the current marker
+			for(int genotype = 0; genotype < nGenotypes; genotype++)
 			{
-				for(int founderCounter2 = 0; founderCounter2 <= founderCounter; founderCounter2++)
+				double value = 0;
+				if(basis != NULL) value = std::max(propagated[genotype], 0.0);
+				else
 				{
-					int markerEncodingTheseFounders = currentMarkerData.hetData(founderCounter, founderCounter2);
-					int encodingTheseFounders = key(founderCounter, founderCounter2)-1;
-					backwardProbabilities(encodingTheseFounders, markerCounter - start) = 0;
-					//The founders at the previous marker
-					for(int founderCounterPrevious = 0; founderCounterPrevious < nFounders; founderCounterPrevious++)
+					const unsigned char* classes = transitionClasses.classes[genotype];
+					//The genotype at the next marker
+					for(int nextGenotype = 0; nextGenotype < nGenotypes; nextGenotype++)
 					{
-						for(int founderCounterPrevious2 = 0; founderCounterPrevious2 <= founderCounterPrevious; founderCounterPrevious2++)
-						{
-							int markerEncodingPreviousFounders = currentMarkerData.hetData(founderCounterPrevious, founderCounterPrevious2);
-							int encodingPreviousFounders = key(founderCounterPrevious, founderCounterPrevious2)-1;
-							if(markerValue == markerEncodingPreviousFounders)
-							{
-								backwardProbabilities(encodingTheseFounders, markerCounter - start) += backwardProbabilities(encodingPreviousFounders, markerCounter - start + 1) * intercrossingHaplotypeProbabilities(markerCounter-start, intercrossingGeneration - minAIGenerations, selfingGenerations - minSelfingGenerations).values[founderCounter][founderCounter2][founderCounterPrevious][founderCounterPrevious2];
-							}
-							else if(markerValue == NA_INTEGER && recodedFounders(founderCounterPrevious2, markerCounter + 1) == recodedFounders(founderCounterPrevious, markerCounter + 1) && homozygoteMissingProb != 0)
-							{
-								backwardProbabilities(encodingTheseFounders, markerCounter - start) += backwardProbabilities(encodingPreviousFounders, markerCounter - start + 1) * intercrossingHaplotypeProbabilities(markerCounter-start, intercrossingGeneration - minAIGenerations, selfingGenerations - minSelfingGenerations).values[founderCounter][founderCounter2][founderCounterPrevious][founderCounterPrevious2] * homozygoteMissingProb;
-							}
-							else if(markerValue == NA_INTEGER && recodedFounders(founderCounterPrevious2, markerCounter + 1) != recodedFounders(founderCounterPrevious, markerCounter + 1) && heterozygoteMissingProb != 0)
-							{
-								backwardProbabilities(encodingTheseFounders, markerCounter - start) += backwardProbabilities(encodingPreviousFounders, markerCounter - start + 1) * intercrossingHaplotypeProbabilities(markerCounter-start, intercrossingGeneration - minAIGenerations, selfingGenerations - minSelfingGenerations).values[founderCounter][founderCounter2][founderCounterPrevious][founderCounterPrevious2] * heterozygoteMissingProb;
-							}
-						}
+						value += previous[nextGenotype] * transitionProbabilities.values[classes[nextGenotype]];
 					}
-					sum += backwardProbabilities(encodingTheseFounders, markerCounter - start);
 				}
+				backwardProbabilities(encodings[genotype], markerCounter - start) = value;
+				sum += value;
 			}
-			for(int counter = 0; counter < (nFounders*(nFounders + 1))/2; counter++)
+			for(int counter = 0; counter < nGenotypes; counter++)
 			{
 				backwardProbabilities(counter, markerCounter - start) /= sum;
 			}
@@ -331,16 +272,17 @@ template<int nFounders> struct forwardsBackwardsAlgorithm<nFounders, false>
 		//Now we can compute the marginal probabilities
 		for(int markerCounter = start; markerCounter < end; markerCounter++)
 		{
-			double sum = 0;
-			for(int counter = 0; counter < (nFounders*(nFounders + 1))/2; counter++)
+			double sum = 0, marginal[nGenotypes];
+			for(int counter = 0; counter < nGenotypes; counter++)
 			{
-				results((nFounders*(nFounders+1)/2)*finalCounter + counter, markerCounter) = backwardProbabilities(counter, markerCounter - start) * forwardProbabilities(counter, markerCounter - start);
-				sum += results(((nFounders*(nFounders+1))/2)*finalCounter + counter, markerCounter);
+				marginal[counter] = backwardProbabilities(counter, markerCounter - start) * forwardProbabilities(counter, markerCounter - start);
+				sum += marginal[counter];
 			}
-			for(int counter = 0; counter < (nFounders*(nFounders+1))/2; counter++)
+			for(int counter = 0; counter < nGenotypes; counter++)
 			{
-				results(((nFounders*(nFounders+1))/2)*finalCounter + counter, markerCounter) /= sum;
+				marginal[counter] /= sum;
 			}
+			results.set(nGenotypes*finalCounter, markerCounter, marginal, nGenotypes);
 		}
 	}
 };
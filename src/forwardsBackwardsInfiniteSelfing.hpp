@@ -13,13 +13,14 @@
 #include "markerPatternsToUniqueValues.h"
 #include "intercrossingHaplotypeToMarker.hpp"
 #include "funnelHaplotypeToMarker.hpp"
+#include "genotypeProbabilitiesOutput.hpp"
 #include <limits>
 template<int nFounders> struct forwardsBackwardsAlgorithm<nFounders, true>
 {
 	typedef typename expandedProbabilities<nFounders, true>::type expandedProbabilitiesType;
 	Rcpp::List recodedHetData;
 	Rcpp::IntegerMatrix recodedFounders, recodedFinals;
-	Rcpp::NumericMatrix results;
+	genotypeProbabilitiesOutput results;
 	xMajorMatrix<expandedProbabilitiesType>& intercrossingHaplotypeProbabilities;
 	rowMajorMatrix<expandedProbabilitiesType>& funnelHaplotypeProbabilities;
 	markerPatternsToUniqueValuesArgs& markerData;
@@ -30,11 +31,12 @@ template<int nFounders> struct forwardsBackwardsAlgorithm<nFounders, true>
 	int minAIGenerations, maxAIGenerations;
 	double heterozygoteMissingProb, homozygoteMissingProb;
 	Rcpp::IntegerMatrix key;
-	rowMajorMatrix<double> forwardProbabilities, backwardProbabilities;
+	//Size of the per-thread forward and backward probability matrices
+	int maxChromosomeSize;
 	std::vector<array2<nFounders> >* intercrossingSingleLociHaplotypeProbabilities;
 	std::vector<array2<nFounders> >* funnelSingleLociHaplotypeProbabilities;
 	forwardsBackwardsAlgorithm(markerPatternsToUniqueValuesArgs& markerData, xMajorMatrix<expandedProbabilitiesType>& intercrossingHaplotypeProbabilities, rowMajorMatrix<expandedProbabilitiesType>& funnelHaplotypeProbabilities, int maxChromosomeSize)
-		: intercrossingHaplotypeProbabilities(intercrossingHaplotypeProbabilities), funnelHaplotypeProbabilities(funnelHaplotypeProbabilities), markerData(markerData), forwardProbabilities(nFounders, maxChromosomeSize), backwardProbabilities(nFounders, maxChromosomeSize)
+		: intercrossingHaplotypeProbabilities(intercrossingHaplotypeProbabilities), funnelHaplotypeProbabilities(funnelHaplotypeProbabilities), markerData(markerData), maxChromosomeSize(maxChromosomeSize)
 	{}
 	void apply(int start, int end)
 	{
@@ -42,19 +44,30 @@ template<int nFounders> struct forwardsBackwardsAlgorithm<nFounders, true>
 		maxAIGenerations = *std::max_element(intercrossingGenerations->begin(), intercrossingGenerations->end());
 		minAIGenerations = std::max(minAIGenerations, 1);
 		int nFinals = recodedFinals.nrow();
-		for(int finalCounter = 0; finalCounter < nFinals; finalCounter++)
+		//Lines are independent, so they can be processed in parallel. Every thread has its own forward and backward probabilities, and the transition probabilities are shared. Each line writes to its own rows of the results, so the output does not depend on the number of threads. 
+#ifdef USE_OPENMP
+		#pragma omp parallel
+#endif
 		{
-			if((*intercrossingGenerations)[finalCounter] == 0)
-			{
-				applyFunnel(start, end, finalCounter, (*lineFunnelIDs)[finalCounter]);
-			}
-			else
+			//Stored column-major, so that the probabilities for all states at a single marker are contiguous
+			columnMajorMatrix<double> forwardProbabilities(nFounders, maxChromosomeSize), backwardProbabilities(nFounders, maxChromosomeSize);
+#ifdef USE_OPENMP
+			#pragma omp for schedule(dynamic)
+#endif
+			for(int finalCounter = 0; finalCounter < nFinals; finalCounter++)
 			{
-				applyIntercrossing(start, end, finalCounter, (*intercrossingGenerations)[finalCounter]);
+				if((*intercrossingGenerations)[finalCounter] == 0)
+				{
+					applyFunnel(start, end, finalCounter, (*lineFunnelIDs)[finalCounter], forwardProbabilities, backwardProbabilities);
+				}
+				else
+				{
+					applyIntercrossing(start, end, finalCounter, (*intercrossingGenerations)[finalCounter], forwardProbabilities, backwardProbabilities);
+				}
 			}
 		}
 	}
-	void applyFunnel(int start, int end, int finalCounter, int funnelID)
+	void applyFunnel(int start, int end, int finalCounter, int funnelID, columnMajorMatrix<double>& forwardProbabilities, columnMajorMatrix<double>& backwardProbabilities)
 	{
 		//Compute forward probabilities
 		int markerValue = recodedFinals(finalCounter, start);
@@ -73,7 +86,7 @@ template<int nFounders> struct forwardsBackwardsAlgorithm<nFounders, true>
 					forwardProbabilities(funnel[founderCounter], 0) = 1;
 					validInitial++;
 				}
-				else forwardProbabilities(founderCounter, 0) = 0;
+				else forwardProbabilities(funnel[founderCounter], 0) = 0;
 			}
 			for(int founderCounter = 0; founderCounter < nFounders; founderCounter++)
 			{
@@ -134,19 +147,20 @@ template<int nFounders> struct forwardsBackwardsAlgorithm<nFounders, true>
 		//Now we can compute the marginal probabilities
 		for(int markerCounter = start; markerCounter < end; markerCounter++)
 		{
-			double sum = 0;
+			double sum = 0, marginal[nFounders];
 			for(int founderCounter = 0; founderCounter < nFounders; founderCounter++)
 			{
-				results(nFounders*finalCounter + founderCounter, markerCounter) = backwardProbabilities(founderCounter, markerCounter - start) * forwardProbabilities(founderCounter, markerCounter - start);
-				sum += results(nFounders*finalCounter + founderCounter, markerCounter);
+				marginal[founderCounter] = backwardProbabilities(founderCounter, markerCounter - start) * forwardProbabilities(founderCounter, markerCounter - start);
+				sum += marginal[founderCounter];
 			}
 			for(int founderCounter = 0; founderCounter < nFounders; founderCounter++)
 			{
-				results(nFounders*finalCounter + founderCounter, markerCounter) /= sum;
+				marginal[founderCounter] /= sum;
 			}
+			results.set(nFounders*finalCounter, markerCounter, marginal, nFounders);
 		}
 	}
-	void applyIntercrossing(int start, int end, int finalCounter, int intercrossingGeneration)
+	void applyIntercrossing(int start, int end, int finalCounter, int intercrossingGeneration, columnMajorMatrix<double>& forwardProbabilities, columnMajorMatrix<double>& backwardProbabilities)
 	{
 		int markerValue = recodedFinals(finalCounter, start);
 		//Compute forward probabilities
@@ -220,16 +234,17 @@ template<int nFounders> struct forwardsBackwardsAlgorithm<nFounders, true>
 		//Now we can compute the marginal probabilities
 		for(int markerCounter = start; markerCounter < end; markerCounter++)
 		{
-			double sum = 0;
+			double sum = 0, marginal[nFounders];
 			for(int founderCounter = 0; founderCounter < nFounders; founderCounter++)
 			{
-				results(nFounders*finalCounter + founderCounter, markerCounter) = backwardProbabilities(founderCounter, markerCounter - start) * forwardProbabilities(founderCounter, markerCounter - start);
-				sum += results(nFounders*finalCounter + founderCounter, markerCounter);
+				marginal[founderCounter] = backwardProbabilities(founderCounter, markerCounter - start) * forwardProbabilities(founderCounter, markerCounter - start);
+				sum += marginal[founderCounter];
 			}
 			for(int founderCounter = 0; founderCounter < nFounders; founderCounter++)
 			{
-				results(nFounders*finalCounter + founderCounter, markerCounter) /= sum;
+				marginal[founderCounter] /= sum;
 			}
+			results.set(nFounders*finalCounter, markerCounter, marginal, nFounders);
 		}
 	}
 };
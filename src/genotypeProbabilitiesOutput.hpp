@@ -0,0 +1,96 @@
+#ifndef GENOTYPE_PROBABILITIES_OUTPUT_HEADER_GUARD
+#define GENOTYPE_PROBABILITIES_OUTPUT_HEADER_GUARD
+#include <Rcpp.h>
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
+//The possible ways of storing the output of computeGenotypeProbabilities. Apart from doubleEncoding, the values are stored in a raw matrix, with bytesPerValue consecutive bytes (in the native byte order) for each probability.
+enum probabilitiesEncoding
+{
+	doubleEncoding, floatEncoding, uint16Encoding, uint8Encoding
+};
+//Destination for the marginal genotype probabilities. Different lines are written to different rows, so this can be written to from multiple threads at once.
+class genotypeProbabilitiesOutput
+{
+public:
+	genotypeProbabilitiesOutput()
+		: encoding(doubleEncoding), nRows(0), bytesPerValue(sizeof(double)), doubleData(NULL), rawData(NULL)
+	{}
+	static bool parseEncoding(const std::string& name, probabilitiesEncoding& result)
+	{
+		if(name == "double") result = doubleEncoding;
+		else if(name == "float") result = floatEncoding;
+		else if(name == "uint16") result = uint16Encoding;
+		else if(name == "uint8") result = uint8Encoding;
+		else return false;
+		return true;
+	}
+	//Allocate the R object that holds the output
+	genotypeProbabilitiesOutput(probabilitiesEncoding encoding, int nRows, int nMarkers)
+		: encoding(encoding), nRows(nRows), doubleData(NULL), rawData(NULL)
+	{
+		if(encoding == doubleEncoding)
+		{
+			bytesPerValue = sizeof(double);
+			Rcpp::NumericMatrix values(nRows, nMarkers);
+			doubleData = &(values(0, 0));
+			data = values;
+		}
+		else
+		{
+			if(encoding == floatEncoding) bytesPerValue = sizeof(float);
+			else if(encoding == uint16Encoding) bytesPerValue = sizeof(uint16_t);
+			else bytesPerValue = sizeof(uint8_t);
+			Rcpp::RawMatrix values(nRows * bytesPerValue, nMarkers);
+			rawData = &(values(0, 0));
+			data = values;
+		}
+	}
+	//Store n probabilities, starting at the given row
+	void set(int row, int marker, const double* values, int n)
+	{
+		std::size_t index = (std::size_t)marker * (std::size_t)nRows + (std::size_t)row;
+		switch(encoding)
+		{
+			case doubleEncoding:
+				std::copy(values, values + n, doubleData + index);
+				break;
+			case floatEncoding:
+				for(int i = 0; i < n; i++)
+				{
+					float value = (float)values[i];
+					memcpy(rawData + (index + i)*sizeof(float), &value, sizeof(float));
+				}
+				break;
+			case uint16Encoding:
+				for(int i = 0; i < n; i++)
+				{
+					uint16_t value = (uint16_t)(clamp(values[i]) * 65535 + 0.5);
+					memcpy(rawData + (index + i)*sizeof(uint16_t), &value, sizeof(uint16_t));
+				}
+				break;
+			case uint8Encoding:
+				for(int i = 0; i < n; i++)
+				{
+					rawData[index + i] = (uint8_t)(clamp(values[i]) * 255 + 0.5);
+				}
+				break;
+		}
+	}
+	Rcpp::RObject data;
+private:
+	//Rounding errors can push the normalised probabilities slightly outside [0, 1]
+	static double clamp(double value)
+	{
+		if(value > 1) return 1;
+		if(value >= 0) return value;
+		return 0;
+	}
+	probabilitiesEncoding encoding;
+	int nRows;
+	std::size_t bytesPerValue;
+	double* doubleData;
+	Rbyte* rawData;
+};
+#endif
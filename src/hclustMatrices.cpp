@@ -1,4 +1,10 @@
 #include "hclustMatrices.h"
+#include "rawSymmetricMatrix.h"
+#include <limits>
+#include <functional>
+#ifdef USE_OPENMP
+#include <omp.h>
+#endif
 R_xlen_t countPreClusterMarkers(SEXP preClusterResults_, bool& noDuplicates)
 {
 	Rcpp::List preClusterResults = preClusterResults_;
@@ -18,6 +24,23 @@ R_xlen_t countPreClusterMarkers(SEXP preClusterResults_, bool& noDuplicates)
 	noDuplicates = nMarkers1 == nMarkers2;
 	return nMarkers1;
 }
+//Copy the groups of markers out of the R list, so they can be used from multiple threads
+std::vector<std::vector<int> > preClusterGroups(Rcpp::List preClusterResults)
+{
+	std::vector<std::vector<int> > result(preClusterResults.size());
+	for(R_xlen_t i = 0; i < preClusterResults.size(); i++) result[i] = Rcpp::as<std::vector<int> >(preClusterResults(i));
+	return result;
+}
+//The same as *std::max_element over the values, which may be read from a file
+double maxValue(const rfValuesData& values)
+{
+	double result = values(0);
+	for(R_xlen_t i = 1; i < values.size(); i++)
+	{
+		if(result < values(i)) result = values(i);
+	}
+	return result;
+}
 SEXP hclustThetaMatrix(SEXP mpcrossRF_, SEXP preClusterResults_)
 {
 BEGIN_RCPP
@@ -33,7 +56,7 @@ BEGIN_RCPP
 	Rcpp::S4 rf = mpcrossRF.slot("rf");
 
 	Rcpp::S4 theta = rf.slot("theta");
-	Rcpp::RawVector data = theta.slot("data");
+	rawSymmetricMatrixData data(theta);
 	Rcpp::NumericVector levels = theta.slot("levels");
 	Rcpp::CharacterVector markers = theta.slot("markers");
 	if(markers.size() != preClusterMarkers)
@@ -43,18 +66,23 @@ BEGIN_RCPP
 	R_xlen_t resultDimension = preClusterResults.size();
 	//Allocate enough storage. This symmetric matrix stores the *LOWER* triangular part, in column-major storage. Excluding the diagonal. 
 	Rcpp::NumericVector result(((resultDimension-(R_xlen_t)1)*resultDimension)/(R_xlen_t)2);
+	std::vector<std::vector<int> > groups = preClusterGroups(preClusterResults);
+	Rcpp::NumericVector::iterator resultPtr = result.begin();
+#ifdef USE_OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
 	for(R_xlen_t column = 0; column < resultDimension; column++)
 	{
-		Rcpp::IntegerVector columnMarkers = preClusterResults(column);
+		const std::vector<int>& columnMarkers = groups[column];
 		for(R_xlen_t row = column + 1; row < resultDimension; row++)
 		{
-			Rcpp::IntegerVector rowMarkers = preClusterResults(row);
+			const std::vector<int>& rowMarkers = groups[row];
 			double total = 0;
 			R_xlen_t counter = 0;
-			for(R_xlen_t columnMarkerCounter = 0; columnMarkerCounter < columnMarkers.size(); columnMarkerCounter++)
+			for(R_xlen_t columnMarkerCounter = 0; columnMarkerCounter < (R_xlen_t)columnMarkers.size(); columnMarkerCounter++)
 			{
 				R_xlen_t marker1 = columnMarkers[columnMarkerCounter]-(R_xlen_t)1;
-				for(R_xlen_t rowMarkerCounter = 0; rowMarkerCounter < rowMarkers.size(); rowMarkerCounter++)
+				for(R_xlen_t rowMarkerCounter = 0; rowMarkerCounter < (R_xlen_t)rowMarkers.size(); rowMarkerCounter++)
 				{
 					R_xlen_t marker2 = rowMarkers[rowMarkerCounter]-(R_xlen_t)1;
 					R_xlen_t column = std::max(marker1, marker2);
@@ -69,7 +97,7 @@ BEGIN_RCPP
 			}
 			if(counter == 0) total = 0.5;
 			else total /= counter;
-			result(((resultDimension-(R_xlen_t)1)*resultDimension)/(R_xlen_t)2 - ((resultDimension - column)*(resultDimension-column-(R_xlen_t)1))/(R_xlen_t)2 + row-column-(R_xlen_t)1) = total;
+			resultPtr[((resultDimension-(R_xlen_t)1)*resultDimension)/(R_xlen_t)2 - ((resultDimension - column)*(resultDimension-column-(R_xlen_t)1))/(R_xlen_t)2 + row-column-(R_xlen_t)1] = total;
 		}
 	}
 	return result;
@@ -89,17 +117,15 @@ BEGIN_RCPP
 	Rcpp::S4 mpcrossRF = mpcrossRF_;
 	Rcpp::S4 rf = mpcrossRF.slot("rf");
 
-	Rcpp::RObject lodObject = rf.slot("lod");
-	if(lodObject.isNULL())
+	Rcpp::S4 theta = rf.slot("theta");
+	rawSymmetricMatrixData data(theta);
+	rfValuesData lodData(rf, data, rfValuesData::lodValues);
+	if(!lodData.present())
 	{
 		throw std::runtime_error("Slot mpcrossRF@rf@lod cannot be NULL if clusterBy is equal to \"combined\"");
 	}
-	Rcpp::S4 lod = Rcpp::as<Rcpp::S4>(lodObject);
-	Rcpp::S4 theta = rf.slot("theta");
-	Rcpp::RawVector data = theta.slot("data");
 	Rcpp::NumericVector levels = theta.slot("levels");
 	Rcpp::CharacterVector markers = theta.slot("markers");
-	Rcpp::NumericVector lodData = lod.slot("x");
 	if(markers.size() != preClusterMarkers || lodData.size() != (preClusterMarkers*(preClusterMarkers+(R_xlen_t)1))/(R_xlen_t)2)
 	{
 		throw std::runtime_error("Number of markers in precluster object was inconsistent with number of markers in mpcrossRF object");
@@ -111,22 +137,27 @@ BEGIN_RCPP
 	{
 		minDifference = std::min(minDifference, levels[i+1] - levels[i]);
 	}
-	double maxLod = *std::max_element(lodData.begin(), lodData.end());
+	double maxLod = maxValue(lodData);
 	double lodMultiplier = minDifference/maxLod;
 	//Allocate enough storage. This symmetric matrix stores the *LOWER* triangular part, in column-major storage. Excluding the diagonal. 
 	Rcpp::NumericVector result(((resultDimension-(R_xlen_t)1)*resultDimension)/(R_xlen_t)2);
+	std::vector<std::vector<int> > groups = preClusterGroups(preClusterResults);
+	Rcpp::NumericVector::iterator resultPtr = result.begin();
+#ifdef USE_OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
 	for(R_xlen_t column = 0; column < resultDimension; column++)
 	{
-		Rcpp::IntegerVector columnMarkers = preClusterResults(column);
+		const std::vector<int>& columnMarkers = groups[column];
 		for(R_xlen_t row = column + (R_xlen_t)1; row < resultDimension; row++)
 		{
-			Rcpp::IntegerVector rowMarkers = preClusterResults(row);
+			const std::vector<int>& rowMarkers = groups[row];
 			double total = 0;
 			R_xlen_t counter = 0;
-			for(int columnMarkerCounter = 0; columnMarkerCounter < columnMarkers.size(); columnMarkerCounter++)
+			for(int columnMarkerCounter = 0; columnMarkerCounter < (R_xlen_t)columnMarkers.size(); columnMarkerCounter++)
 			{
 				R_xlen_t marker1 = columnMarkers[columnMarkerCounter]-(R_xlen_t)1;
-				for(int rowMarkerCounter = 0; rowMarkerCounter < rowMarkers.size(); rowMarkerCounter++)
+				for(int rowMarkerCounter = 0; rowMarkerCounter < (R_xlen_t)rowMarkers.size(); rowMarkerCounter++)
 				{
 					R_xlen_t marker2 = rowMarkers[rowMarkerCounter]-(R_xlen_t)1;
 					R_xlen_t column = std::max(marker1, marker2);
@@ -142,7 +173,7 @@ BEGIN_RCPP
 			}
 			if(counter == 0) total = 0.5 + minDifference;
 			else total /= counter;
-			result(((resultDimension-1)*resultDimension)/(R_xlen_t)2 - ((resultDimension - column)*(resultDimension-column-(R_xlen_t)1))/(R_xlen_t)2 + row-column-(R_xlen_t)1) = total;
+			resultPtr[((resultDimension-1)*resultDimension)/(R_xlen_t)2 - ((resultDimension - column)*(resultDimension-column-(R_xlen_t)1))/(R_xlen_t)2 + row-column-(R_xlen_t)1] = total;
 		}
 	}
 	return result;
@@ -162,33 +193,38 @@ BEGIN_RCPP
 	Rcpp::S4 mpcrossRF = mpcrossRF_;
 	Rcpp::S4 rf = mpcrossRF.slot("rf");
 
-	Rcpp::RObject lodObject = rf.slot("lod");
-	if(lodObject.isNULL())
+	Rcpp::S4 theta = rf.slot("theta");
+	rawSymmetricMatrixData data(theta);
+	rfValuesData lodData(rf, data, rfValuesData::lodValues);
+	if(!lodData.present())
 	{
 		throw std::runtime_error("Slot mpcrossRF@rf@lod cannot be NULL if clusterBy is equal to \"combined\"");
 	}
-	Rcpp::S4 lod = Rcpp::as<Rcpp::S4>(lodObject);
-	Rcpp::NumericVector lodData = lod.slot("x");
 	if(lodData.size() != (preClusterMarkers*(preClusterMarkers+(R_xlen_t)1))/(R_xlen_t)2)
 	{
 		throw std::runtime_error("Number of markers in precluster object was inconsistent with number of markers in mpcrossRF object");
 	}
 	R_xlen_t resultDimension = preClusterResults.size();
-	double maxLod = *std::max_element(lodData.begin(), lodData.end());
+	double maxLod = maxValue(lodData);
 	//Allocate enough storage. This symmetric matrix stores the *LOWER* triangular part, in column-major storage. Excluding the diagonal. 
 	Rcpp::NumericVector result(((resultDimension-(R_xlen_t)1)*resultDimension)/(R_xlen_t)2);
+	std::vector<std::vector<int> > groups = preClusterGroups(preClusterResults);
+	Rcpp::NumericVector::iterator resultPtr = result.begin();
+#ifdef USE_OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
 	for(R_xlen_t column = 0; column < resultDimension; column++)
 	{
-		Rcpp::IntegerVector columnMarkers = preClusterResults(column);
+		const std::vector<int>& columnMarkers = groups[column];
 		for(R_xlen_t row = column + 1; row < resultDimension; row++)
 		{
-			Rcpp::IntegerVector rowMarkers = preClusterResults(row);
+			const std::vector<int>& rowMarkers = groups[row];
 			double total = 0;
 			int counter = 0;
-			for(R_xlen_t columnMarkerCounter = 0; columnMarkerCounter < columnMarkers.size(); columnMarkerCounter++)
+			for(R_xlen_t columnMarkerCounter = 0; columnMarkerCounter < (R_xlen_t)columnMarkers.size(); columnMarkerCounter++)
 			{
 				R_xlen_t marker1 = columnMarkers[columnMarkerCounter]-(R_xlen_t)1;
-				for(R_xlen_t rowMarkerCounter = 0; rowMarkerCounter < rowMarkers.size(); rowMarkerCounter++)
+				for(R_xlen_t rowMarkerCounter = 0; rowMarkerCounter < (R_xlen_t)rowMarkers.size(); rowMarkerCounter++)
 				{
 					R_xlen_t marker2 = rowMarkers[rowMarkerCounter]-(R_xlen_t)1;
 					R_xlen_t column = std::max(marker1, marker2);
@@ -203,9 +239,202 @@ BEGIN_RCPP
 			}
 			if(counter == 0) total = maxLod;
 			else total /= counter;
-			result(((resultDimension-(R_xlen_t)1)*resultDimension)/(R_xlen_t)2 - ((resultDimension - column)*(resultDimension-column-(R_xlen_t)1))/(R_xlen_t)2 + row-column-(R_xlen_t)1) = maxLod - total;
+			resultPtr[((resultDimension-(R_xlen_t)1)*resultDimension)/(R_xlen_t)2 - ((resultDimension - column)*(resultDimension-column-(R_xlen_t)1))/(R_xlen_t)2 + row-column-(R_xlen_t)1] = maxLod - total;
 		}
 	}
 	return result;
 END_RCPP;
 }
+//Index of entry (row, column) in a packed triangle that excludes the diagonal, where row < column
+inline std::size_t packedOffDiagonalIndex(std::size_t row, std::size_t column)
+{
+	return (column * (column - 1)) / 2 + row;
+}
+/* Average, complete or single linkage clustering of the markers, cut into the specified number of groups. 
+ *
+ * The distances are computed from the packed theta and lod data as in formGroups, and held in double precision in a single packed triangle which is updated as clusters are merged, so no dense matrices are needed. The merges are found with the nearest-neighbour chain algorithm, which gives the same tree as the usual algorithm for these linkages, and the same heights as fastcluster. The result numbers the groups in order of their first marker, like cutree. If two merges are tied the order in which they are made can differ from fastcluster, and for average and complete linkage that can change the later merges, and so the groups. Merging exact duplicates (markers with identical rows of distances) doesn't change any distances, so ties between them don't matter. 
+ */
+SEXP hclustPacked(SEXP mpcrossRF_, SEXP clusterBy_, SEXP method_, SEXP groups_)
+{
+BEGIN_RCPP
+	Rcpp::S4 mpcrossRF = mpcrossRF_;
+	Rcpp::S4 rf = mpcrossRF.slot("rf");
+	std::string clusterBy = Rcpp::as<std::string>(clusterBy_);
+	std::string method = Rcpp::as<std::string>(method_);
+	if(clusterBy != "combined" && clusterBy != "theta" && clusterBy != "lod")
+	{
+		throw std::runtime_error("Input clusterBy must be one of 'combined', 'theta' or 'lod'");
+	}
+	if(method != "average" && method != "complete" && method != "single")
+	{
+		throw std::runtime_error("Input method must be one of 'average', 'complete' or 'single'");
+	}
+
+	Rcpp::S4 theta = rf.slot("theta");
+	rawSymmetricMatrixData data(theta);
+	std::vector<double> levels = Rcpp::as<std::vector<double> >(theta.slot("levels"));
+	Rcpp::CharacterVector markers = theta.slot("markers");
+	std::size_t nMarkers = markers.size();
+	int groups = Rcpp::as<int>(groups_);
+	if(groups < 1 || groups > (int)nMarkers)
+	{
+		throw std::runtime_error("Input groups must be between 1 and the number of markers");
+	}
+	enum {averageLinkage, completeLinkage, singleLinkage} linkage = method == "average" ? averageLinkage : (method == "complete" ? completeLinkage : singleLinkage);
+	bool useTheta = clusterBy != "lod", useLod = clusterBy != "theta";
+	rfValuesData lodData;
+	//The lod part of the distance is (maxLod - lod) / lodDivisor * lodScale, in the same order of operations as formGroups used to compute it in R
+	double maxLod = 0, lodDivisor = 1, lodScale = 0;
+	if(useLod)
+	{
+		lodData = rfValuesData(rf, data, rfValuesData::lodValues);
+		if(!lodData.present())
+		{
+			throw std::runtime_error("Slot mpcrossRF@rf@lod cannot be NULL if clusterBy is equal to \"combined\" or \"lod\"");
+		}
+		if(lodData.size() != (R_xlen_t)((nMarkers*(nMarkers+1))/2))
+		{
+			throw std::runtime_error("Slot mpcrossRF@rf@lod had the wrong size");
+		}
+		//Missing lod values count as zero, including when computing the range
+		double minLod = 0;
+		for(R_xlen_t i = 0; i < lodData.size(); i++)
+		{
+			double value = ISNAN(lodData(i)) ? 0 : lodData(i);
+			if(i == 0) maxLod = minLod = value;
+			maxLod = std::max(maxLod, value);
+			minLod = std::min(minLod, value);
+		}
+		//For clusterBy = "combined" the scaled lod only breaks ties in theta
+		if(!useTheta) lodScale = 1;
+		else if(maxLod > minLod)
+		{
+			double minDifference = std::numeric_limits<double>::infinity();
+			for(std::size_t i = 0; i + 1 < levels.size(); i++) minDifference = std::min(minDifference, fabs(levels[i+1] - levels[i]));
+			lodDivisor = maxLod - minLod;
+			lodScale = minDifference;
+		}
+	}
+	const Rbyte* thetaData = data.data();
+
+	//Initial distances
+	std::vector<double> distances((nMarkers * (nMarkers - 1)) / 2);
+#ifdef USE_OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for(long column = 1; column < (long)nMarkers; column++)
+	{
+		std::size_t packedColumn = ((std::size_t)column * (column + 1)) / 2;
+		for(long row = 0; row < column; row++)
+		{
+			double distance = 0;
+			if(useTheta)
+			{
+				Rbyte value = thetaData[packedColumn + row];
+				distance += value == 0xFF ? 0.5 : levels[value];
+			}
+			if(useLod)
+			{
+				double lod = lodData(packedColumn + row);
+				if(ISNAN(lod)) lod = 0;
+				distance += (maxLod - lod) / lodDivisor * lodScale;
+			}
+			distances[packedOffDiagonalIndex(row, column)] = distance;
+		}
+	}
+	auto distance = [&distances](std::size_t a, std::size_t b) -> double&
+	{
+		if(a > b) std::swap(a, b);
+		return distances[packedOffDiagonalIndex(a, b)];
+	};
+
+	//Nearest-neighbour chain. Each cluster is identified by the position of one of its markers. 
+	std::vector<std::size_t> active(nMarkers), chain, sizes(nMarkers, 1);
+	for(std::size_t i = 0; i < nMarkers; i++) active[i] = i;
+	struct merge
+	{
+		std::size_t first, second;
+		double height;
+	};
+	std::vector<merge> merges;
+	merges.reserve(nMarkers);
+	while(active.size() > 1)
+	{
+		if(chain.size() == 0) chain.push_back(active[0]);
+		std::size_t a, b;
+		while(true)
+		{
+			a = chain.back();
+			//If the previous element of the chain is one of the nearest neighbours, choose it
+			std::size_t nearest = chain.size() > 1 ? chain[chain.size() - 2] : nMarkers;
+			double nearestDistance = nearest != nMarkers ? distance(a, nearest) : std::numeric_limits<double>::infinity();
+			for(std::vector<std::size_t>::iterator other = active.begin(); other != active.end(); other++)
+			{
+				if(*other == a) continue;
+				double current = distance(a, *other);
+				if(current < nearestDistance)
+				{
+					nearestDistance = current;
+					nearest = *other;
+				}
+			}
+			if(chain.size() > 1 && nearest == chain[chain.size() - 2])
+			{
+				b = nearest;
+				break;
+			}
+			chain.push_back(nearest);
+		}
+		chain.pop_back();
+		chain.pop_back();
+		if(a > b) std::swap(a, b);
+		merges.push_back({a, b, distance(a, b)});
+		//The merged cluster takes the place of a. Update its distances with the Lance-Williams formula. 
+		active.erase(std::find(active.begin(), active.end(), b));
+		//The weights are computed as in fastcluster, so that the results are rounded in the same way
+		double weightA = (double)sizes[a] / (double)(sizes[a] + sizes[b]), weightB = (double)sizes[b] / (double)(sizes[a] + sizes[b]);
+		long nActive = (long)active.size();
+#ifdef USE_OPENMP
+		#pragma omp parallel for schedule(static) if(nActive > 10000)
+#endif
+		for(long i = 0; i < nActive; i++)
+		{
+			std::size_t other = active[i];
+			if(other == a) continue;
+			double& toA = distance(a, other);
+			double toB = distance(b, other);
+			if(linkage == averageLinkage) toA = weightA * toA + weightB * toB;
+			else if(linkage == completeLinkage) toA = std::max(toA, toB);
+			else toA = std::min(toA, toB);
+		}
+		sizes[a] += sizes[b];
+	}
+	//Apply the lowest merges, to get the requested number of groups
+	std::stable_sort(merges.begin(), merges.end(), [](const merge& x, const merge& y){ return x.height < y.height; });
+	std::vector<std::size_t> parent(nMarkers);
+	for(std::size_t i = 0; i < nMarkers; i++) parent[i] = i;
+	std::function<std::size_t(std::size_t)> findRoot = [&parent](std::size_t marker)
+	{
+		while(parent[marker] != marker)
+		{
+			parent[marker] = parent[parent[marker]];
+			marker = parent[marker];
+		}
+		return marker;
+	};
+	for(std::size_t i = 0; i < nMarkers - groups; i++)
+	{
+		parent[findRoot(merges[i].second)] = findRoot(merges[i].first);
+	}
+	Rcpp::IntegerVector result(nMarkers);
+	std::vector<int> groupOfRoot(nMarkers, 0);
+	int nextGroup = 1;
+	for(std::size_t i = 0; i < nMarkers; i++)
+	{
+		std::size_t root = findRoot(i);
+		if(groupOfRoot[root] == 0) groupOfRoot[root] = nextGroup++;
+		result[i] = groupOfRoot[root];
+	}
+	return result;
+END_RCPP
+}
@@ -4,4 +4,6 @@
 SEXP hclustCombinedMatrix(SEXP preClusterResults, SEXP mpcrossRF);
 SEXP hclustThetaMatrix(SEXP preClusterResults, SEXP mpcrossRF);
 SEXP hclustLodMatrix(SEXP preClusterResults, SEXP mpcrossRF);
+//Cluster the markers directly from the packed theta and lod data, returning the group of every marker
+SEXP hclustPacked(SEXP mpcrossRF, SEXP clusterBy, SEXP method, SEXP groups);
 #endif
@@ -5,6 +5,14 @@
 #include <functional>
 #include <Rcpp.h>
 bool impute(unsigned char* theta, std::vector<double>& thetaLevels, double* lod, double* lkhd, std::vector<int>& markers, std::string& error, std::function<void(unsigned long, unsigned long)> statusFunction);
-SEXP imputeWholeObject(SEXP mpcrossLG, SEXP verbose);
+/* Impute several groups, where theta[i] holds the packed data for the markers markers[i]. 
+ *
+ * Groups with a large share of the work are imputed first, one at a time using every thread. The remaining groups are then imputed concurrently, one per thread. The imputation of a group does not depend on the number of threads, so neither does the result. 
+ */
+bool imputeGroups(std::vector<unsigned char*>& theta, std::vector<double>& thetaLevels, std::vector<std::vector<int> >& markers, const std::vector<int>& groupNames, std::string& error, std::function<void(unsigned long, unsigned long)> statusFunction);
+/* Impute every group, and return the whole of the imputed theta, lod and lkhd data. If the theta values reference a file, the results are instead written to a new file with name file, which is returned. 
+ */
+SEXP imputeWholeObject(SEXP mpcrossLG, SEXP verbose, SEXP file);
 SEXP imputeGroup(SEXP mpcrossLG_sexp, SEXP verbose_sexp, SEXP group_sexp);
+SEXP imputeAllGroups(SEXP mpcrossLG_sexp, SEXP verbose_sexp);
 #endif
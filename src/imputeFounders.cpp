@@ -14,6 +14,9 @@
 #include "funnelHaplotypeToMarker.hpp"
 #include "viterbi.hpp"
 #include "recodeHetsAsNA.h"
+#ifdef USE_OPENMP
+#include <omp.h>
+#endif
 template<int nFounders, bool infiniteSelfing> void imputedFoundersInternal2(Rcpp::IntegerMatrix founders, Rcpp::IntegerMatrix finals, Rcpp::S4 pedigree, Rcpp::List hetData, Rcpp::List map, Rcpp::IntegerMatrix results, double homozygoteMissingProb, double heterozygoteMissingProb, Rcpp::IntegerMatrix key)
 {
 	//Work out maximum number of markers per chromosome
@@ -117,8 +120,14 @@ template<int nFounders, bool infiniteSelfing> void imputedFoundersInternal2(Rcpp
 	Rcpp::IntegerMatrix intermediate(nFounders, maxChromosomeMarkers);
 	int cumulativeMarkerCounter = 0;
 
-	xMajorMatrix<expandedProbabilitiesType> intercrossingHaplotypeProbabilities(maxChromosomeMarkers-1, maxAIGenerations - minAIGenerations + 1, maxSelfing - minSelfing+1);
-	rowMajorMatrix<expandedProbabilitiesType> funnelHaplotypeProbabilities(maxChromosomeMarkers-1, maxSelfing - minSelfing + 1);
+	//Lines are processed in parallel. If there are fewer lines than threads, several chromosomes are processed at once, which requires haplotype probabilities for all of them. 
+	int nThreads = 1;
+#ifdef USE_OPENMP
+	nThreads = omp_get_max_threads();
+#endif
+	int chromosomesPerBatch = std::max(1, std::min((int)map.size(), (nThreads + nFinals - 1) / std::max(nFinals, 1)));
+	xMajorMatrix<expandedProbabilitiesType> intercrossingHaplotypeProbabilities(chromosomesPerBatch*maxChromosomeMarkers-1, maxAIGenerations - minAIGenerations + 1, maxSelfing - minSelfing+1);
+	rowMajorMatrix<expandedProbabilitiesType> funnelHaplotypeProbabilities(chromosomesPerBatch*maxChromosomeMarkers-1, maxSelfing - minSelfing + 1);
 
 	//The single loci probabilities are different depending on whether there are zero or one generations of intercrossing. But once you have non-zero generations, it doesn't matter how many
 	std::vector<array2<nFounders> > intercrossingSingleLociHaplotypeProbabilities(maxSelfing - minSelfing+1);
@@ -161,31 +170,38 @@ template<int nFounders, bool infiniteSelfing> void imputedFoundersInternal2(Rcpp
 	viterbi.intercrossingSingleLociHaplotypeProbabilities = &intercrossingSingleLociHaplotypeProbabilities;
 	viterbi.funnelSingleLociHaplotypeProbabilities = &funnelSingleLociHaplotypeProbabilities;
 
-	//Now actually run the Viterbi algorithm. To cut down on memory usage we run a single chromosome at a time
-	for(int chromosomeCounter = 0; chromosomeCounter < map.size(); chromosomeCounter++)
+	//Now actually run the Viterbi algorithm. To cut down on memory usage we only compute the haplotype probabilities for a single batch of chromosomes at a time
+	for(int batchStart = 0; batchStart < map.size(); batchStart += chromosomesPerBatch)
 	{
-		Rcpp::NumericVector positions = Rcpp::as<Rcpp::NumericVector>(map(chromosomeCounter));
-		Rcpp::NumericVector recombinationFractions = haldaneToRf(diff(positions));
-		//Generate haplotype probability data. 
-		for(int markerCounter = 0; markerCounter < recombinationFractions.size(); markerCounter++)
+		int batchEnd = std::min((int)map.size(), batchStart + chromosomesPerBatch);
+		std::vector<std::pair<int, int> > chromosomes;
+		viterbi.transitionOffset = cumulativeMarkerCounter;
+		for(int chromosomeCounter = batchStart; chromosomeCounter < batchEnd; chromosomeCounter++)
 		{
-			double recombination = recombinationFractions(markerCounter);
-			for(int selfingGenerationCounter = minSelfing; selfingGenerationCounter <= maxSelfing; selfingGenerationCounter++)
+			Rcpp::NumericVector positions = Rcpp::as<Rcpp::NumericVector>(map(chromosomeCounter));
+			Rcpp::NumericVector recombinationFractions = haldaneToRf(diff(positions));
+			//Generate haplotype probability data. 
+			for(int markerCounter = 0; markerCounter < recombinationFractions.size(); markerCounter++)
 			{
-				expandedGenotypeProbabilities<nFounders, infiniteSelfing, true>::noIntercross(funnelHaplotypeProbabilities(markerCounter, selfingGenerationCounter - minSelfing), recombination, selfingGenerationCounter, nFunnels);
-			}
-			for(int selfingGenerationCounter = minSelfing; selfingGenerationCounter <= maxSelfing; selfingGenerationCounter++)
-			{
-				for(int intercrossingGenerations =  minAIGenerations; intercrossingGenerations <= maxAIGenerations; intercrossingGenerations++)
+				double recombination = recombinationFractions(markerCounter);
+				int row = cumulativeMarkerCounter + markerCounter - viterbi.transitionOffset;
+				for(int selfingGenerationCounter = minSelfing; selfingGenerationCounter <= maxSelfing; selfingGenerationCounter++)
 				{
-					expandedGenotypeProbabilities<nFounders, infiniteSelfing, true>::withIntercross(intercrossingHaplotypeProbabilities(markerCounter, intercrossingGenerations - minAIGenerations, selfingGenerationCounter - minSelfing), intercrossingGenerations, recombination, selfingGenerationCounter, nFunnels);
+					expandedGenotypeProbabilities<nFounders, infiniteSelfing, true>::noIntercross(funnelHaplotypeProbabilities(row, selfingGenerationCounter - minSelfing), recombination, selfingGenerationCounter, nFunnels);
+				}
+				for(int selfingGenerationCounter = minSelfing; selfingGenerationCounter <= maxSelfing; selfingGenerationCounter++)
+				{
+					for(int intercrossingGenerations =  minAIGenerations; intercrossingGenerations <= maxAIGenerations; intercrossingGenerations++)
+					{
+						expandedGenotypeProbabilities<nFounders, infiniteSelfing, true>::withIntercross(intercrossingHaplotypeProbabilities(row, intercrossingGenerations - minAIGenerations, selfingGenerationCounter - minSelfing), intercrossingGenerations, recombination, selfingGenerationCounter, nFunnels);
+					}
 				}
 			}
-
+			chromosomes.push_back(std::make_pair(cumulativeMarkerCounter, cumulativeMarkerCounter+(int)positions.size()));
+			cumulativeMarkerCounter += (int)positions.size();
 		}
 		//dispatch based on whether we have infinite generations of selfing or not. 
-		viterbi.apply(cumulativeMarkerCounter, cumulativeMarkerCounter+(int)positions.size());
-		cumulativeMarkerCounter += (int)positions.size();
+		viterbi.apply(chromosomes);
 	}
 }
 template<int nFounders> void imputedFoundersInternal1(Rcpp::IntegerMatrix founders, Rcpp::IntegerMatrix finals, Rcpp::S4 pedigree, Rcpp::List hetData, Rcpp::List map, Rcpp::IntegerMatrix results, bool infiniteSelfing, double homozygoteMissingProb, double heterozygoteMissingProb, Rcpp::IntegerMatrix key)
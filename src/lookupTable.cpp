@@ -0,0 +1,82 @@
+#include "lookupTable.h"
+#include <cstring>
+#include <stdint.h>
+namespace
+{
+	//The serialised form starts with the numbers of alleles of the two patterns
+	const std::size_t serialisedHeaderBytes = 2 * sizeof(int32_t);
+}
+std::size_t singleMarkerPairData::serialisedSize(int nFirstAlleles, int nSecondAlleles, int nRecombLevels, int nDifferentFunnels, int nDifferentAIGenerations, int nDifferentSelfingGenerations)
+{
+	std::size_t nClassesAndSelfing = (std::size_t)(nDifferentFunnels + nDifferentAIGenerations) * (std::size_t)nDifferentSelfingGenerations;
+	return serialisedHeaderBytes + (std::size_t)nRecombLevels * nClassesAndSelfing * (std::size_t)nFirstAlleles * (std::size_t)nSecondAlleles * sizeof(double) + nClassesAndSelfing;
+}
+/* The serialised form is the number of alleles of the first and second patterns (as 32-bit integers), followed by the values and then the allowable flags, both in the same layout as in memory. So there are nFirstAlleles by nSecondAlleles values for every class, number of selfing generations and recombination fraction. 
+ */
+void singleMarkerPairData::serialise(unsigned char* output) const
+{
+	int32_t header[2] = {(int32_t)nFirstAlleles, (int32_t)nSecondAlleles};
+	memcpy(output, header, serialisedHeaderBytes);
+	output += serialisedHeaderBytes;
+	std::size_t nClassesAndSelfing = (std::size_t)nClasses * (std::size_t)nDifferentSelfingGenerations;
+	std::size_t valueBytes = (std::size_t)nRecombLevels * nClassesAndSelfing * (std::size_t)nFirstAlleles * (std::size_t)nSecondAlleles * sizeof(double);
+	memcpy(output, values, valueBytes);
+	memcpy(output + valueBytes, allowable, nClassesAndSelfing);
+}
+bool singleMarkerPairData::deserialise(const unsigned char* input, std::size_t inputBytes) const
+{
+	if(inputBytes != serialisedSize()) return false;
+	int32_t header[2];
+	memcpy(header, input, serialisedHeaderBytes);
+	if(header[0] != nFirstAlleles || header[1] != nSecondAlleles) return false;
+	input += serialisedHeaderBytes;
+	std::size_t nClassesAndSelfing = (std::size_t)nClasses * (std::size_t)nDifferentSelfingGenerations;
+	std::size_t valueBytes = (std::size_t)nRecombLevels * nClassesAndSelfing * (std::size_t)nFirstAlleles * (std::size_t)nSecondAlleles * sizeof(double);
+	memcpy(values, input, valueBytes);
+	memcpy(allowable, input + valueBytes, nClassesAndSelfing);
+	return true;
+}
+void singleMarkerPairData::clear() const
+{
+	std::size_t nValues = (std::size_t)nRecombLevels * (std::size_t)nClasses * (std::size_t)nDifferentSelfingGenerations * (std::size_t)nFirstAlleles * (std::size_t)nSecondAlleles;
+	std::fill(values, values + nValues, 0.0);
+	std::fill(allowable, allowable + (std::size_t)nClasses * (std::size_t)nDifferentSelfingGenerations, 0);
+}
+namespace
+{
+	//The offset (in doubles) of the entry for every pair of patterns, followed by the total number of doubles
+	void computeOffsets(const std::vector<markerData>& allMarkerPatterns, std::size_t valuesPerAllelePair, std::vector<std::size_t>& offsets)
+	{
+		std::size_t nPatterns = allMarkerPatterns.size();
+		offsets.resize(nPatterns * (nPatterns + 1) / 2 + 1);
+		std::size_t current = 0, pairIndex = 0;
+		//Entry (first, second) with first <= second is at index second*(second+1)/2 + first
+		for(std::size_t secondPattern = 0; secondPattern < nPatterns; secondPattern++)
+		{
+			for(std::size_t firstPattern = 0; firstPattern <= secondPattern; firstPattern++)
+			{
+				offsets[pairIndex] = current;
+				current += valuesPerAllelePair * (std::size_t)allMarkerPatterns[firstPattern].nObservedValues * (std::size_t)allMarkerPatterns[secondPattern].nObservedValues;
+				pairIndex++;
+			}
+		}
+		offsets[pairIndex] = current;
+	}
+}
+allMarkerPairData::allMarkerPairData(const std::vector<markerData>& allMarkerPatterns, int nRecombLevels, int nDifferentFunnels, int nDifferentAIGenerations, int nDifferentSelfingGenerations)
+	: nRecombLevels(nRecombLevels), nDifferentFunnels(nDifferentFunnels), nDifferentAIGenerations(nDifferentAIGenerations), nDifferentSelfingGenerations(nDifferentSelfingGenerations), allowablePerPair((std::size_t)(nDifferentFunnels + nDifferentAIGenerations) * (std::size_t)nDifferentSelfingGenerations)
+{
+	std::size_t nPatterns = allMarkerPatterns.size();
+	nObservedValues.resize(nPatterns);
+	for(std::size_t i = 0; i < nPatterns; i++) nObservedValues[i] = allMarkerPatterns[i].nObservedValues;
+	computeOffsets(allMarkerPatterns, (std::size_t)nRecombLevels * allowablePerPair, offsets);
+	values.reset(new double[std::max(offsets.back(), (std::size_t)1)]);
+	allowable.reset(new unsigned char[std::max(allowablePerPair * (offsets.size() - 1), (std::size_t)1)]);
+}
+std::size_t allMarkerPairData::requiredBytes(const std::vector<markerData>& allMarkerPatterns, int nRecombLevels, int nDifferentFunnels, int nDifferentAIGenerations, int nDifferentSelfingGenerations)
+{
+	std::size_t allowablePerPair = (std::size_t)(nDifferentFunnels + nDifferentAIGenerations) * (std::size_t)nDifferentSelfingGenerations;
+	std::vector<std::size_t> offsets;
+	computeOffsets(allMarkerPatterns, (std::size_t)nRecombLevels * allowablePerPair, offsets);
+	return offsets.back() * sizeof(double) + allowablePerPair * (offsets.size() - 1) + offsets.size() * sizeof(std::size_t);
+}
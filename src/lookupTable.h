@@ -0,0 +1,101 @@
+#ifndef LOOKUP_TABLE_HEADER_GUARD
+#define LOOKUP_TABLE_HEADER_GUARD
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <algorithm>
+#include "markerPatternsToUniqueValues.h"
+/* The lookup table entry for a single pair of marker patterns. This is a view into the storage of allMarkerPairData.
+ *
+ * Lines are divided into classes, with one class per funnel followed by one class per number of intercrossing generations. For every class, number of selfing generations and pair of marker alleles, there is one value per recombination fraction, and these are stored contiguously. Only the alleles which can actually be observed for the two patterns are stored.
+ */
+class singleMarkerPairData
+{
+public:
+	singleMarkerPairData(double* values, unsigned char* allowable, int nFirstAlleles, int nSecondAlleles, int nRecombLevels, int nDifferentFunnels, int nDifferentAIGenerations, int nDifferentSelfingGenerations)
+		: values(values), allowable(allowable), nFirstAlleles(nFirstAlleles), nSecondAlleles(nSecondAlleles), nRecombLevels(nRecombLevels), nDifferentFunnels(nDifferentFunnels), nClasses(nDifferentFunnels + nDifferentAIGenerations), nDifferentSelfingGenerations(nDifferentSelfingGenerations)
+	{}
+	//The values for lines from this funnel, for every recombination fraction
+	double* perFunnelData(int funnel, int selfing, int allele1, int allele2) const
+	{
+		return values + index(funnel, selfing, allele1, allele2);
+	}
+	//The values for lines with this many intercrossing generations (minus one), for every recombination fraction
+	double* perAIGenerationData(int intercrossingGenerations, int selfing, int allele1, int allele2) const
+	{
+		return values + index(nDifferentFunnels + intercrossingGenerations, selfing, allele1, allele2);
+	}
+	//Whether this pair of markers is informative for lines from this funnel. Stored as unsigned char rather than bool, so that different entries can be written from different threads.
+	unsigned char& allowableFunnel(int funnel, int selfing) const
+	{
+		return allowable[funnel * nDifferentSelfingGenerations + selfing];
+	}
+	unsigned char& allowableAI(int intercrossingGenerations, int selfing) const
+	{
+		return allowable[(nDifferentFunnels + intercrossingGenerations) * nDifferentSelfingGenerations + selfing];
+	}
+	int getNFirstAlleles() const
+	{
+		return nFirstAlleles;
+	}
+	int getNSecondAlleles() const
+	{
+		return nSecondAlleles;
+	}
+	//The number of bytes required to serialise an entry with these dimensions
+	static std::size_t serialisedSize(int nFirstAlleles, int nSecondAlleles, int nRecombLevels, int nDifferentFunnels, int nDifferentAIGenerations, int nDifferentSelfingGenerations);
+	std::size_t serialisedSize() const
+	{
+		return serialisedSize(nFirstAlleles, nSecondAlleles, nRecombLevels, nDifferentFunnels, nClasses - nDifferentFunnels, nDifferentSelfingGenerations);
+	}
+	//Serialise into output, which must have serialisedSize() bytes available
+	void serialise(unsigned char* output) const;
+	//The inverse of serialise. Returns false (leaving this entry unchanged) if the input has the wrong size, or was serialised from an entry with different numbers of alleles.
+	bool deserialise(const unsigned char* input, std::size_t inputBytes) const;
+	//Set every value to zero and every combination to not allowable
+	void clear() const;
+private:
+	std::size_t index(int classIndex, int selfing, int allele1, int allele2) const
+	{
+		return ((((std::size_t)selfing * (std::size_t)nClasses + (std::size_t)classIndex) * (std::size_t)nFirstAlleles + (std::size_t)allele1) * (std::size_t)nSecondAlleles + (std::size_t)allele2) * (std::size_t)nRecombLevels;
+	}
+	double* values;
+	unsigned char* allowable;
+	int nFirstAlleles, nSecondAlleles, nRecombLevels, nDifferentFunnels, nClasses, nDifferentSelfingGenerations;
+};
+/* The lookup table for every pair of marker patterns.
+ *
+ * All the values are held in a single allocation, with the entry for each pair of patterns sized according to the number of alleles of those patterns, and located using a per-pair offset. The storage is not initialised here; every entry must be filled in (or cleared) before it is used, which allows the entries to be initialised by the threads that compute them.
+ */
+class allMarkerPairData
+{
+public:
+	allMarkerPairData(const std::vector<markerData>& allMarkerPatterns, int nRecombLevels, int nDifferentFunnels, int nDifferentAIGenerations, int nDifferentSelfingGenerations);
+	//The number of bytes which would be allocated for these marker patterns
+	static std::size_t requiredBytes(const std::vector<markerData>& allMarkerPatterns, int nRecombLevels, int nDifferentFunnels, int nDifferentAIGenerations, int nDifferentSelfingGenerations);
+	//The entry for a pair of marker patterns. The alleles of the entry are ordered so that the first allele comes from the pattern with the smaller ID.
+	singleMarkerPairData operator()(int markerPattern1ID, int markerPattern2ID) const
+	{
+		std::size_t pairIndex = entryIndex(markerPattern1ID, markerPattern2ID);
+		int firstPattern = std::min(markerPattern1ID, markerPattern2ID), secondPattern = std::max(markerPattern1ID, markerPattern2ID);
+		return singleMarkerPairData(values.get() + offsets[pairIndex], allowable.get() + pairIndex * allowablePerPair, nObservedValues[firstPattern], nObservedValues[secondPattern], nRecombLevels, nDifferentFunnels, nDifferentAIGenerations, nDifferentSelfingGenerations);
+	}
+	//The start of the values for a pair of marker patterns, for prefetching
+	const double* valuesStart(int markerPattern1ID, int markerPattern2ID) const
+	{
+		return values.get() + offsets[entryIndex(markerPattern1ID, markerPattern2ID)];
+	}
+private:
+	static std::size_t entryIndex(int markerPattern1ID, int markerPattern2ID)
+	{
+		if(markerPattern1ID < markerPattern2ID) std::swap(markerPattern1ID, markerPattern2ID);
+		return (std::size_t)markerPattern1ID * (std::size_t)(markerPattern1ID + 1) / 2 + (std::size_t)markerPattern2ID;
+	}
+	int nRecombLevels, nDifferentFunnels, nDifferentAIGenerations, nDifferentSelfingGenerations;
+	std::size_t allowablePerPair;
+	std::vector<int> nObservedValues;
+	std::vector<std::size_t> offsets;
+	std::unique_ptr<double[]> values;
+	std::unique_ptr<unsigned char[]> allowable;
+};
+#endif
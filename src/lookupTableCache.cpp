@@ -0,0 +1,138 @@
+#include "lookupTableCache.h"
+#include "crc32.h"
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
+namespace
+{
+	const char cacheMagic[8] = {'m', 'p', 'M', 'a', 'p', '2', 'l', 't'};
+	//Version 1 stored every entry padded to maxAlleles by maxAlleles values, with a fixed size
+	const uint32_t cacheVersion = 2;
+	template<typename T> void appendToKey(std::vector<unsigned char>& key, const T& value)
+	{
+		const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&value);
+		key.insert(key.end(), bytes, bytes + sizeof(T));
+	}
+}
+std::vector<unsigned char> lookupTableDesignKey(int nFounders, int maxAlleles, bool infiniteSelfing, const std::vector<double>& recombinationFractions, const std::vector<funnelEncoding>& lineFunnelEncodings, const std::vector<funnelEncoding>& allFunnelEncodings, int maxAIGenerations, int minSelfing, int maxSelfing)
+{
+	std::vector<unsigned char> key;
+	appendToKey(key, (int32_t)nFounders);
+	appendToKey(key, (int32_t)maxAlleles);
+	appendToKey(key, (int32_t)infiniteSelfing);
+	appendToKey(key, (int32_t)maxAIGenerations);
+	appendToKey(key, (int32_t)minSelfing);
+	appendToKey(key, (int32_t)maxSelfing);
+	appendToKey(key, (uint64_t)recombinationFractions.size());
+	for(std::vector<double>::const_iterator i = recombinationFractions.begin(); i != recombinationFractions.end(); i++) appendToKey(key, *i);
+	appendToKey(key, (uint64_t)lineFunnelEncodings.size());
+	for(std::vector<funnelEncoding>::const_iterator i = lineFunnelEncodings.begin(); i != lineFunnelEncodings.end(); i++) appendToKey(key, (uint64_t)i->value);
+	//The intercrossing probabilities depend on the number of funnels and on the first funnel
+	appendToKey(key, (uint64_t)allFunnelEncodings.size());
+	if(allFunnelEncodings.size() > 0) appendToKey(key, (uint64_t)allFunnelEncodings[0].value);
+	return key;
+}
+lookupTableCache::lookupTableCache(const std::string& directory, const std::vector<unsigned char>& designKey, std::size_t patternSize)
+	: designKey(designKey), patternSize(patternSize), savedBytes(0), fileValid(false)
+{
+	std::stringstream ss;
+	ss << directory;
+	if(directory.size() > 0 && directory[directory.size()-1] != '/' && directory[directory.size()-1] != '\\') ss << "/";
+	ss << "lookup-" << std::hex << std::setw(8) << std::setfill('0') << crc32(&(designKey[0]), designKey.size()) << ".bin";
+	path = ss.str();
+	load();
+}
+void lookupTableCache::load()
+{
+	std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+	if(!file) return;
+	char magic[8];
+	uint32_t version;
+	uint64_t keyLength, patternBytes;
+	if(!file.read(magic, sizeof(magic)) || memcmp(magic, cacheMagic, sizeof(magic)) != 0) return;
+	if(!file.read(reinterpret_cast<char*>(&version), sizeof(version)) || version != cacheVersion) return;
+	if(!file.read(reinterpret_cast<char*>(&keyLength), sizeof(keyLength)) || keyLength != designKey.size()) return;
+	std::vector<unsigned char> fileKey(designKey.size());
+	if(!file.read(reinterpret_cast<char*>(&(fileKey[0])), fileKey.size()) || fileKey != designKey) return;
+	if(!file.read(reinterpret_cast<char*>(&patternBytes), sizeof(patternBytes)) || patternBytes != 2*patternSize*sizeof(int)) return;
+	//The remaining size of the file bounds the size of any single entry
+	std::streampos entriesStart = file.tellg();
+	file.seekg(0, std::ios::end);
+	uint64_t remainingBytes = (uint64_t)(file.tellg() - entriesStart);
+	file.seekg(entriesStart);
+
+	std::vector<int> patterns(2*patternSize);
+	std::vector<unsigned char> payload;
+	uint64_t payloadBytes;
+	//A partially written entry at the end of the file is ignored
+	while(file.read(reinterpret_cast<char*>(&(patterns[0])), patternBytes) && file.read(reinterpret_cast<char*>(&payloadBytes), sizeof(payloadBytes)) && payloadBytes > 0 && payloadBytes <= remainingBytes)
+	{
+		payload.resize(payloadBytes);
+		if(!file.read(reinterpret_cast<char*>(&(payload[0])), payloadBytes)) break;
+		if(entries.find(patterns) != entries.end()) continue;
+		entries.insert(std::make_pair(patterns, std::make_pair(storage.size(), (std::size_t)payloadBytes)));
+		storage.insert(storage.end(), payload.begin(), payload.end());
+	}
+	savedBytes = storage.size();
+	fileValid = true;
+}
+const unsigned char* lookupTableCache::find(const int* pattern1, const int* pattern2, std::size_t& payloadBytes) const
+{
+	std::vector<int> patterns(pattern1, pattern1 + patternSize);
+	patterns.insert(patterns.end(), pattern2, pattern2 + patternSize);
+	std::map<std::vector<int>, std::pair<std::size_t, std::size_t> >::const_iterator entry = entries.find(patterns);
+	if(entry == entries.end()) return NULL;
+	payloadBytes = entry->second.second;
+	return &(storage[entry->second.first]);
+}
+void lookupTableCache::add(const int* pattern1, const int* pattern2, const unsigned char* payload, std::size_t payloadBytes)
+{
+	std::vector<int> patterns(pattern1, pattern1 + patternSize);
+	patterns.insert(patterns.end(), pattern2, pattern2 + patternSize);
+	if(entries.find(patterns) != entries.end()) return;
+	entries.insert(std::make_pair(patterns, std::make_pair(storage.size(), payloadBytes)));
+	storage.insert(storage.end(), payload, payload + payloadBytes);
+}
+bool lookupTableCache::save()
+{
+	if(fileValid && savedBytes == storage.size()) return true;
+	//Put the entries to be written in order of their offsets
+	std::vector<std::pair<std::pair<std::size_t, std::size_t>, const std::vector<int>*> > toWrite;
+	for(std::map<std::vector<int>, std::pair<std::size_t, std::size_t> >::const_iterator i = entries.begin(); i != entries.end(); i++)
+	{
+		if(!fileValid || i->second.first >= savedBytes) toWrite.push_back(std::make_pair(i->second, &(i->first)));
+	}
+	std::sort(toWrite.begin(), toWrite.end());
+
+	//Everything is written with a single call, to minimise the chance of interleaving with another process writing to the same file
+	std::vector<char> buffer;
+	if(!fileValid)
+	{
+		uint64_t keyLength = designKey.size(), patternBytes = 2*patternSize*sizeof(int);
+		buffer.insert(buffer.end(), cacheMagic, cacheMagic + sizeof(cacheMagic));
+		buffer.insert(buffer.end(), reinterpret_cast<const char*>(&cacheVersion), reinterpret_cast<const char*>(&cacheVersion) + sizeof(cacheVersion));
+		buffer.insert(buffer.end(), reinterpret_cast<const char*>(&keyLength), reinterpret_cast<const char*>(&keyLength) + sizeof(keyLength));
+		buffer.insert(buffer.end(), designKey.begin(), designKey.end());
+		buffer.insert(buffer.end(), reinterpret_cast<const char*>(&patternBytes), reinterpret_cast<const char*>(&patternBytes) + sizeof(patternBytes));
+	}
+	for(std::vector<std::pair<std::pair<std::size_t, std::size_t>, const std::vector<int>*> >::iterator i = toWrite.begin(); i != toWrite.end(); i++)
+	{
+		const char* patternData = reinterpret_cast<const char*>(&((*i->second)[0]));
+		buffer.insert(buffer.end(), patternData, patternData + 2*patternSize*sizeof(int));
+		uint64_t payloadBytes = i->first.second;
+		buffer.insert(buffer.end(), reinterpret_cast<const char*>(&payloadBytes), reinterpret_cast<const char*>(&payloadBytes) + sizeof(payloadBytes));
+		const char* payload = reinterpret_cast<const char*>(&(storage[i->first.first]));
+		buffer.insert(buffer.end(), payload, payload + payloadBytes);
+	}
+	std::ofstream file(path.c_str(), fileValid ? (std::ios::out | std::ios::binary | std::ios::app) : (std::ios::out | std::ios::binary | std::ios::trunc));
+	if(!file) return false;
+	if(!file.write(&(buffer[0]), buffer.size())) return false;
+	file.close();
+	if(!file) return false;
+	savedBytes = storage.size();
+	fileValid = true;
+	return true;
+}
@@ -0,0 +1,46 @@
+#ifndef LOOKUP_TABLE_CACHE_HEADER_GUARD
+#define LOOKUP_TABLE_CACHE_HEADER_GUARD
+#include <string>
+#include <vector>
+#include <map>
+#include <cstddef>
+#include "unitTypes.hpp"
+/* On-disk cache of the entries of the lookup table used by estimateRF.
+ *
+ * The lookup table entry for a pair of marker patterns depends only on the two patterns and on the design (number of founders, maximum number of alleles, funnels, numbers of generations of intercrossing and selfing, and the grid of recombination fractions). All entries for the same design are stored in a single file in the cache directory, named according to the crc32 of the design key. The full design key is stored in the file and checked on load, so a crc32 collision only results in the file being replaced.
+ *
+ * Entries are keyed by the contents of both marker patterns (in order), not by their IDs, because the IDs depend on the order in which the patterns are encountered. The size of an entry depends on the numbers of alleles of the patterns, so every entry is stored with its size. 
+ */
+class lookupTableCache
+{
+public:
+	/* @param directory The cache directory, which must already exist
+	 * @param designKey The serialised description of the design
+	 * @param patternSize The number of integers describing a single marker pattern
+	 */
+	lookupTableCache(const std::string& directory, const std::vector<unsigned char>& designKey, std::size_t patternSize);
+	//Returns the serialised entry for this (ordered) pair of patterns and sets payloadBytes to its size, or returns NULL if it isn't in the cache. This is safe to call concurrently, as long as add is not called at the same time.
+	const unsigned char* find(const int* pattern1, const int* pattern2, std::size_t& payloadBytes) const;
+	void add(const int* pattern1, const int* pattern2, const unsigned char* payload, std::size_t payloadBytes);
+	//Write any entries added since the cache was loaded. Errors writing the cache are not fatal, so this returns false rather than throwing.
+	bool save();
+	std::size_t size() const
+	{
+		return entries.size();
+	}
+private:
+	void load();
+	std::string path;
+	std::vector<unsigned char> designKey;
+	std::size_t patternSize;
+	//Map from the concatenated patterns to the offset and size of the payload in storage
+	std::map<std::vector<int>, std::pair<std::size_t, std::size_t> > entries;
+	std::vector<unsigned char> storage;
+	//Entries with offsets at least this large have not been written to the file yet
+	std::size_t savedBytes;
+	//If false the file is missing or invalid, and must be rewritten from scratch
+	bool fileValid;
+};
+//Construct the key describing the design, for use with lookupTableCache.
+std::vector<unsigned char> lookupTableDesignKey(int nFounders, int maxAlleles, bool infiniteSelfing, const std::vector<double>& recombinationFractions, const std::vector<funnelEncoding>& lineFunnelEncodings, const std::vector<funnelEncoding>& allFunnelEncodings, int maxAIGenerations, int minSelfing, int maxSelfing);
+#endif
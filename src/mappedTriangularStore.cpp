@@ -0,0 +1,282 @@
+#include "mappedTriangularStore.h"
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+namespace
+{
+	const char storeMagic[8] = {'m', 'p', 'M', 'a', 'p', '2', 'r', 'f'};
+	const uint32_t storeVersion = 1;
+	//The header is padded out to this size, so that the theta values start at an aligned offset
+	const unsigned long long headerBytes = 64;
+	struct storeHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t lodBytes;
+		uint32_t lkhdBytes;
+		uint32_t reserved;
+		uint64_t nValues;
+	};
+	unsigned long long roundUpToEight(unsigned long long value)
+	{
+		return (value + 7ULL) & ~7ULL;
+	}
+	unsigned long long requiredFileSize(unsigned long long nValues, int lodBytes, int lkhdBytes)
+	{
+		return headerBytes + roundUpToEight(nValues) + nValues * (unsigned long long)lodBytes + nValues * (unsigned long long)lkhdBytes;
+	}
+	void throwFileError(const std::string& message, const std::string& path)
+	{
+		std::stringstream ss;
+		ss << message << " \"" << path << "\"";
+		throw std::runtime_error(ss.str().c_str());
+	}
+}
+mappedTriangularStore::mappedTriangularStore(const std::string& path, unsigned long long nValues, int lodBytes, int lkhdBytes)
+	: path(path), nValues(nValues), lodBytes(lodBytes), lkhdBytes(lkhdBytes), writable(true), base(NULL), mappedSize(0), thetaPtr(NULL), lodPtr(NULL), lkhdPtr(NULL)
+{
+	if(nValues == 0) throw std::runtime_error("Internal error");
+	if((lodBytes != 0 && lodBytes != 4 && lodBytes != 8) || (lkhdBytes != 0 && lkhdBytes != 4 && lkhdBytes != 8))
+	{
+		throw std::runtime_error("Values in a mapped triangular store must have size 4 or 8 bytes");
+	}
+	map(path, true, requiredFileSize(nValues, lodBytes, lkhdBytes));
+	storeHeader header;
+	memset(&header, 0, sizeof(storeHeader));
+	memcpy(header.magic, storeMagic, sizeof(storeMagic));
+	header.version = storeVersion;
+	header.lodBytes = (uint32_t)lodBytes;
+	header.lkhdBytes = (uint32_t)lkhdBytes;
+	header.nValues = (uint64_t)nValues;
+	memcpy(base, &header, sizeof(storeHeader));
+	setPointers();
+}
+mappedTriangularStore::mappedTriangularStore(const std::string& path)
+	: path(path), nValues(0), lodBytes(0), lkhdBytes(0), writable(false), base(NULL), mappedSize(0), thetaPtr(NULL), lodPtr(NULL), lkhdPtr(NULL)
+{
+	map(path, false, 0);
+	try
+	{
+		if(mappedSize < headerBytes) throwFileError("Invalid header for file", path);
+		storeHeader header;
+		memcpy(&header, base, sizeof(storeHeader));
+		if(memcmp(header.magic, storeMagic, sizeof(storeMagic)) != 0 || header.version != storeVersion)
+		{
+			throwFileError("Invalid header for file", path);
+		}
+		nValues = header.nValues;
+		lodBytes = (int)header.lodBytes;
+		lkhdBytes = (int)header.lkhdBytes;
+		if((lodBytes != 0 && lodBytes != 4 && lodBytes != 8) || (lkhdBytes != 0 && lkhdBytes != 4 && lkhdBytes != 8) || mappedSize < requiredFileSize(nValues, lodBytes, lkhdBytes))
+		{
+			throwFileError("Invalid header for file", path);
+		}
+	}
+	catch(...)
+	{
+		unmap();
+		throw;
+	}
+	setPointers();
+}
+mappedTriangularStore::~mappedTriangularStore()
+{
+	unmap();
+}
+void mappedTriangularStore::setPointers()
+{
+	thetaPtr = base + headerBytes;
+	lodPtr = thetaPtr + roundUpToEight(nValues);
+	lkhdPtr = lodPtr + nValues * (unsigned long long)lodBytes;
+}
+#ifdef _WIN32
+void mappedTriangularStore::map(const std::string& path, bool writable, unsigned long long fileSize)
+{
+	fileHandle = mappingHandle = NULL;
+	HANDLE file = CreateFileA(path.c_str(), writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ, FILE_SHARE_READ, NULL, writable ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE) throwFileError("Unable to open file", path);
+	if(!writable)
+	{
+		LARGE_INTEGER existingSize;
+		if(!GetFileSizeEx(file, &existingSize))
+		{
+			CloseHandle(file);
+			throwFileError("Unable to determine size of file", path);
+		}
+		fileSize = (unsigned long long)existingSize.QuadPart;
+		if(fileSize < headerBytes)
+		{
+			CloseHandle(file);
+			throwFileError("Invalid header for file", path);
+		}
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY, (DWORD)(fileSize >> 32), (DWORD)(fileSize & 0xffffffffULL), NULL);
+	if(mapping == NULL)
+	{
+		CloseHandle(file);
+		throwFileError("Unable to map file", path);
+	}
+	void* view = MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+	if(view == NULL)
+	{
+		CloseHandle(mapping);
+		CloseHandle(file);
+		throwFileError("Unable to map file", path);
+	}
+	fileHandle = file;
+	mappingHandle = mapping;
+	base = (unsigned char*)view;
+	mappedSize = fileSize;
+}
+void mappedTriangularStore::flush()
+{
+	if(writable && base != NULL) FlushViewOfFile(base, 0);
+}
+void mappedTriangularStore::unmap()
+{
+	if(base != NULL)
+	{
+		flush();
+		UnmapViewOfFile(base);
+		base = NULL;
+	}
+	if(mappingHandle != NULL) CloseHandle((HANDLE)mappingHandle);
+	if(fileHandle != NULL) CloseHandle((HANDLE)fileHandle);
+	mappingHandle = fileHandle = NULL;
+}
+#else
+void mappedTriangularStore::map(const std::string& path, bool writable, unsigned long long fileSize)
+{
+	fileDescriptor = -1;
+	int descriptor;
+	if(writable) descriptor = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	else descriptor = open(path.c_str(), O_RDONLY);
+	if(descriptor == -1) throwFileError("Unable to open file", path);
+	if(writable)
+	{
+		//The file is sparse until the pages are written
+		if(ftruncate(descriptor, (off_t)fileSize) != 0)
+		{
+			close(descriptor);
+			throwFileError("Unable to set size of file", path);
+		}
+	}
+	else
+	{
+		struct stat fileStatus;
+		if(fstat(descriptor, &fileStatus) != 0)
+		{
+			close(descriptor);
+			throwFileError("Unable to determine size of file", path);
+		}
+		fileSize = (unsigned long long)fileStatus.st_size;
+		if(fileSize < headerBytes)
+		{
+			close(descriptor);
+			throwFileError("Invalid header for file", path);
+		}
+	}
+	void* mapped = mmap(NULL, (size_t)fileSize, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, descriptor, 0);
+	if(mapped == MAP_FAILED)
+	{
+		close(descriptor);
+		throwFileError("Unable to map file", path);
+	}
+	fileDescriptor = descriptor;
+	base = (unsigned char*)mapped;
+	mappedSize = fileSize;
+}
+void mappedTriangularStore::flush()
+{
+	if(writable && base != NULL) msync(base, (size_t)mappedSize, MS_SYNC);
+}
+void mappedTriangularStore::unmap()
+{
+	if(base != NULL)
+	{
+		flush();
+		munmap(base, (size_t)mappedSize);
+		base = NULL;
+	}
+	if(fileDescriptor != -1) close(fileDescriptor);
+	fileDescriptor = -1;
+}
+#endif
+SEXP mappedTriangularStoreInfo(SEXP file_)
+{
+BEGIN_RCPP
+	std::string file;
+	try
+	{
+		file = Rcpp::as<std::string>(file_);
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Input file must be a single string");
+	}
+	mappedTriangularStore store(file);
+	return Rcpp::List::create(Rcpp::Named("nValues") = (double)store.size(), Rcpp::Named("lod") = store.hasLod(), Rcpp::Named("lkhd") = store.hasLkhd());
+END_RCPP
+}
+SEXP mappedTriangularStoreSubset(SEXP file_, SEXP values_, SEXP i_, SEXP j_)
+{
+BEGIN_RCPP
+	std::string file, values;
+	try
+	{
+		file = Rcpp::as<std::string>(file_);
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Input file must be a single string");
+	}
+	try
+	{
+		values = Rcpp::as<std::string>(values_);
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Input values must be a single string");
+	}
+	if(values != "lod" && values != "lkhd") throw std::runtime_error("Input values must be either \"lod\" or \"lkhd\"");
+	Rcpp::IntegerVector i, j;
+	try
+	{
+		i = i_;
+		j = j_;
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Inputs i and j must be integer vectors");
+	}
+	mappedTriangularStore store(file);
+	bool isLod = values == "lod";
+	if(isLod && !store.hasLod()) throw std::runtime_error("File does not contain lod values");
+	if(!isLod && !store.hasLkhd()) throw std::runtime_error("File does not contain lkhd values");
+	Rcpp::NumericMatrix result((int)i.size(), (int)j.size());
+	for(R_xlen_t iCounter = 0; iCounter < i.size(); iCounter++)
+	{
+		for(R_xlen_t jCounter = 0; jCounter < j.size(); jCounter++)
+		{
+			unsigned long long iCopied = i[iCounter], jCopied = j[jCounter];
+			if(iCopied > jCopied) std::swap(iCopied, jCopied);
+			unsigned long long index = (jCopied*(jCopied-1ULL))/2ULL + iCopied-1ULL;
+			if(index >= store.size()) throw std::runtime_error("Indices were out of range");
+			double value = isLod ? store.lod(index) : store.lkhd(index);
+			if(value != value) result(iCounter, jCounter) = NA_REAL;
+			else result(iCounter, jCounter) = value;
+		}
+	}
+	return result;
+END_RCPP
+}
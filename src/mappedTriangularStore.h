@@ -0,0 +1,106 @@
+#ifndef MAPPED_TRIANGULAR_STORE_HEADER_GUARD
+#define MAPPED_TRIANGULAR_STORE_HEADER_GUARD
+#include <Rcpp.h>
+#include <string>
+#include <stdint.h>
+/* A packed upper-triangular matrix of recombination fraction estimates, stored in a memory-mapped file.
+ *
+ * The file contains a fixed size header, followed by the theta values (one byte per entry, with 0xff indicating NA), and optionally the lod and lkhd values, each as either 4 or 8 byte floating point values. Values are stored in the same order as the data slot of a rawSymmetricMatrix object.
+ *
+ * Only the pages that are actually accessed are read into memory, so a store can be much larger than the available RAM.
+ */
+class mappedTriangularStore
+{
+public:
+	/* Create a new file, overwriting any existing file. The file is mapped for writing.
+	 * @param path The path of the file
+	 * @param nValues The number of entries in the packed upper triangle
+	 * @param lodBytes The number of bytes used to store every lod value. Must be 0 (lod values not stored), 4 or 8.
+	 * @param lkhdBytes The number of bytes used to store every lkhd value. Must be 0 (lkhd values not stored), 4 or 8.
+	 */
+	mappedTriangularStore(const std::string& path, unsigned long long nValues, int lodBytes, int lkhdBytes);
+	//Open an existing file, for reading only.
+	mappedTriangularStore(const std::string& path);
+	~mappedTriangularStore();
+	unsigned long long size() const
+	{
+		return nValues;
+	}
+	const Rbyte* theta() const
+	{
+		return thetaPtr;
+	}
+	Rbyte* theta()
+	{
+		return thetaPtr;
+	}
+	bool hasLod() const
+	{
+		return lodBytes != 0;
+	}
+	bool hasLkhd() const
+	{
+		return lkhdBytes != 0;
+	}
+	int bytesPerLod() const
+	{
+		return lodBytes;
+	}
+	int bytesPerLkhd() const
+	{
+		return lkhdBytes;
+	}
+	double lod(unsigned long long index) const
+	{
+		return getValue(lodPtr, lodBytes, index);
+	}
+	double lkhd(unsigned long long index) const
+	{
+		return getValue(lkhdPtr, lkhdBytes, index);
+	}
+	void setLod(unsigned long long index, double value)
+	{
+		setValue(lodPtr, lodBytes, index, value);
+	}
+	void setLkhd(unsigned long long index, double value)
+	{
+		setValue(lkhdPtr, lkhdBytes, index, value);
+	}
+	//Write any modified pages back to the file.
+	void flush();
+private:
+	mappedTriangularStore(const mappedTriangularStore&);
+	mappedTriangularStore& operator=(const mappedTriangularStore&);
+	static double getValue(const unsigned char* ptr, int bytes, unsigned long long index)
+	{
+		if(bytes == 4) return reinterpret_cast<const float*>(ptr)[index];
+		return reinterpret_cast<const double*>(ptr)[index];
+	}
+	static void setValue(unsigned char* ptr, int bytes, unsigned long long index, double value)
+	{
+		if(bytes == 4) reinterpret_cast<float*>(ptr)[index] = (float)value;
+		else reinterpret_cast<double*>(ptr)[index] = value;
+	}
+	void map(const std::string& path, bool writable, unsigned long long fileSize);
+	void unmap();
+	void setPointers();
+	std::string path;
+	unsigned long long nValues;
+	int lodBytes, lkhdBytes;
+	bool writable;
+	unsigned char* base;
+	unsigned long long mappedSize;
+	Rbyte* thetaPtr;
+	unsigned char *lodPtr, *lkhdPtr;
+#ifdef _WIN32
+	void* fileHandle;
+	void* mappingHandle;
+#else
+	int fileDescriptor;
+#endif
+};
+//Returns a list with entries nValues, lodBytes and lkhdBytes, describing the file
+SEXP mappedTriangularStoreInfo(SEXP file);
+//Extract a submatrix of the lod or lkhd values stored in the file
+SEXP mappedTriangularStoreSubset(SEXP file, SEXP values, SEXP i, SEXP j);
+#endif
@@ -43,6 +43,33 @@ private:
 	int nRows, nColumns;
 	std::vector<T> data;
 };
+//Column-major storage, so entries in the same column are contiguous
+template<typename T> class columnMajorMatrix
+{
+public:
+	columnMajorMatrix(int nRows, int nColumns)
+		: nRows(nRows), nColumns(nColumns), data(nRows*nColumns)
+	{}
+	typename std::vector<T>::reference operator()(int row, int column)
+	{
+		return data[row + column*nRows];
+	}
+	typename std::vector<T>::const_reference operator()(int row, int column) const
+	{
+		return data[row + column*nRows];
+	}
+	int getNRows() const
+	{
+		return nRows;
+	}
+	int getNColumns() const
+	{
+		return nColumns;
+	}
+private:
+	int nRows, nColumns;
+	std::vector<T> data;
+};
 template<typename T> class xMajorMatrix
 {
 public:
@@ -56,15 +83,19 @@ public:
 	{
 		return data[i + j*sizeX + k * sizeX * sizeY];
 	}
-	int getSizeX()
+	const T& operator()(int i, int j, int k) const
+	{
+		return data[i + j*sizeX + k * sizeX * sizeY];
+	}
+	int getSizeX() const
 	{
 		return sizeX;
 	}
-	int getSizeY()
+	int getSizeY() const
 	{
 		return sizeY;
 	}
-	int getSizeZ()
+	int getSizeZ() const
 	{
 		return sizeZ;
 	}
@@ -1,9 +1,16 @@
 #include "matrixChunks.h"
+#include <algorithm>
 triangularIterator::triangularIterator(const std::vector<int>& markerRows, const std::vector<int>& markerColumns)
 	: markerRows(markerRows), markerColumns(markerColumns), markerRow(markerRows.begin()), markerColumn(markerColumns.begin())
 {
 	if(*markerRow > *markerColumn) next();
 }
+triangularIterator::triangularIterator(const std::vector<int>& markerRows, const std::vector<int>& markerColumns, std::size_t rowPosition, std::size_t columnPosition)
+	: markerRows(markerRows), markerColumns(markerColumns), markerRow(markerRows.begin() + rowPosition), markerColumn(markerColumns.begin() + columnPosition)
+{
+	if(columnPosition == markerColumns.size()) markerRow = markerRows.begin();
+	else if(*markerRow > *markerColumn) throw std::runtime_error("Internal error");
+}
 std::pair<int, int> triangularIterator::get() const
 {
 	return std::make_pair(*markerRow, *markerColumn);
@@ -34,6 +41,105 @@ bool triangularIterator::isDone() const
 {
 	return markerColumn == markerColumns.end();
 }
+triangularIndex::triangularIndex(const std::vector<int>& markerRows, const std::vector<int>& markerColumns)
+	: markerRows(markerRows), markerColumns(markerColumns), cumulativeCounts(markerColumns.size() + 1, 0)
+{
+	rowsSorted = std::is_sorted(markerRows.begin(), markerRows.end());
+	std::vector<int> markerRowsSorted = markerRows;
+	if(!rowsSorted) std::sort(markerRowsSorted.begin(), markerRowsSorted.end());
+	for(std::size_t columnPosition = 0; columnPosition < markerColumns.size(); columnPosition++)
+	{
+		std::size_t validRows = std::distance(markerRowsSorted.begin(), std::upper_bound(markerRowsSorted.begin(), markerRowsSorted.end(), markerColumns[columnPosition]));
+		cumulativeCounts[columnPosition + 1] = cumulativeCounts[columnPosition] + validRows;
+	}
+}
+unsigned long long triangularIndex::size() const
+{
+	return cumulativeCounts.back();
+}
+void triangularIndex::positionOf(unsigned long long index, std::size_t& rowPosition, std::size_t& columnPosition) const
+{
+	if(index > size()) throw std::runtime_error("Index exceeded the size of the region");
+	if(index == size())
+	{
+		rowPosition = 0;
+		columnPosition = markerColumns.size();
+		return;
+	}
+	//The first entry strictly greater than index is one past the column we want. Columns with no valid rows have the same cumulative count as the next column, and are skipped by this. 
+	columnPosition = std::distance(cumulativeCounts.begin(), std::upper_bound(cumulativeCounts.begin(), cumulativeCounts.end(), index)) - 1;
+	unsigned long long withinColumn = index - cumulativeCounts[columnPosition];
+	if(rowsSorted)
+	{
+		rowPosition = (std::size_t)withinColumn;
+		return;
+	}
+	int column = markerColumns[columnPosition];
+	for(rowPosition = 0; rowPosition < markerRows.size(); rowPosition++)
+	{
+		if(markerRows[rowPosition] <= column)
+		{
+			if(withinColumn == 0) return;
+			withinColumn--;
+		}
+	}
+	throw std::runtime_error("Internal error");
+}
+std::pair<int, int> triangularIndex::get(unsigned long long index) const
+{
+	if(index >= size()) throw std::runtime_error("Index exceeded the size of the region");
+	std::size_t rowPosition, columnPosition;
+	positionOf(index, rowPosition, columnPosition);
+	return std::make_pair(markerRows[rowPosition], markerColumns[columnPosition]);
+}
+triangularIterator triangularIndex::iteratorAt(unsigned long long index) const
+{
+	std::size_t rowPosition, columnPosition;
+	positionOf(index, rowPosition, columnPosition);
+	return triangularIterator(markerRows, markerColumns, rowPosition, columnPosition);
+}
+unsigned long long triangularIndex::columnStart(std::size_t columnPosition) const
+{
+	return cumulativeCounts[columnPosition];
+}
+std::size_t triangularIndex::columnCount(std::size_t columnPosition) const
+{
+	return (std::size_t)(cumulativeCounts[columnPosition + 1] - cumulativeCounts[columnPosition]);
+}
+int triangularIndex::rowMarker(std::size_t rowPosition) const
+{
+	return markerRows[rowPosition];
+}
+int triangularIndex::columnMarker(std::size_t columnPosition) const
+{
+	return markerColumns[columnPosition];
+}
+bool triangularIndex::getBlocks(unsigned long long start, unsigned long long count, std::size_t blockSize, std::vector<markerBlock>& blocks) const
+{
+	blocks.clear();
+	if(!rowsSorted || blockSize == 0) return false;
+	if(count == 0) return true;
+	std::size_t firstColumn, lastColumn, rowPosition;
+	positionOf(start, rowPosition, firstColumn);
+	positionOf(start + count - 1, rowPosition, lastColumn);
+	for(std::size_t blockColumnStart = firstColumn; blockColumnStart <= lastColumn; blockColumnStart += blockSize)
+	{
+		std::size_t blockColumnEnd = std::min(blockColumnStart + blockSize, lastColumn + 1);
+		//Columns are not necessarily sorted, so take the largest number of rows in any column of this block
+		std::size_t maxRows = 0;
+		for(std::size_t columnPosition = blockColumnStart; columnPosition < blockColumnEnd; columnPosition++) maxRows = std::max(maxRows, columnCount(columnPosition));
+		for(std::size_t blockRowStart = 0; blockRowStart < maxRows; blockRowStart += blockSize)
+		{
+			markerBlock block;
+			block.rowStart = blockRowStart;
+			block.rowEnd = std::min(blockRowStart + blockSize, maxRows);
+			block.columnStart = blockColumnStart;
+			block.columnEnd = blockColumnEnd;
+			blocks.push_back(block);
+		}
+	}
+	return true;
+}
 SEXP countValuesToEstimateExported(SEXP markerRows_, SEXP markerColumns_)
 {
 BEGIN_RCPP
@@ -70,14 +176,9 @@ SEXP singleIndexToPairExported(SEXP markerRows_, SEXP markerColumns_, SEXP index
 BEGIN_RCPP
 	std::vector<int> markerRows = Rcpp::as<std::vector<int> >(markerRows_);
 	std::vector<int> markerColumns = Rcpp::as<std::vector<int> >(markerColumns_);
-	triangularIterator iterator(markerRows, markerColumns);
+	triangularIndex pairIndex(markerRows, markerColumns);
 	unsigned long long index = (unsigned long long)Rcpp::as<int>(index_) - 1;
-	while(index > 0)
-	{
-		iterator.next();
-		index--;
-	}
-	std::pair<int, int> markerPair = iterator.get();
+	std::pair<int, int> markerPair = pairIndex.get(index);
 	return Rcpp::IntegerVector::create(markerPair.first, markerPair.second);
 END_RCPP
 }
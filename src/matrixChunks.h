@@ -6,6 +6,8 @@ class triangularIterator
 {
 public:
 	triangularIterator(const std::vector<int>& markerRows, const std::vector<int>& markerColumns);
+	//Construct an iterator pointing to a specific (row, column) position. The position must be a valid pair, or the end of the region.
+	triangularIterator(const std::vector<int>& markerRows, const std::vector<int>& markerColumns, std::size_t rowPosition, std::size_t columnPosition);
 	std::pair<int, int> get() const;
 	void next();
 	bool isDone() const;
@@ -15,6 +17,37 @@ private:
 	const std::vector<int>& markerColumns;
 	std::vector<int>::const_iterator markerRow, markerColumn;
 };
+//A square block of positions in markerRows and markerColumns, used for cache-blocked traversal of a region. Rows are [rowStart, rowEnd) and columns are [columnStart, columnEnd). 
+struct markerBlock
+{
+	std::size_t rowStart, rowEnd, columnStart, columnEnd;
+};
+//Random access into the region traversed by triangularIterator. For every entry of markerColumns we store the number of pairs in all previous columns, so a linear index can be mapped to a column with a binary search, and then to a row within that column. 
+class triangularIndex
+{
+public:
+	triangularIndex(const std::vector<int>& markerRows, const std::vector<int>& markerColumns);
+	unsigned long long size() const;
+	//Get the (row, column) pair for the specified linear index, which must be less than size(). 
+	std::pair<int, int> get(unsigned long long index) const;
+	//Get an iterator pointing to the specified linear index. An index of size() gives an iterator for which isDone() is true. 
+	triangularIterator iteratorAt(unsigned long long index) const;
+	//The linear index of the first pair in the specified column, and the number of pairs in that column. 
+	unsigned long long columnStart(std::size_t columnPosition) const;
+	std::size_t columnCount(std::size_t columnPosition) const;
+	int rowMarker(std::size_t rowPosition) const;
+	int columnMarker(std::size_t columnPosition) const;
+	//Split the pairs with linear indices [start, start + count) into square blocks of positions of size blockSize. Blocks at the start and end may also contain pairs outside this range, which must be skipped by the caller. Within a column the pairs are the first columnCount(column) rows, so this is only possible if markerRows is sorted; otherwise false is returned.
+	bool getBlocks(unsigned long long start, unsigned long long count, std::size_t blockSize, std::vector<markerBlock>& blocks) const;
+private:
+	void positionOf(unsigned long long index, std::size_t& rowPosition, std::size_t& columnPosition) const;
+	const std::vector<int>& markerRows;
+	const std::vector<int>& markerColumns;
+	//Entry i is the number of pairs in columns [0, i). Has markerColumns.size() + 1 entries. 
+	std::vector<unsigned long long> cumulativeCounts;
+	//If markerRows is sorted then the valid rows for every column form a prefix of markerRows, and the row can be found directly. 
+	bool rowsSorted;
+};
 SEXP countValuesToEstimateExported(SEXP markerRows, SEXP markerColumns);
 unsigned long long countValuesToEstimate(const std::vector<int>& markerRows, const std::vector<int>& markerColumns);
 SEXP singleIndexToPairExported(SEXP markerRows, SEXP markerColumns, SEXP index);
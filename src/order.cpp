@@ -1,10 +1,11 @@
 #include "order.h"
 #include "impute.h"
 #include "arsaRaw.h"
+#include "rawSymmetricMatrix.h"
 #ifdef USE_OPENMP
 #include <omp.h>
 #endif
-SEXP order(SEXP mpcrossLG_sexp, SEXP groupsToOrder_sexp, SEXP cool_, SEXP temperatureMin_, SEXP nReps_, SEXP maxMove_sexp, SEXP effortMultiplier_sexp, SEXP randomStart_sexp, SEXP verbose_)
+SEXP order(SEXP mpcrossLG_sexp, SEXP groupsToOrder_sexp, SEXP cool_, SEXP temperatureMin_, SEXP nReps_, SEXP maxMove_sexp, SEXP effortMultiplier_sexp, SEXP randomStart_sexp, SEXP windowSize_sexp, SEXP method_sexp, SEXP nChains_sexp, SEXP verbose_)
 {
 BEGIN_RCPP
 	Rcpp::S4 mpcrossLG;
@@ -60,6 +61,49 @@ BEGIN_RCPP
 		throw std::runtime_error("Input maxMove must be non-negative");
 	}
 
+	int windowSize;
+	try
+	{
+		windowSize = Rcpp::as<int>(windowSize_sexp);
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Input windowSize must be an integer");
+	}
+	if(windowSize < 0 || windowSize == 1)
+	{
+		throw std::runtime_error("Input windowSize must be zero, or at least 2");
+	}
+
+	std::string method;
+	try
+	{
+		method = Rcpp::as<std::string>(method_sexp);
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Input method must be a string");
+	}
+	if(method != "arsa" && method != "tempering")
+	{
+		throw std::runtime_error("Input method must be either \"arsa\" or \"tempering\"");
+	}
+	bool tempering = method == "tempering";
+
+	int nChains;
+	try
+	{
+		nChains = Rcpp::as<int>(nChains_sexp);
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Input nChains must be an integer");
+	}
+	if(nChains < 2)
+	{
+		throw std::runtime_error("Input nChains must be at least 2");
+	}
+
 	double effortMultiplier;
 	try
 	{
@@ -156,7 +200,7 @@ BEGIN_RCPP
 		throw std::runtime_error("Internal error accessing slot mpcrossLG@lg@imputedTheta");
 	}
 	bool hasImputedTheta = !imputedTheta_robject.isNULL();
-	Rcpp::RawVector thetaRawData;
+	rawSymmetricMatrixData thetaRawData;
 	Rcpp::List imputedTheta;
 	if(hasImputedTheta)
 	{
@@ -198,9 +242,9 @@ BEGIN_RCPP
 
 		try
 		{
-			thetaRawData = theta.slot("data");
+			thetaRawData = rawSymmetricMatrixData(theta);
 		}
-		catch(...)
+		catch(Rcpp::not_compatible&)
 		{
 			throw std::runtime_error("Slot mpcrossLG@rf@theta@data must be a raw vector");
 		}
@@ -233,40 +277,56 @@ BEGIN_RCPP
 
 
 	R_xlen_t nMarkers = groups.size();
+	std::size_t nGroups = allGroups.size();
+
+	//linkage groups are not required to be contiguous in this case, so we have to scan through to find the markers in each group
+	std::vector<std::vector<int> > markersByGroup(nGroups);
+	for(R_xlen_t marker = 0; marker < nMarkers; marker++)
+	{
+		std::vector<int>::iterator bound = std::lower_bound(allGroups.begin(), allGroups.end(), groups[marker]);
+		if(bound != allGroups.end() && *bound == groups[marker]) markersByGroup[std::distance(allGroups.begin(), bound)].push_back((int)marker);
+	}
+	std::vector<std::size_t> nonEmptyGroups;
+	for(std::size_t groupCount = 0; groupCount < nGroups; groupCount++)
+	{
+		if(markersByGroup[groupCount].size() > 0) nonEmptyGroups.push_back(groupCount);
+	}
 
-	std::vector<int> permutation, currentGroupPermutation;
-	permutation.reserve(nMarkers);
-	std::vector<int> markersThisGroup;
-	//This holds a copy of the raw data, for the purposes of doing imputation. We don't want to touch the original, obviously. 
-	std::vector<unsigned char> imputedRaw;
-	unsigned char* imputedRawPtr;
 	//Stuff for the verbose output case
 	Rcpp::RObject barHandle;
 	Rcpp::Function txtProgressBar("txtProgressBar"), setTxtProgressBar("setTxtProgressBar"), close("close");
-	for(std::vector<int>::iterator currentGroup = allGroups.begin(); currentGroup != allGroups.end(); currentGroup++)
+	std::function<std::function<void(unsigned long,unsigned long)>()> makeProgressFunction = [&barHandle, txtProgressBar, setTxtProgressBar]()
 	{
-		int groupCount = (int)std::distance(allGroups.begin(), currentGroup);
-		markersThisGroup.clear();
-		//linkage groups are not required to be contiguous in this case, so we have to scan through to find the number of markers in this group
-		for(std::vector<int>::iterator currentMarkerGroup = groups.begin(); currentMarkerGroup != groups.end(); currentMarkerGroup++)
+		barHandle = txtProgressBar(Rcpp::Named("style") = 3, Rcpp::Named("min") = 0, Rcpp::Named("max") = 1000, Rcpp::Named("initial") = 0);
+		Rcpp::RObject currentBarHandle = barHandle;
+		return std::function<void(unsigned long, unsigned long)>([currentBarHandle, setTxtProgressBar](unsigned long done, unsigned long totalSteps)
 		{
-			if(*currentMarkerGroup == *currentGroup)
-			{
-				markersThisGroup.push_back((int)std::distance(groups.begin(), currentMarkerGroup));
-			}
-		}
-		std::size_t nMarkersCurrentGroup = (int)markersThisGroup.size();
-		if(nMarkersCurrentGroup == 0) continue;
-		
-		std::vector<int> contiguousIndices(nMarkersCurrentGroup);
-		for(std::size_t i = 0; i < nMarkersCurrentGroup; i++) contiguousIndices[i] = (int)i;
+#ifdef CUSTOM_STATIC_RCPP
+			setTxtProgressBar.topLevelExec(currentBarHandle, (int)((double)(1000*done) / (double)totalSteps));
+#else
+			setTxtProgressBar(currentBarHandle, (int)((double)(1000*done) / (double)totalSteps));
+#endif
+		});
+	};
+	std::function<void(unsigned long,unsigned long)> noProgress = [](unsigned long,unsigned long){};
 
-		if(!hasImputedTheta)
+	//The packed data for each group, after imputation
+	std::vector<unsigned char*> imputedRawPtrs(nGroups, NULL);
+	//This holds a copy of the raw data, for the purposes of doing imputation. We don't want to touch the original, obviously. 
+	std::vector<std::vector<unsigned char> > imputedRaw(nGroups);
+	if(!hasImputedTheta)
+	{
+		//Imputation of the different groups is independent, so the groups are imputed together
+		std::vector<unsigned char*> toImpute;
+		std::vector<std::vector<int> > contiguousIndices;
+		std::vector<int> groupNames;
+		for(std::vector<std::size_t>::iterator groupCount = nonEmptyGroups.begin(); groupCount != nonEmptyGroups.end(); groupCount++)
 		{
-			//Do imputation
+			const std::vector<int>& markersThisGroup = markersByGroup[*groupCount];
+			std::size_t nMarkersCurrentGroup = markersThisGroup.size();
 			//So first make a copy of the raw data subset
-			imputedRaw.resize((nMarkersCurrentGroup * (nMarkersCurrentGroup + 1ULL)) / 2ULL);
-			imputedRawPtr = &(imputedRaw[0]);
+			imputedRaw[*groupCount].resize((nMarkersCurrentGroup * (nMarkersCurrentGroup + 1ULL)) / 2ULL);
+			unsigned char* imputedRawPtr = imputedRawPtrs[*groupCount] = &(imputedRaw[*groupCount][0]);
 			//column
 			for(std::size_t i = 0; i < nMarkersCurrentGroup; i++)
 			{
@@ -275,42 +335,47 @@ BEGIN_RCPP
 				{
 					std::size_t row = (std::size_t)markersThisGroup[j], column = (std::size_t)markersThisGroup[i];
 					if(row > column) std::swap(row, column);
-					imputedRaw[(i * (i + 1ULL))/2ULL + j] = thetaRawData[(column * (column + 1ULL))/2ULL + row];
+					imputedRawPtr[(i * (i + 1ULL))/2ULL + j] = thetaRawData[(column * (column + 1ULL))/2ULL + row];
 				}
 			}
+			toImpute.push_back(imputedRawPtr);
+			contiguousIndices.push_back(std::vector<int>(nMarkersCurrentGroup));
+			for(std::size_t i = 0; i < nMarkersCurrentGroup; i++) contiguousIndices.back()[i] = (int)i;
+			groupNames.push_back(allGroups[*groupCount]);
+		}
 
-			std::string error;
-			std::function<void(unsigned long,unsigned long)> imputationProgressFunction = [](unsigned long,unsigned long){};
-			if(verbose)
-			{
-				Rcpp::Rcout << "Starting imputation for group " << *currentGroup << std::endl;
-				barHandle = txtProgressBar(Rcpp::Named("style") = 3, Rcpp::Named("min") = 0, Rcpp::Named("max") = 1000, Rcpp::Named("initial") = 0);
-					imputationProgressFunction = [barHandle, setTxtProgressBar](unsigned long done, unsigned long totalSteps)
-				{
-#ifdef CUSTOM_STATIC_RCPP
-					setTxtProgressBar.topLevelExec(barHandle, (int)((double)(1000*done) / (double)totalSteps));
-#else
-					setTxtProgressBar(barHandle, (int)((double)(1000*done) / (double)totalSteps));
-#endif
-				};
-			}
-			bool imputationResult = impute(imputedRawPtr, levels, NULL, NULL, contiguousIndices, error, imputationProgressFunction);
-			if(verbose)
-			{
-				close(barHandle);
-			}
+		std::string error;
+		std::function<void(unsigned long,unsigned long)> imputationProgressFunction = noProgress;
+		if(verbose)
+		{
+			if(groupNames.size() == 1) Rcpp::Rcout << "Starting imputation for group " << groupNames[0] << std::endl;
+			else Rcpp::Rcout << "Starting imputation" << std::endl;
+			imputationProgressFunction = makeProgressFunction();
+		}
+		bool imputationResult = imputeGroups(toImpute, levels, contiguousIndices, groupNames, error, imputationProgressFunction);
+		if(verbose)
+		{
+			close(barHandle);
+		}
 
-			if(!imputationResult)
-			{
-				throw std::runtime_error(error.c_str());
-			}
+		if(!imputationResult)
+		{
+			throw std::runtime_error(error.c_str());
 		}
-		else
+	}
+	else
+	{
+		for(std::vector<std::size_t>::iterator groupCount = nonEmptyGroups.begin(); groupCount != nonEmptyGroups.end(); groupCount++)
 		{
-			imputedRawPtr = &(Rcpp::as<Rcpp::RawVector>(Rcpp::as<Rcpp::S4>(imputedTheta(groupCount)).slot("data"))[0]);
+			imputedRawPtrs[*groupCount] = &(Rcpp::as<Rcpp::RawVector>(Rcpp::as<Rcpp::S4>(imputedTheta(*groupCount)).slot("data"))[0]);
 		}
-		//Unpack the data into a symmetric matrix
-		std::vector<Rbyte> distMatrix(nMarkersCurrentGroup*nMarkersCurrentGroup);
+	}
+	//Unpack the data for a group into a symmetric matrix
+	std::function<void(std::size_t, std::vector<Rbyte>&)> unpack = [&markersByGroup, &imputedRawPtrs](std::size_t groupCount, std::vector<Rbyte>& distMatrix)
+	{
+		std::size_t nMarkersCurrentGroup = markersByGroup[groupCount].size();
+		const unsigned char* imputedRawPtr = imputedRawPtrs[groupCount];
+		distMatrix.resize(nMarkersCurrentGroup*nMarkersCurrentGroup);
 		for(std::size_t i = 0; i < nMarkersCurrentGroup; i++)
 		{
 			for(std::size_t j = 0; j <= i; j++)
@@ -318,49 +383,97 @@ BEGIN_RCPP
 				distMatrix[i * nMarkersCurrentGroup + j] = distMatrix[j * nMarkersCurrentGroup + i] = imputedRawPtr[(i*(i+1ULL))/2ULL + j];
 			}
 		}
-	
-		
-		std::function<void(unsigned long, unsigned long)> orderingProgressFunction = [](unsigned long,unsigned long){};
-		if(verbose)
-		{
-			//Only output this text if there was an imputation step, or we're ordering multiple groups
-			if(!hasImputedTheta || groupsToOrder.size() > 1) Rcpp::Rcout << "Starting to order group " << *currentGroup << std::endl;
-			barHandle = txtProgressBar(Rcpp::Named("style") = 3, Rcpp::Named("min") = 0, Rcpp::Named("max") = 1000, Rcpp::Named("initial") = 0);
-			orderingProgressFunction = [barHandle, setTxtProgressBar](unsigned long done, unsigned long totalSteps)
-			{
-#ifdef CUSTOM_STATIC_RCPP
-				setTxtProgressBar.topLevelExec(barHandle, (int)((double)(1000*done) / (double)totalSteps));
-#else
-				setTxtProgressBar(barHandle, (int)((double)(1000*done) / (double)totalSteps));
+	};
+
+	std::vector<std::vector<int> > groupPermutations(nGroups);
+	//If the replicates are run in parallel then the groups can be ordered together, with every replicate of every group as a separate task. This gives the same result as ordering the groups one at a time, but keeps every thread busy until the end. Otherwise the groups are ordered one at a time. 
+	bool orderTogether = false;
+#ifdef USE_OPENMP
+	orderTogether = !tempering && omp_get_max_threads() > 1 && nReps > 1 && nonEmptyGroups.size() > 1;
+	for(std::vector<std::size_t>::iterator groupCount = nonEmptyGroups.begin(); groupCount != nonEmptyGroups.end(); groupCount++)
+	{
+		if(windowSize > 0 && (int)markersByGroup[*groupCount].size() > windowSize) orderTogether = false;
+	}
 #endif
-			};
-		}
-		arsaRawArgs args(levels, currentGroupPermutation);
-		args.n = nMarkersCurrentGroup;
-		args.rawDist = &(distMatrix[0]);
-		args.cool = cool;
-		args.temperatureMin = temperatureMin;
-		args.nReps = nReps;
-		args.progressFunction = orderingProgressFunction;
-		args.randomStart = randomStart;
-		args.maxMove = maxMove;
-		args.effortMultiplier = effortMultiplier;
+	if(orderTogether)
+	{
 #ifdef USE_OPENMP
-		if(omp_get_max_threads() > 1)
+		std::vector<arsaRawArgs> allArgs;
+		allArgs.reserve(nonEmptyGroups.size());
+		std::vector<arsaRawArgs*> allArgsPtrs;
+		for(std::vector<std::size_t>::iterator groupCount = nonEmptyGroups.begin(); groupCount != nonEmptyGroups.end(); groupCount++)
 		{
-			arsaRawParallel(args);
+			allArgs.push_back(arsaRawArgs(levels, groupPermutations[*groupCount]));
+			arsaRawArgs& args = allArgs.back();
+			args.n = markersByGroup[*groupCount].size();
+			args.cool = cool;
+			args.temperatureMin = temperatureMin;
+			args.nReps = nReps;
+			args.randomStart = randomStart;
+			args.maxMove = maxMove;
+			args.effortMultiplier = effortMultiplier;
+			allArgsPtrs.push_back(&args);
 		}
-		else
-#endif
+		std::function<void(unsigned long,unsigned long)> orderingProgressFunction = noProgress;
+		if(verbose)
 		{
-			arsaRaw(args);
+			Rcpp::Rcout << "Starting to order groups" << std::endl;
+			orderingProgressFunction = makeProgressFunction();
 		}
-
+		//The groups are only unpacked while they're being ordered
+		std::function<void(std::size_t, std::vector<Rbyte>&)> unpackNonEmpty = [&unpack, &nonEmptyGroups](std::size_t counter, std::vector<Rbyte>& distMatrix)
+		{
+			unpack(nonEmptyGroups[counter], distMatrix);
+		};
+		arsaRawReplicatesParallel(allArgsPtrs, orderingProgressFunction, unpackNonEmpty);
 		if(verbose)
 		{
 			close(barHandle);
 		}
-		for(std::size_t i = 0; i < nMarkersCurrentGroup; i++) permutation.push_back(markersThisGroup[currentGroupPermutation[i]]+1);
+#endif
+	}
+	else
+	{
+		for(std::vector<std::size_t>::iterator groupCount = nonEmptyGroups.begin(); groupCount != nonEmptyGroups.end(); groupCount++)
+		{
+			std::size_t nMarkersCurrentGroup = markersByGroup[*groupCount].size();
+			//Large groups are ordered in windows, directly from the packed data, whichever method was requested. Otherwise unpack the data into a symmetric matrix
+			bool windowed = windowSize > 0 && (int)nMarkersCurrentGroup > windowSize;
+			std::vector<Rbyte> distMatrix;
+			if(!windowed) unpack(*groupCount, distMatrix);
+		
+			std::function<void(unsigned long, unsigned long)> orderingProgressFunction = noProgress;
+			if(verbose)
+			{
+				//Only output this text if there was an imputation step, or we're ordering multiple groups
+				if(!hasImputedTheta || groupsToOrder.size() > 1) Rcpp::Rcout << "Starting to order group " << allGroups[*groupCount] << std::endl;
+				orderingProgressFunction = makeProgressFunction();
+			}
+			arsaRawArgs args(levels, groupPermutations[*groupCount]);
+			args.n = nMarkersCurrentGroup;
+			args.rawDist = windowed ? imputedRawPtrs[*groupCount] : &(distMatrix[0]);
+			args.cool = cool;
+			args.temperatureMin = temperatureMin;
+			args.nReps = nReps;
+			args.progressFunction = orderingProgressFunction;
+			args.randomStart = randomStart;
+			args.maxMove = maxMove;
+			args.effortMultiplier = effortMultiplier;
+			if(windowed) arsaRawWindowed(args, windowSize);
+			else if(tempering) arsaRawTempering(args, nChains);
+			else arsaRawExported(args);
+
+			if(verbose)
+			{
+				close(barHandle);
+			}
+		}
+	}
+	std::vector<int> permutation;
+	permutation.reserve(nMarkers);
+	for(std::vector<std::size_t>::iterator groupCount = nonEmptyGroups.begin(); groupCount != nonEmptyGroups.end(); groupCount++)
+	{
+		for(std::size_t i = 0; i < markersByGroup[*groupCount].size(); i++) permutation.push_back(markersByGroup[*groupCount][groupPermutations[*groupCount][i]]+1);
 	}
 	return Rcpp::wrap(permutation);
 END_RCPP
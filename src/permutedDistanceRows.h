@@ -0,0 +1,128 @@
+#ifndef MPMAP2_PERMUTED_DISTANCE_ROWS_HEADER_GUARD
+#define MPMAP2_PERMUTED_DISTANCE_ROWS_HEADER_GUARD
+#include <Rcpp.h>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+/* Cache of rows of the distance matrix used by arsaRaw, decoded into levels and put in the order of the current permutation.
+ *
+ * The row for the marker at position p holds levels[rawDist[permutation[p]*n + permutation[i]]] for i = 0, ..., n-1, so the change in the objective function for a proposed swap or insertion can be computed with contiguous sums, instead of a gather through the permutation for every term.
+ *
+ * Rows are only built when they are requested. Accepted changes to the permutation are recorded in a short log, and applied to a cached row the next time that row is requested. A row which has fallen further behind than the length of the log is rebuilt. If the cache is full, requesting a row evicts some other row, but never the one returned by the previous call.
+ */
+class permutedDistanceRows
+{
+public:
+	permutedDistanceRows(const Rbyte* rawDist, const std::vector<double>& levels, long n, std::size_t maxBytes)
+		: rawDist(rawDist), levels(levels), n(n), version(0), nextEviction(0), lastSlot(-1)
+	{
+		capacity = (long)std::min((std::size_t)n, std::max((std::size_t)2, maxBytes / (sizeof(double) * n)));
+		storage.resize((std::size_t)capacity * n);
+		slotOfMarker.resize(n);
+		markerOfSlot.resize(capacity);
+		slotVersion.resize(capacity);
+		reset();
+	}
+	//Discard all cached rows. This must be called whenever the permutation is replaced, other than through swapped and moved
+	void reset()
+	{
+		std::fill(slotOfMarker.begin(), slotOfMarker.end(), -1);
+		std::fill(markerOfSlot.begin(), markerOfSlot.end(), -1);
+		version = 0;
+		nextEviction = 0;
+		lastSlot = -1;
+	}
+	//True if every row can be cached at once, in which case any number of rows can be used without rebuilding them
+	bool holdsAllRows() const
+	{
+		return capacity == n;
+	}
+	//The row for the marker at this position of the permutation
+	const double* row(const std::vector<int>& permutation, long position)
+	{
+		int marker = permutation[position];
+		long slot = slotOfMarker[marker];
+		if(slot < 0)
+		{
+			slot = evict();
+			slotOfMarker[marker] = (int)slot;
+			markerOfSlot[slot] = marker;
+			rebuild(slot, marker, permutation);
+		}
+		else if(slotVersion[slot] != version)
+		{
+			if(version - slotVersion[slot] > logLength) rebuild(slot, marker, permutation);
+			else replay(slot);
+		}
+		lastSlot = slot;
+		return &(storage[(std::size_t)slot * n]);
+	}
+	//Record that the values at these two positions were swapped
+	void swapped(long position1, long position2)
+	{
+		record(false, position1, position2);
+	}
+	//Record that the value at position from was moved to position to, shifting the values in between
+	void moved(long from, long to)
+	{
+		record(true, from, to);
+	}
+private:
+	static const unsigned long long logLength = 32;
+	struct change
+	{
+		bool isMove;
+		long from, to;
+	};
+	void record(bool isMove, long from, long to)
+	{
+		version++;
+		change& entry = log[version % logLength];
+		entry.isMove = isMove;
+		entry.from = from;
+		entry.to = to;
+	}
+	long evict()
+	{
+		if(nextEviction == lastSlot) nextEviction = (nextEviction + 1) % capacity;
+		long slot = nextEviction;
+		nextEviction = (nextEviction + 1) % capacity;
+		if(markerOfSlot[slot] >= 0) slotOfMarker[markerOfSlot[slot]] = -1;
+		return slot;
+	}
+	void rebuild(long slot, int marker, const std::vector<int>& permutation)
+	{
+		double* destination = &(storage[(std::size_t)slot * n]);
+		const Rbyte* source = rawDist + (std::size_t)marker * n;
+		for(long i = 0; i < n; i++) destination[i] = levels[source[permutation[i]]];
+		slotVersion[slot] = version;
+	}
+	//Apply the changes made since this row was last brought up to date
+	void replay(long slot)
+	{
+		double* values = &(storage[(std::size_t)slot * n]);
+		for(unsigned long long current = slotVersion[slot] + 1; current <= version; current++)
+		{
+			const change& entry = log[current % logLength];
+			if(!entry.isMove) std::swap(values[entry.from], values[entry.to]);
+			else
+			{
+				double moving = values[entry.from];
+				if(entry.to > entry.from) memmove(values + entry.from, values + entry.from + 1, sizeof(double)*(entry.to - entry.from));
+				else memmove(values + entry.to + 1, values + entry.to, sizeof(double)*(entry.from - entry.to));
+				values[entry.to] = moving;
+			}
+		}
+		slotVersion[slot] = version;
+	}
+	const Rbyte* rawDist;
+	const std::vector<double>& levels;
+	long n, capacity;
+	std::vector<double> storage;
+	std::vector<int> slotOfMarker, markerOfSlot;
+	std::vector<unsigned long long> slotVersion;
+	change log[logLength];
+	unsigned long long version;
+	long nextEviction, lastSlot;
+};
+#endif
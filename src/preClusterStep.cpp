@@ -1,11 +1,25 @@
 #include "preClusterStep.h"
+#include "rawSymmetricMatrix.h"
+#include <limits>
+#include <cstring>
+#ifdef USE_OPENMP
+#include <omp.h>
+#endif
+//Number of columns of the triangle that are scanned as a single piece of work
+const R_xlen_t preClusterColumnBlock = 256;
+/* Find the bins of markers with pairwise zero recombination. 
+ *
+ * Conceptually every marker starts in its own group. In each round the groups are considered in order, and each one is merged with the first later group (that hasn't already been merged in this round) for which every pair of markers has recombination fraction zero. Merged groups go on to the next round, in the order they were created, and the other groups are finalised. 
+ *
+ * Two groups can only be merged if they are joined by a pair of markers with zero recombination, so the triangle is scanned once to find those pairs, and the rounds are replayed using only those pairs. 
+ */
 SEXP preClusterStep(SEXP mpcrossRF_)
 {
 BEGIN_RCPP
 	Rcpp::S4 mpcrossRF = mpcrossRF_;
 	Rcpp::S4 rf = mpcrossRF.slot("rf");
 	Rcpp::S4 theta = rf.slot("theta");
-	Rcpp::RawVector data = theta.slot("data");
+	rawSymmetricMatrixData data(theta);
 	Rcpp::CharacterVector markers = theta.slot("markers");
 	Rcpp::NumericVector levels = theta.slot("levels");
 
@@ -16,78 +30,129 @@ BEGIN_RCPP
 	}
 	Rbyte zeroLevel = (Rbyte)std::distance(levels.begin(), zeroIterator);
 	R_xlen_t nMarkers = markers.size();
-	struct group
+
+	//Find the pairs with zero recombination, in a single pass over the packed triangle. Every block of columns gets its own list, so that the combined list is in order of column, and then row. 
+	const Rbyte* packed = data.data();
+	long nBlocks = (long)((nMarkers + preClusterColumnBlock - 1) / preClusterColumnBlock);
+	std::vector<std::vector<std::pair<int, int> > > blockPairs(nBlocks);
+#ifdef USE_OPENMP
+	#pragma omp parallel for schedule(dynamic)
+#endif
+	for(long block = 0; block < nBlocks; block++)
+	{
+		R_xlen_t blockEnd = std::min(nMarkers, (block + 1) * preClusterColumnBlock);
+		for(R_xlen_t column = block * preClusterColumnBlock; column < blockEnd; column++)
+		{
+			const Rbyte* columnData = packed + (column * (column + (R_xlen_t)1))/(R_xlen_t)2;
+			//Most entries are not zero, so skip over them with memchr
+			const Rbyte* current = columnData, *end = columnData + column;
+			while((current = (const Rbyte*)memchr(current, zeroLevel, end - current)) != NULL)
+			{
+				blockPairs[block].push_back(std::make_pair((int)(current - columnData), (int)column));
+				current++;
+			}
+		}
+	}
+	//Sorted lists of the markers with zero recombination with each marker
+	std::vector<std::size_t> neighbourStart(nMarkers + 1, 0);
+	for(long block = 0; block < nBlocks; block++)
 	{
-	public:
-		group()
+		for(std::vector<std::pair<int, int> >::iterator pair = blockPairs[block].begin(); pair != blockPairs[block].end(); pair++)
 		{
-			data.reserve(1);
+			neighbourStart[pair->first + 1]++;
+			neighbourStart[pair->second + 1]++;
 		}
-		group(group&& other)
-			: data(std::move(other.data))
-		{}
-		group& operator=(group&& other)
+	}
+	for(R_xlen_t i = 0; i < nMarkers; i++) neighbourStart[i + 1] += neighbourStart[i];
+	std::vector<int> neighbours(neighbourStart[nMarkers]);
+	{
+		std::vector<std::size_t> position(neighbourStart.begin(), neighbourStart.end() - 1);
+		for(long block = 0; block < nBlocks; block++)
 		{
-			data.swap(other.data);
-			return *this;
+			for(std::vector<std::pair<int, int> >::iterator pair = blockPairs[block].begin(); pair != blockPairs[block].end(); pair++)
+			{
+				neighbours[position[pair->first]++] = pair->second;
+				neighbours[position[pair->second]++] = pair->first;
+			}
+			std::vector<std::pair<int, int> >().swap(blockPairs[block]);
 		}
-		std::vector<int> data;
-	private:
-		group(const group& other);
+	}
+	auto isZero = [&neighbours, &neighbourStart](int marker1, int marker2)
+	{
+		return std::binary_search(neighbours.begin() + neighbourStart[marker1], neighbours.begin() + neighbourStart[marker1 + 1], marker2);
 	};
-	//The groups that are now fixed
-	std::vector<group> finalisedGroups;
-	//The groups that we're currently considering
-	std::vector<group> continuingGroups(nMarkers);
-	//The groups that we will consider in the next step
-	std::vector<group> newContinuingGroups(nMarkers);
 
+	//The groups that are now fixed
+	std::vector<std::vector<int> > finalisedGroups;
+	//The groups that we're currently considering, and those that we will consider in the next step
+	std::vector<std::vector<int> > continuingGroups(nMarkers), newContinuingGroups;
+	//The position of the group containing each marker, within continuingGroups, or finalised
+	const std::size_t finalised = std::numeric_limits<std::size_t>::max();
+	std::vector<std::size_t> groupOfMarker(nMarkers);
 	//Initially every marker is in its own group
-	for(R_xlen_t i = 0; i < nMarkers; i++) continuingGroups[i].data.push_back((int)i);
+	for(R_xlen_t i = 0; i < nMarkers; i++)
+	{
+		continuingGroups[i].push_back((int)i);
+		groupOfMarker[i] = i;
+	}
+	std::vector<std::size_t> candidates;
 	while(continuingGroups.size() > 0)
 	{
 		for(std::size_t i = 0; i < continuingGroups.size(); i++)
 		{
-			if(continuingGroups[i].data.size() == 0) continue;
-			for(std::size_t j = i + 1; j < continuingGroups.size(); j++)
+			std::vector<int>& iData = continuingGroups[i];
+			if(iData.size() == 0) continue;
+			//Any group that can be merged with this one contains a marker with zero recombination with the first marker of this one. 
+			candidates.clear();
+			int firstMarker = iData[0];
+			for(std::size_t neighbour = neighbourStart[firstMarker]; neighbour < neighbourStart[firstMarker + 1]; neighbour++)
 			{
-				const std::vector<int>& iData = continuingGroups[i].data, &jData = continuingGroups[j].data;
-				if(jData.size() == 0) continue;
+				std::size_t j = groupOfMarker[neighbours[neighbour]];
+				if(j != finalised && j > i && continuingGroups[j].size() > 0) candidates.push_back(j);
+			}
+			std::sort(candidates.begin(), candidates.end());
+			candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+			bool merged = false;
+			for(std::vector<std::size_t>::iterator j = candidates.begin(); j != candidates.end() && !merged; j++)
+			{
+				std::vector<int>& jData = continuingGroups[*j];
 				//Check that every marker has recombination 0 with every marker in group j
-				for(std::size_t i_ = 0; i_ < iData.size(); i_++)
+				bool allZero = true;
+				for(std::size_t i_ = 0; i_ < iData.size() && allZero; i_++)
 				{
-					R_xlen_t iMarker = iData[i_];
-					for(std::size_t j_ = 0; j_ < jData.size(); j_++)
+					for(std::size_t j_ = 0; j_ < jData.size() && allZero; j_++)
 					{
-						R_xlen_t jMarker = jData[j_];
-						R_xlen_t rowMarker = std::min(jMarker, iMarker);
-						R_xlen_t columnMarker = std::max(jMarker, iMarker);
-						if(data[(columnMarker * (columnMarker+(R_xlen_t)1))/(R_xlen_t)2 + rowMarker] != zeroLevel)
-						{
-							//If it doesn't, continue to the next group j
-							goto nextJ;
-						}
+						allZero = isZero(iData[i_], jData[j_]);
 					}
 				}
-				//If it does, combine the groups and add them to the set to be considered in the next step
-				continuingGroups[i].data.insert(continuingGroups[i].data.end(), continuingGroups[j].data.begin(), continuingGroups[j].data.end());
-				continuingGroups[j].data.clear();
-				newContinuingGroups.emplace_back(std::move(continuingGroups[i]));
-				goto nextI;
-	nextJ:
-				;
+				if(allZero)
+				{
+					//If it does, combine the groups and add them to the set to be considered in the next step
+					iData.insert(iData.end(), jData.begin(), jData.end());
+					std::vector<int>().swap(jData);
+					newContinuingGroups.emplace_back(std::move(iData));
+					iData.clear();
+					merged = true;
+				}
+			}
+			if(!merged)
+			{
+				for(std::vector<int>::iterator marker = iData.begin(); marker != iData.end(); marker++) groupOfMarker[*marker] = finalised;
+				finalisedGroups.emplace_back(std::move(iData));
+				iData.clear();
 			}
-			finalisedGroups.emplace_back(std::move(continuingGroups[i]));
-	nextI:
-			;
 		}
 		continuingGroups.swap(newContinuingGroups);
 		newContinuingGroups.clear();
+		for(std::size_t i = 0; i < continuingGroups.size(); i++)
+		{
+			for(std::vector<int>::iterator marker = continuingGroups[i].begin(); marker != continuingGroups[i].end(); marker++) groupOfMarker[*marker] = i;
+		}
 	}
 	Rcpp::List result(finalisedGroups.size());
 	for(std::size_t i = 0; i < finalisedGroups.size(); i++)
 	{
-		Rcpp::IntegerVector currentGroup = Rcpp::wrap(finalisedGroups[i].data);
+		Rcpp::IntegerVector currentGroup = Rcpp::wrap(finalisedGroups[i]);
 		//Add 1, because these are going to be R indices
 		for(int j = 0; j < currentGroup.size(); j++) currentGroup[j]++;
 		result[i] = currentGroup;
@@ -95,4 +160,3 @@ BEGIN_RCPP
 	return result;
 END_RCPP
 }
-
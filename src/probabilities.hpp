@@ -9,15 +9,50 @@
  * Struct that will contain arrays relevant for probability calculations
  */
 template<int nFounders> struct probabilityData;
+#include "compressedProbabilities.hpp"
 /*
- * The type for the expanded probability data, in the case of infinite selfing
+ * The type for the two-point probability data, in the case of finite selfing. The probability of a pair of genotypes at two markers only takes one of a small number of different values, so only those values are stored. The value for a specific pair of genotypes is values[finiteSelfingTransitionClasses<nFounders>::get().classes[first][second]]. 
  */
 template<int nFounders> struct expandedProbabilitiesFiniteSelfing
 {
 public:
 	expandedProbabilitiesFiniteSelfing()
 	{}
-	double values[nFounders][nFounders][nFounders][nFounders];
+	double values[compressedProbabilities<nFounders, false>::nDifferentProbs];
+};
+/*
+ * For finite selfing, the class of the two-point probability for every pair of genotypes. Genotypes are unordered pairs of founder positions (i, j) with j <= i, and have index i*(i+1)/2 + j. These are the same for every marker interval and every line, so they are computed once and shared. Storing the classes separately means that the probability data for a single marker interval is a few hundred bytes, rather than nFounders^4 values. 
+ */
+template<int nFounders> struct finiteSelfingTransitionClasses
+{
+public:
+	static const int nGenotypes = (nFounders*(nFounders+1))/2;
+	unsigned char classes[nGenotypes][nGenotypes];
+	static const finiteSelfingTransitionClasses<nFounders>& get()
+	{
+		static const finiteSelfingTransitionClasses<nFounders> instance;
+		return instance;
+	}
+private:
+	finiteSelfingTransitionClasses()
+	{
+		static_assert(compressedProbabilities<nFounders, false>::nDifferentProbs <= 256, "Transition classes must fit in an unsigned char");
+		for(int first1 = 0; first1 < nFounders; first1++)
+		{
+			for(int first2 = 0; first2 <= first1; first2++)
+			{
+				const int index1 = probabilityData<nFounders>::intermediateAllelesMask[first1][first2];
+				for(int second1 = 0; second1 < nFounders; second1++)
+				{
+					for(int second2 = 0; second2 <= second1; second2++)
+					{
+						const int index2 = probabilityData<nFounders>::intermediateAllelesMask[second1][second2];
+						classes[(first1*(first1+1))/2 + first2][(second1*(second1+1))/2 + second2] = (unsigned char)probabilityData<nFounders>::intermediateProbabilitiesMask[index1][index2];
+					}
+				}
+			}
+		}
+	}
 };
 /*
  * Type with a typedef, giving the type for the expanded probability data, both infinite generations of selfing and finite generations of selfing
@@ -37,7 +72,6 @@ template<int nFounders> struct expandedProbabilities<nFounders, false>
 {
 	typedef expandedProbabilitiesFiniteSelfing<nFounders> type;
 };
-#include "compressedProbabilities.hpp"
 /*
  * Templated function to work out the two-point probabilities with the given recombination fraction (and number of AI generations). Templating allows the number of founders to be a compile-time constant
  */
@@ -112,57 +146,21 @@ public:
 		const int nDifferentProbs = compressedProbabilities<nFounders, false>::nDifferentProbs;
 		std::array<double, nDifferentProbs> probabilities;
 		genotypeProbabilitiesNoIntercross<nFounders, false>(probabilities, r, selfingGenerations, nFunnels);
-		memset(&expandedProbabilities, 0, sizeof(expandedProbabilitiesFiniteSelfing<nFounders>));
-		if(takeLogs)
-		{
-			for(int i = 0; i < nDifferentProbs; i++)
-			{
-				if(probabilities[i] == 0) probabilities[i] = -std::numeric_limits<double>::infinity();
-				else probabilities[i] = log(probabilities[i]);
-			}
-		}
-#ifndef NDEBUG
-		double sum = 0;
-#endif
-		for(int marker1Allele1 = 0; marker1Allele1 < nFounders; marker1Allele1++)
-		{
-			for(int marker1Allele2 = 0; marker1Allele2 < nFounders; marker1Allele2++)
-			{
-				for(int marker2Allele1 = 0; marker2Allele1 < nFounders; marker2Allele1++)
-				{
-					for(int marker2Allele2 = 0; marker2Allele2 < nFounders; marker2Allele2++)
-					{
-						const int index1 = probabilityData<nFounders>::intermediateAllelesMask[marker1Allele1][marker1Allele2];
-						const int index2 = probabilityData<nFounders>::intermediateAllelesMask[marker2Allele1][marker2Allele2];
-						expandedProbabilities.values[marker1Allele1][marker1Allele2][marker2Allele1][marker2Allele2] = probabilities[probabilityData<nFounders>::intermediateProbabilitiesMask[index1][index2]];
-#ifndef NDEBUG
-						sum += expandedProbabilities.values[marker1Allele1][marker1Allele2][marker2Allele1][marker2Allele2];
-#endif
-					}
-				}
-			}
-		}
-#ifndef NDEBUG
-		if(!takeLogs && fabs(sum - 1) > 1e-6) throw std::runtime_error("Haplotype probabilities did not sum to 1");
-#endif
+		store(expandedProbabilities, probabilities);
 	}
 	static void withIntercross(expandedProbabilitiesFiniteSelfing<nFounders>& expandedProbabilities, int nAIGenerations, double r, int selfingGenerations, std::size_t nFunnels)
 	{
 		const int nDifferentProbs = compressedProbabilities<nFounders, false>::nDifferentProbs;
 		std::array<double, nDifferentProbs> probabilities;
 		genotypeProbabilitiesWithIntercross<nFounders, false>(probabilities, nAIGenerations, r, selfingGenerations, nFunnels);
-		memset(&expandedProbabilities, 0, sizeof(expandedProbabilitiesFiniteSelfing<nFounders>));
-		if(takeLogs)
-		{
-			for(int i = 0; i < nDifferentProbs; i++)
-			{
-				if(probabilities[i] == 0) probabilities[i] = -std::numeric_limits<double>::infinity();
-				else probabilities[i] = log(probabilities[i]);
-			}
-		}
+		store(expandedProbabilities, probabilities);
+	}
+private:
+	static void store(expandedProbabilitiesFiniteSelfing<nFounders>& expandedProbabilities, std::array<double, compressedProbabilities<nFounders, false>::nDifferentProbs>& probabilities)
+	{
+		const int nDifferentProbs = compressedProbabilities<nFounders, false>::nDifferentProbs;
 #ifndef NDEBUG
 		double sum = 0;
-#endif
 		for(int marker1Allele1 = 0; marker1Allele1 < nFounders; marker1Allele1++)
 		{
 			for(int marker1Allele2 = 0; marker1Allele2 < nFounders; marker1Allele2++)
@@ -173,17 +171,19 @@ public:
 					{
 						const int index1 = probabilityData<nFounders>::intermediateAllelesMask[marker1Allele1][marker1Allele2];
 						const int index2 = probabilityData<nFounders>::intermediateAllelesMask[marker2Allele1][marker2Allele2];
-						expandedProbabilities.values[marker1Allele1][marker1Allele2][marker2Allele1][marker2Allele2] = probabilities[probabilityData<nFounders>::intermediateProbabilitiesMask[index1][index2]];
-#ifndef NDEBUG
-						sum += expandedProbabilities.values[marker1Allele1][marker1Allele2][marker2Allele1][marker2Allele2];
-#endif
+						sum += probabilities[probabilityData<nFounders>::intermediateProbabilitiesMask[index1][index2]];
 					}
 				}
 			}
 		}
-#ifndef NDEBUG
-		if(!takeLogs && fabs(sum - 1) > 1e-6) throw std::runtime_error("Haplotype probabilities did not sum to 1");
+		if(fabs(sum - 1) > 1e-6) throw std::runtime_error("Haplotype probabilities did not sum to 1");
 #endif
+		for(int i = 0; i < nDifferentProbs; i++)
+		{
+			if(!takeLogs) expandedProbabilities.values[i] = probabilities[i];
+			else if(probabilities[i] == 0) expandedProbabilities.values[i] = -std::numeric_limits<double>::infinity();
+			else expandedProbabilities.values[i] = log(probabilities[i]);
+		}
 	}
 };
 #endif
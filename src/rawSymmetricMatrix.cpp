@@ -1,5 +1,61 @@
 #include "rawSymmetricMatrix.h"
 #include "matrixChunks.h"
+#include <sstream>
+rawSymmetricMatrixData::rawSymmetricMatrixData(Rcpp::S4 object)
+	: dataPtr(NULL), nValues(0)
+{
+	Rcpp::CharacterVector file;
+	if(object.hasSlot("file"))
+	{
+		try
+		{
+			file = Rcpp::as<Rcpp::CharacterVector>(object.slot("file"));
+		}
+		catch(...)
+		{
+			throw std::runtime_error("Slot file of a rawSymmetricMatrix must be a character vector");
+		}
+	}
+	if(file.size() > 0)
+	{
+		mapped.reset(new mappedTriangularStore(Rcpp::as<std::string>(file[0])));
+		dataPtr = mapped->theta();
+		nValues = (R_xlen_t)mapped->size();
+	}
+	else
+	{
+		inMemory = Rcpp::as<Rcpp::RawVector>(object.slot("data"));
+		nValues = inMemory.size();
+		if(nValues > 0) dataPtr = &(inMemory[0]);
+	}
+}
+rfValuesData::rfValuesData(Rcpp::S4 rf, const rawSymmetricMatrixData& theta, valueType type)
+	: inMemoryPtr(NULL), mapped(NULL), type(type), nValues(0)
+{
+	const char* slotName = type == lodValues ? "lod" : "lkhd";
+	Rcpp::RObject slot = rf.slot(slotName);
+	if(!slot.isNULL())
+	{
+		try
+		{
+			inMemory = Rcpp::as<Rcpp::NumericVector>(Rcpp::as<Rcpp::S4>(slot).slot("x"));
+		}
+		catch(...)
+		{
+			std::stringstream ss;
+			ss << "Slot " << slotName << "@x of an rf object must be a numeric vector";
+			throw std::runtime_error(ss.str().c_str());
+		}
+		nValues = inMemory.size();
+		//Use a non-NULL pointer even if there are no values, so that present() is still true
+		inMemoryPtr = inMemory.begin();
+	}
+	else if(theta.store() != NULL && (type == lodValues ? theta.store()->hasLod() : theta.store()->hasLkhd()))
+	{
+		mapped = theta.store();
+		nValues = (R_xlen_t)mapped->size();
+	}
+}
 SEXP rawSymmetricMatrixSubsetByMatrix(SEXP object_, SEXP index_)
 {
 BEGIN_RCPP
@@ -13,12 +69,12 @@ BEGIN_RCPP
 		throw std::runtime_error("Input object must be an S4 object");
 	}
 
-	Rcpp::RawVector data;
+	rawSymmetricMatrixData data;
 	try
 	{
-		data = Rcpp::as<Rcpp::RawVector>(object.slot("data"));
+		data = rawSymmetricMatrixData(object);
 	}
-	catch(...)
+	catch(Rcpp::not_compatible&)
 	{
 		throw std::runtime_error("Slot object@data must be a raw vector");
 	}
@@ -61,7 +117,7 @@ BEGIN_RCPP
 	Rcpp::S4 object = object_;
 	Rcpp::CharacterVector markers = object.slot("markers");
 	Rcpp::NumericVector levels = object.slot("levels");
-	Rcpp::RawVector data = object.slot("data");
+	rawSymmetricMatrixData data(object);
 	Rcpp::IntegerVector i = i_;
 	Rcpp::IntegerVector j = j_;
 	bool drop = Rcpp::as<bool>(drop_);
@@ -135,14 +191,56 @@ BEGIN_RCPP
 	return result;
 END_RCPP
 }
+//Extract the values for the markers with these (1-based) indices from a packed upper triangular matrix, in the same format
+template<typename packedData> Rcpp::RawVector subsetPacked(packedData& oldData, Rcpp::IntegerVector& indices)
+{
+	R_xlen_t newNMarkers = indices.size();
+	Rcpp::RawVector newData((indices.size() * (indices.size() + (R_xlen_t)1))/(R_xlen_t)2);
+	R_xlen_t counter = 0;
+	//Column
+	for(R_xlen_t j = 0; j < newNMarkers; j++)
+	{
+		//Row
+		for(R_xlen_t i = 0; i <= j; i++)
+		{
+			R_xlen_t indexJ = indices[j], indexI = indices[i];
+			if(indexI > indexJ) std::swap(indexI, indexJ);
+			newData(counter) = oldData[(indexJ*(indexJ-(R_xlen_t)1))/(R_xlen_t)2 + indexI - (R_xlen_t)1];
+			counter++;
+		}
+	}
+	return newData;
+}
 SEXP rawSymmetricMatrixSubsetObject(SEXP object_, SEXP indices_)
 {
 BEGIN_RCPP
 	Rcpp::S4 object = object_;
-	Rcpp::RawVector oldData = object.slot("data");
+	rawSymmetricMatrixData oldData(object);
 	Rcpp::IntegerVector indices = indices_;
+	return subsetPacked(oldData, indices);
+END_RCPP
+}
+SEXP packedRawSubset(SEXP data_, SEXP indices_)
+{
+BEGIN_RCPP
+	Rcpp::RawVector data = data_;
+	Rcpp::IntegerVector indices = indices_;
+	return subsetPacked(data, indices);
+END_RCPP
+}
+SEXP rawSymmetricMatrixSubsetToFile(SEXP object_, SEXP indices_, SEXP file_)
+{
+BEGIN_RCPP
+	Rcpp::S4 object = object_;
+	rawSymmetricMatrixData oldData(object);
+	const mappedTriangularStore* oldStore = oldData.store();
+	if(oldStore == NULL) throw std::runtime_error("Input object must reference a file");
+	Rcpp::IntegerVector indices = indices_;
+	std::string file = Rcpp::as<std::string>(file_);
 	R_xlen_t newNMarkers = indices.size();
-	Rcpp::RawVector newData((indices.size() * (indices.size() + (R_xlen_t)1))/(R_xlen_t)2);
+	if(newNMarkers == 0) throw std::runtime_error("At least one marker must be selected");
+	mappedTriangularStore newStore(file, (newNMarkers * (newNMarkers + (R_xlen_t)1))/(R_xlen_t)2, oldStore->bytesPerLod(), oldStore->bytesPerLkhd());
+	Rbyte* newTheta = newStore.theta();
 	R_xlen_t counter = 0;
 	//Column
 	for(R_xlen_t j = 0; j < newNMarkers; j++)
@@ -152,11 +250,15 @@ BEGIN_RCPP
 		{
 			R_xlen_t indexJ = indices[j], indexI = indices[i];
 			if(indexI > indexJ) std::swap(indexI, indexJ);
-			newData(counter) = oldData[(indexJ*(indexJ-(R_xlen_t)1))/(R_xlen_t)2 + indexI - (R_xlen_t)1];
+			R_xlen_t oldIndex = (indexJ*(indexJ-(R_xlen_t)1))/(R_xlen_t)2 + indexI - (R_xlen_t)1;
+			newTheta[counter] = oldData[oldIndex];
+			if(newStore.hasLod()) newStore.setLod(counter, oldStore->lod(oldIndex));
+			if(newStore.hasLkhd()) newStore.setLkhd(counter, oldStore->lkhd(oldIndex));
 			counter++;
 		}
 	}
-	return newData;
+	newStore.flush();
+	return R_NilValue;
 END_RCPP
 }
 SEXP assignRawSymmetricMatrixFromEstimateRF(SEXP destination_, SEXP rowIndices_, SEXP columnIndices_, SEXP source_)
@@ -197,11 +299,11 @@ SEXP assignRawSymmetricMatrixDiagonal(SEXP destination_, SEXP indices_, SEXP sou
 {
 BEGIN_RCPP
 	Rcpp::S4 destination = destination_;
-	Rcpp::RawVector source = source_;
+	rawSymmetricMatrixData source(Rcpp::as<Rcpp::S4>(source_));
 	Rcpp::RawVector destinationData = destination.slot("data");
 	Rcpp::IntegerVector indices = indices_;
 
-	if(&(source(0)) == &(destinationData(0)))
+	if(source.data() == &(destinationData(0)))
 	{
 		throw std::runtime_error("Source and destination cannot be the same in assignRawSymmetricMatrixDiagonal");
 	}
@@ -231,7 +333,7 @@ SEXP checkRawSymmetricMatrix(SEXP rawSymmetric_)
 BEGIN_RCPP
 	Rcpp::S4 rawSymmetric = rawSymmetric_;
 	Rcpp::NumericVector levels = Rcpp::as<Rcpp::NumericVector>(rawSymmetric.slot("levels"));
-	Rcpp::RawVector data = Rcpp::as<Rcpp::RawVector>(rawSymmetric.slot("data"));
+	rawSymmetricMatrixData data(rawSymmetric);
 	R_xlen_t size = data.size(), levelsSize = levels.size();
 	for(R_xlen_t i = 0; i < size; i++)
 	{
@@ -246,7 +348,7 @@ BEGIN_RCPP
 	Rcpp::S4 rawSymmetric = object;
 	Rcpp::NumericVector levels = Rcpp::as<Rcpp::NumericVector>(rawSymmetric.slot("levels"));
 	Rcpp::CharacterVector markers = Rcpp::as<Rcpp::CharacterVector>(rawSymmetric.slot("markers"));
-	Rcpp::RawVector data = Rcpp::as<Rcpp::RawVector>(rawSymmetric.slot("data"));
+	rawSymmetricMatrixData data(rawSymmetric);
 	R_xlen_t size = markers.size(), levelsSize = levels.size();
 
 	Rcpp::NumericVector result(size*(size - 1)/2, 0);
@@ -269,7 +371,7 @@ BEGIN_RCPP
 	return result;
 END_RCPP
 }
-SEXP constructDissimilarityMatrixInternal(unsigned char* data, std::vector<double>& levels, int size, SEXP clusters_, int start, const std::vector<int>& currentPermutation)
+SEXP constructDissimilarityMatrixInternal(const unsigned char* data, std::vector<double>& levels, int size, SEXP clusters_, int start, const std::vector<int>& currentPermutation)
 {
 	Rcpp::IntegerVector clusters = Rcpp::as<Rcpp::IntegerVector>(clusters_);
 	int minCluster = *std::min_element(clusters.begin(), clusters.end()), maxCluster = *std::max_element(clusters.begin(), clusters.end());
@@ -317,12 +419,12 @@ BEGIN_RCPP
 	Rcpp::S4 rawSymmetric = object;
 	Rcpp::NumericVector levels = Rcpp::as<Rcpp::NumericVector>(rawSymmetric.slot("levels"));
 	Rcpp::CharacterVector markers = Rcpp::as<Rcpp::CharacterVector>(rawSymmetric.slot("markers"));
-	Rcpp::RawVector data = Rcpp::as<Rcpp::RawVector>(rawSymmetric.slot("data"));
+	rawSymmetricMatrixData data(rawSymmetric);
 	int nMarkers = markers.size();
 	std::vector<double> levelsCopied = Rcpp::as<std::vector<double> >(levels);
 	
 	std::vector<int> permutation(nMarkers);
 	for(int i = 0; i < nMarkers; i++) permutation[i] = i;
-	return constructDissimilarityMatrixInternal(&(data(0)), levelsCopied, nMarkers, clusters_, 0, permutation);
+	return constructDissimilarityMatrixInternal(data.data(), levelsCopied, nMarkers, clusters_, 0, permutation);
 END_RCPP
 }
@@ -1,13 +1,89 @@
 #ifndef RAW_SYMMETRIC_MATRIX_HEADER_GUARD
 #define RAW_SYMMETRIC_MATRIX_HEADER_GUARD
 #include <Rcpp.h>
+#include <memory>
+#include "mappedTriangularStore.h"
+/* Read-only access to the values of a rawSymmetricMatrix object. If slot file of the object is set, the values are read lazily from the memory-mapped file. Otherwise slot data is used.
+ */
+class rawSymmetricMatrixData
+{
+public:
+	rawSymmetricMatrixData()
+		: dataPtr(NULL), nValues(0)
+	{}
+	rawSymmetricMatrixData(Rcpp::S4 object);
+	const Rbyte* data() const
+	{
+		return dataPtr;
+	}
+	R_xlen_t size() const
+	{
+		return nValues;
+	}
+	Rbyte operator[](R_xlen_t index) const
+	{
+		return dataPtr[index];
+	}
+	Rbyte operator()(R_xlen_t index) const
+	{
+		return dataPtr[index];
+	}
+	//The underlying file, or NULL if the values are held in memory
+	const mappedTriangularStore* store() const
+	{
+		return mapped.get();
+	}
+private:
+	Rcpp::RawVector inMemory;
+	std::unique_ptr<mappedTriangularStore> mapped;
+	const Rbyte* dataPtr;
+	R_xlen_t nValues;
+};
+/* Read-only access to the lod or lkhd values of an rf object. These are taken from slot x of the corresponding dspMatrix if that slot is not NULL, and otherwise from the file referenced by the theta values, if estimateRF stored them there. The theta values must outlive this object.
+ */
+class rfValuesData
+{
+public:
+	enum valueType
+	{
+		lodValues, lkhdValues
+	};
+	rfValuesData()
+		: inMemoryPtr(NULL), mapped(NULL), type(lodValues), nValues(0)
+	{}
+	rfValuesData(Rcpp::S4 rf, const rawSymmetricMatrixData& theta, valueType type);
+	//Whether the values are available at all
+	bool present() const
+	{
+		return inMemoryPtr != NULL || mapped != NULL;
+	}
+	R_xlen_t size() const
+	{
+		return nValues;
+	}
+	double operator()(R_xlen_t index) const
+	{
+		if(inMemoryPtr != NULL) return inMemoryPtr[index];
+		return type == lodValues ? mapped->lod(index) : mapped->lkhd(index);
+	}
+private:
+	Rcpp::NumericVector inMemory;
+	const double* inMemoryPtr;
+	const mappedTriangularStore* mapped;
+	valueType type;
+	R_xlen_t nValues;
+};
 SEXP rawSymmetricMatrixSubsetIndices(SEXP object, SEXP i, SEXP j, SEXP drop);
 SEXP rawSymmetricMatrixSubsetObject(SEXP object, SEXP indices);
+//The same as rawSymmetricMatrixSubsetObject, for a raw vector holding a packed upper triangular matrix
+SEXP packedRawSubset(SEXP data, SEXP indices);
+//Equivalent to rawSymmetricMatrixSubsetObject, but the subset (including any lod and lkhd values) is written to a new file, for objects which reference a file
+SEXP rawSymmetricMatrixSubsetToFile(SEXP object, SEXP indices, SEXP file);
 SEXP assignRawSymmetricMatrixFromEstimateRF(SEXP destination, SEXP rowIndices, SEXP columnIndices, SEXP source);
 SEXP assignRawSymmetricMatrixDiagonal(SEXP destination, SEXP indices, SEXP source);
 SEXP checkRawSymmetricMatrix(SEXP rawSymmetric);
 SEXP rawSymmetricMatrixSubsetByMatrix(SEXP object_, SEXP index_);
 SEXP rawSymmetricMatrixToDist(SEXP object);
-SEXP constructDissimilarityMatrixInternal(unsigned char* data, std::vector<double>& levels, int size, SEXP clusters_, int start, const std::vector<int>& permutation);
+SEXP constructDissimilarityMatrixInternal(const unsigned char* data, std::vector<double>& levels, int size, SEXP clusters_, int start, const std::vector<int>& permutation);
 SEXP constructDissimilarityMatrix(SEXP object, SEXP clusters);
 #endif
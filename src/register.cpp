@@ -2,6 +2,7 @@
 #include <R_ext/Rdynload.h>
 #include "checkHets.h"
 #include "generateGenotypes.h"
+#include "simulateGenotypes.h"
 #include "alleleDataErrors.h"
 #include "estimateRF.h"
 #ifdef CUSTOM_STATIC_RCPP
@@ -15,6 +16,7 @@
 #include "sixteenParentPedigreeRandomFunnels.h"
 #include "matrixChunks.h"
 #include "rawSymmetricMatrix.h"
+#include "mappedTriangularStore.h"
 #include "dspMatrix.h"
 #include "preClusterStep.h"
 #include "hclustMatrices.h"
@@ -27,10 +29,13 @@
 #include "imputeFounders.h"
 #include "checkImputedBounds.h"
 #include "generateDesignMatrix.h"
+#include "estimateMapNNLS.h"
 #include "compressedProbabilities_RInterface.h"
 #include "testDistortion.h"
 #include "removeHets.h"
 #include "computeGenotypeProbabilities.h"
+#include "bitPackedGenotypes.h"
+#include "finiteSelfingTransitionBasis.hpp"
 #ifdef HAS_BOOST
 	#include "reorderPedigree.h"
 #endif
@@ -41,9 +46,10 @@ extern "C"
 	{
 		{"checkHets", (DL_FUNC)&checkHets, 1},
 		{"generateGenotypes", (DL_FUNC)&generateGenotypes, 3},
+		{"simulateGenotypes", (DL_FUNC)&simulateGenotypes, 3},
 		{"alleleDataErrors", (DL_FUNC)&alleleDataErrors, 2},
 		{"listCodingErrors", (DL_FUNC)&listCodingErrors, 3},
-		{"estimateRF", (DL_FUNC)&estimateRF, 9},
+		{"estimateRF", (DL_FUNC)&estimateRF, 15},
 		{"fourParentPedigreeRandomFunnels", (DL_FUNC)&fourParentPedigreeRandomFunnels, 4},
 		{"fourParentPedigreeSingleFunnel", (DL_FUNC)&fourParentPedigreeSingleFunnel, 4},
 		{"eightParentPedigreeRandomFunnels", (DL_FUNC)&eightParentPedigreeRandomFunnels, 4},
@@ -53,6 +59,8 @@ extern "C"
 		{"singleIndexToPair", (DL_FUNC)&singleIndexToPairExported, 3},
 		{"rawSymmetricMatrixSubsetIndices", (DL_FUNC)&rawSymmetricMatrixSubsetIndices, 4},
 		{"rawSymmetricMatrixSubsetObject", (DL_FUNC)&rawSymmetricMatrixSubsetObject, 2},
+		{"packedRawSubset", (DL_FUNC)&packedRawSubset, 2},
+		{"rawSymmetricMatrixSubsetToFile", (DL_FUNC)&rawSymmetricMatrixSubsetToFile, 3},
 		{"rawSymmetricMatrixToDist", (DL_FUNC)&rawSymmetricMatrixToDist, 1},
 		{"constructDissimilarityMatrix", (DL_FUNC)&constructDissimilarityMatrix, 2},
 		{"assignRawSymmetricMatrixFromEstimateRF", (DL_FUNC)&assignRawSymmetricMatrixFromEstimateRF, 4},
@@ -62,18 +70,21 @@ extern "C"
 		{"hclustThetaMatrix", (DL_FUNC)&hclustThetaMatrix, 2},
 		{"hclustCombinedMatrix", (DL_FUNC)&hclustCombinedMatrix, 2},
 		{"hclustLodMatrix", (DL_FUNC)&hclustLodMatrix, 2},
+		{"hclustPacked", (DL_FUNC)&hclustPacked, 4},
 		{"omp_set_num_threads", (DL_FUNC)&mpMap2_omp_set_num_threads, 1},
-		{"order", (DL_FUNC)&order, 9},
+		{"order", (DL_FUNC)&order, 12},
 		{"checkRawSymmetricMatrix", (DL_FUNC)&checkRawSymmetricMatrix, 1},
 		{"arsa", (DL_FUNC)&arsaExportedR, 8},
-		{"imputeWholeObject", (DL_FUNC)&imputeWholeObject, 2},
+		{"imputeWholeObject", (DL_FUNC)&imputeWholeObject, 3},
 		{"imputeGroup", (DL_FUNC)&imputeGroup, 3},
+		{"imputeAllGroups", (DL_FUNC)&imputeAllGroups, 2},
 		{"multiparentSNPRemoveHets", (DL_FUNC)&multiparentSNPRemoveHets, 1},
 		{"multiparentSNPKeepHets", (DL_FUNC)&multiparentSNPKeepHets, 1},
 		{"rawSymmetricMatrixSubsetByMatrix", (DL_FUNC)&rawSymmetricMatrixSubsetByMatrix, 2},
 		{"imputeFounders", (DL_FUNC)&imputeFounders, 4},
 		{"checkImputedBounds", (DL_FUNC)&checkImputedBounds, 1},
 		{"generateDesignMatrix", (DL_FUNC)&generateDesignMatrix, 2},
+		{"estimateMapNNLS", (DL_FUNC)&estimateMapNNLS, 3},
 		{"compressedProbabilities", (DL_FUNC)&compressedProbabilities_RInterface, 6},
 		{"eightParentPedigreeImproperFunnels", (DL_FUNC)&eightParentPedigreeImproperFunnels, 3},
 #ifdef HAS_BOOST
@@ -81,7 +92,13 @@ extern "C"
 #endif
 		{"testDistortion", (DL_FUNC)&testDistortion, 1},
 		{"removeHets", (DL_FUNC)&removeHets, 3},
-		{"computeGenotypeProbabilities", (DL_FUNC)&computeGenotypeProbabilities, 4},
+		{"computeGenotypeProbabilities", (DL_FUNC)&computeGenotypeProbabilities, 5},
+		{"mappedTriangularStoreInfo", (DL_FUNC)&mappedTriangularStoreInfo, 1},
+		{"mappedTriangularStoreSubset", (DL_FUNC)&mappedTriangularStoreSubset, 4},
+		{"bitPackedGenotypesMode", (DL_FUNC)&bitPackedGenotypesMode, 1},
+		{"finiteSelfingRecursionMode", (DL_FUNC)&finiteSelfingRecursionMode, 1},
+		{"arsaRawRowCacheBytes", (DL_FUNC)&arsaRawRowCacheBytes, 1},
+		{"arsaRawCompareDeltas", (DL_FUNC)&arsaRawCompareDeltas, 4},
 		{NULL, NULL, 0}
 	};
 	RcppExport void R_init_mpMap2(DllInfo *info)
@@ -0,0 +1,235 @@
+#include "simulateGenotypes.h"
+#include "arsaRandom.h"
+#include <vector>
+#include <limits>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#ifdef USE_OPENMP
+#include <omp.h>
+#endif
+//A run of consecutive markers, starting at marker start, which are all inherited from the same founder
+struct haplotypeSegment
+{
+	haplotypeSegment(int start, int founder)
+		: start(start), founder(founder)
+	{}
+	int start, founder;
+};
+typedef std::vector<haplotypeSegment> haplotype;
+//Append the part of source covering markers from, ..., to - 1 to destination
+void copySegments(const haplotype& source, int from, int to, haplotype& destination)
+{
+	haplotype::const_iterator current = std::upper_bound(source.begin(), source.end(), from, [](int position, const haplotypeSegment& segment){ return position < segment.start; }) - 1;
+	for(; current != source.end() && current->start < to; current++)
+	{
+		int start = std::max(current->start, from);
+		//Adjacent segments from the same founder are combined
+		if(destination.size() > 0 && destination.back().founder == current->founder) continue;
+		destination.push_back(haplotypeSegment(start, current->founder));
+	}
+}
+/* Simulate a gamete from a line with the two given haplotypes. 
+ *
+ * Instead of a draw for every interval, the crossovers are found directly. If interval i has recombination fraction r_i, it has hazard h_i = -log(1 - r_i), and cumulativeHazard[m] is the sum of the hazards of the intervals before marker m. The next crossover after marker m is in the first interval where the cumulative hazard since marker m exceeds an exponential random variable, which gives the same distribution as independent crossovers in every interval. 
+ */
+template<typename rng> void sampleGamete(const haplotype& first, const haplotype& second, const std::vector<double>& cumulativeHazard, rng& random, haplotype& output)
+{
+	int nMarkers = (int)cumulativeHazard.size();
+	bool useSecond = random() < 0.5;
+	int position = 0;
+	output.clear();
+	while(position < nMarkers)
+	{
+		double target = cumulativeHazard[position] - log(1 - random());
+		int next = (int)(std::lower_bound(cumulativeHazard.begin() + position + 1, cumulativeHazard.end(), target) - cumulativeHazard.begin());
+		copySegments(useSecond ? second : first, position, next, output);
+		position = next;
+		useSecond = !useSecond;
+	}
+}
+SEXP simulateGenotypes(SEXP recombinationFractions_sexp, SEXP markerNames_sexp, SEXP pedigree_sexp)
+{
+BEGIN_RCPP
+	std::vector<double> recombinationFractions;
+	try
+	{
+		recombinationFractions = Rcpp::as<std::vector<double> >(recombinationFractions_sexp);
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Input recombinationFractions must be a numeric vector");
+	}
+	Rcpp::CharacterVector markerNames;
+	try
+	{
+		markerNames = markerNames_sexp;
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Input markerNames must be a character vector");
+	}
+	Rcpp::S4 pedigree;
+	try
+	{
+		pedigree = Rcpp::S4(pedigree_sexp);
+	}
+	catch(...)
+	{
+		throw std::runtime_error("Input pedigree must be an S4 object");
+	}
+	if(Rcpp::as<std::string>(pedigree.attr("class")) != "detailedPedigree")
+	{
+		throw std::runtime_error("Input pedigree had class " + Rcpp::as<std::string>(pedigree.attr("class")) + " instead of detailedPedigree");
+	}
+	Rcpp::CharacterVector lineNames = Rcpp::as<Rcpp::CharacterVector>(pedigree.slot("lineNames"));
+	std::vector<int> mother = Rcpp::as<std::vector<int> >(pedigree.slot("mother"));
+	std::vector<int> father = Rcpp::as<std::vector<int> >(pedigree.slot("father"));
+	std::vector<int> observed = Rcpp::as<std::vector<int> >(pedigree.slot("observed"));
+
+	int nMarkers = (int)recombinationFractions.size() + 1, nLines = (int)lineNames.size();
+	if(markerNames.size() != nMarkers)
+	{
+		throw std::runtime_error("Input markerNames must have one more value than input recombinationFractions");
+	}
+	std::vector<double> cumulativeHazard(nMarkers, 0);
+	for(int i = 1; i < nMarkers; i++)
+	{
+		double fraction = recombinationFractions[i-1];
+		if(!(fraction >= 0 && fraction < 1))
+		{
+			throw std::runtime_error("Input recombinationFractions must contain values in [0, 1)");
+		}
+		cumulativeHazard[i] = cumulativeHazard[i-1] - log(1 - fraction);
+	}
+
+	//Lines are simulated in generations, where every line in a generation only depends on lines in earlier generations. Founders are the lines with no mother or father, and they must come first. 
+	std::vector<int> generation(nLines, 0), founderIndex(nLines, 0), remainingChildren(nLines, 0);
+	std::vector<std::vector<int> > generations(1);
+	int nFounders = 0;
+	for(int line = 0; line < nLines; line++)
+	{
+		bool isFounder = mother[line] == 0 || father[line] == 0;
+		if(isFounder)
+		{
+			if(nFounders != line)
+			{
+				throw std::runtime_error("Founder lines must be placed at the top of the pedigree");
+			}
+			founderIndex[line] = ++nFounders;
+			generations[0].push_back(line);
+			continue;
+		}
+		if(mother[line] > line || father[line] > line)
+		{
+			throw std::runtime_error("Mother and father must preceed offspring in the pedigree");
+		}
+		generation[line] = std::max(generation[mother[line]-1], generation[father[line]-1]) + 1;
+		if(generation[line] == (int)generations.size()) generations.resize(generations.size() + 1);
+		generations[generation[line]].push_back(line);
+		remainingChildren[mother[line]-1]++;
+		remainingChildren[father[line]-1]++;
+	}
+	int nObserved = (int)std::count(observed.begin(), observed.end(), 1);
+	if((std::size_t)nObserved * (std::size_t)(2 * nMarkers) > (std::size_t)std::numeric_limits<int>::max())
+	{
+		std::stringstream ss;
+		ss << "Simulation of genotypes requires a matrix with " << (std::size_t)nObserved * (std::size_t)(2 * nMarkers) << " entries. Matrices this large cannot be constructed in R";
+		throw std::runtime_error(ss.str());
+	}
+
+	//Every line gets its own random number generator, seeded from R's random number generator. So the result only depends on R's seed. 
+	std::vector<uint64_t> seeds(nLines);
+	GetRNGstate();
+	for(int line = nFounders; line < nLines; line++) seeds[line] = xoshiro256Plus::seedFromR();
+	PutRNGstate();
+
+	std::vector<haplotype> haplotypes(2 * (std::size_t)nLines);
+	for(int line = 0; line < nFounders; line++)
+	{
+		haplotypes[2*line].push_back(haplotypeSegment(0, founderIndex[line]));
+		haplotypes[2*line+1].push_back(haplotypeSegment(0, founderIndex[line]));
+	}
+	Rcpp::IntegerMatrix finals(nObserved, 2 * nMarkers);
+	Rcpp::CharacterVector finalNames(nObserved);
+	std::vector<int> finalRow(nLines, -1);
+	for(int line = 0, row = 0; line < nLines; line++)
+	{
+		if(observed[line] == 1)
+		{
+			finalNames[row] = lineNames[line];
+			finalRow[line] = row++;
+		}
+	}
+	int* finalsPtr = &(finals(0, 0));
+	for(std::size_t currentGeneration = 0; currentGeneration < generations.size(); currentGeneration++)
+	{
+		const std::vector<int>& lines = generations[currentGeneration];
+		long nLinesThisGeneration = (long)lines.size();
+#ifdef USE_OPENMP
+		#pragma omp parallel for schedule(dynamic)
+#endif
+		for(long lineCounter = 0; lineCounter < nLinesThisGeneration; lineCounter++)
+		{
+			int line = lines[lineCounter];
+			if(currentGeneration > 0)
+			{
+				xoshiro256Plus random(seeds[line]);
+				int motherIndex = mother[line] - 1, fatherIndex = father[line] - 1;
+				sampleGamete(haplotypes[2*motherIndex], haplotypes[2*motherIndex+1], cumulativeHazard, random, haplotypes[2*line]);
+				sampleGamete(haplotypes[2*fatherIndex], haplotypes[2*fatherIndex+1], cumulativeHazard, random, haplotypes[2*line+1]);
+			}
+			//Write out observed lines. Column i and column i + nMarkers are the two alleles at marker i. 
+			if(finalRow[line] >= 0)
+			{
+				for(int copy = 0; copy < 2; copy++)
+				{
+					const haplotype& current = haplotypes[2*line+copy];
+					for(std::size_t segment = 0; segment < current.size(); segment++)
+					{
+						int end = segment + 1 < current.size() ? current[segment+1].start : nMarkers;
+						for(int marker = current[segment].start; marker < end; marker++)
+						{
+							finalsPtr[(std::size_t)(copy * nMarkers + marker) * nObserved + finalRow[line]] = current[segment].founder;
+						}
+					}
+				}
+			}
+		}
+		//Discard lines once all their children have been simulated
+		for(long lineCounter = 0; lineCounter < nLinesThisGeneration; lineCounter++)
+		{
+			int line = lines[lineCounter];
+			if(currentGeneration > 0)
+			{
+				for(int parent : {mother[line] - 1, father[line] - 1})
+				{
+					if(--remainingChildren[parent] == 0)
+					{
+						haplotype().swap(haplotypes[2*parent]);
+						haplotype().swap(haplotypes[2*parent+1]);
+					}
+				}
+			}
+			if(remainingChildren[line] == 0)
+			{
+				haplotype().swap(haplotypes[2*line]);
+				haplotype().swap(haplotypes[2*line+1]);
+			}
+		}
+	}
+	Rcpp::CharacterVector finalColumnNames(2 * nMarkers);
+	for(int i = 0; i < nMarkers; i++) finalColumnNames[i] = finalColumnNames[i + nMarkers] = markerNames[i];
+	finals.attr("dimnames") = Rcpp::List::create(finalNames, finalColumnNames);
+
+	Rcpp::IntegerMatrix founders(nFounders, nMarkers);
+	Rcpp::CharacterVector founderNames(nFounders);
+	for(int line = 0; line < nFounders; line++)
+	{
+		founderNames[line] = lineNames[line];
+		for(int marker = 0; marker < nMarkers; marker++) founders(line, marker) = line + 1;
+	}
+	founders.attr("dimnames") = Rcpp::List::create(founderNames, markerNames);
+	return Rcpp::List::create(Rcpp::Named("founders") = founders, Rcpp::Named("finals") = finals);
+END_RCPP
+}
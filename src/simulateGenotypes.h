@@ -0,0 +1,5 @@
+#ifndef SIMULATE_GENOTYPES_HEADER_GUARD
+#define SIMULATE_GENOTYPES_HEADER_GUARD
+#include <Rcpp.h>
+SEXP simulateGenotypes(SEXP recombinationFractions, SEXP markerNames, SEXP pedigree);
+#endif
@@ -1,7 +1,20 @@
 #ifndef VITERBI_HEADER_GUARD
 #define VITERBI_HEADER_GUARD
-template<int nFounders, bool infiniteSelfing> struct viterbiAlgorithm;
+#include <vector>
+#include <utility>
+#include "matrices.hpp"
 #include "impossibleDataException.h"
+template<int nFounders, bool infiniteSelfing> struct viterbiAlgorithm;
+//Working storage for running the Viterbi algorithm on a single line. When lines are processed in parallel every thread has its own copy. 
+struct viterbiScratch
+{
+	viterbiScratch(int nStates, int nIntermediateRows, int maxChromosomeSize)
+		: intermediate1(nStates, maxChromosomeSize), intermediate2(nIntermediateRows, maxChromosomeSize), pathLengths1(nStates), pathLengths2(nStates), working(nStates)
+	{}
+	rowMajorMatrix<int> intermediate1, intermediate2;
+	std::vector<double> pathLengths1, pathLengths2;
+	std::vector<double> working;
+};
 #include "viterbiInfiniteSelfing.hpp"
 #include "viterbiFiniteSelfing.hpp"
 #endif
@@ -13,16 +13,18 @@
 #include "markerPatternsToUniqueValues.h"
 #include "intercrossingHaplotypeToMarker.hpp"
 #include "funnelHaplotypeToMarker.hpp"
+#include "finiteSelfingTransitionBasis.hpp"
 #include <limits>
+#include <algorithm>
 template<int nFounders> struct viterbiAlgorithm<nFounders, false>
 {
 	typedef typename expandedProbabilities<nFounders, false>::type expandedProbabilitiesType;
 	Rcpp::List recodedHetData;
 	Rcpp::IntegerMatrix recodedFounders, recodedFinals;
-	rowMajorMatrix<int> intermediate1, intermediate2;
 	Rcpp::IntegerMatrix results;
-	std::vector<double> pathLengths1, pathLengths2;
-	std::vector<double> working;
+	//The haplotype probabilities for the interval starting at marker m are stored in row m - transitionOffset
+	int transitionOffset;
+	int maxChromosomeSize;
 	xMajorMatrix<expandedProbabilitiesType>& intercrossingHaplotypeProbabilities;
 	rowMajorMatrix<expandedProbabilitiesType>& funnelHaplotypeProbabilities;
 	markerPatternsToUniqueValuesArgs& markerData;
@@ -39,9 +41,13 @@ template<int nFounders> struct viterbiAlgorithm<nFounders, false>
 	std::vector<array2<nFounders> >* intercrossingSingleLociHaplotypeProbabilities;
 	std::vector<array2<nFounders> >* funnelSingleLociHaplotypeProbabilities;
 	viterbiAlgorithm(markerPatternsToUniqueValuesArgs& markerData, xMajorMatrix<expandedProbabilitiesType>& intercrossingHaplotypeProbabilities, rowMajorMatrix<expandedProbabilitiesType>& funnelHaplotypeProbabilities, int maxChromosomeSize)
-		: intermediate1((nFounders*(nFounders+1))/2, maxChromosomeSize), intermediate2(nFounders*nFounders, maxChromosomeSize), pathLengths1((nFounders*(nFounders+1))/2), pathLengths2((nFounders*(nFounders+1))/2), working((nFounders*(nFounders+1)/2)), intercrossingHaplotypeProbabilities(intercrossingHaplotypeProbabilities), funnelHaplotypeProbabilities(funnelHaplotypeProbabilities), markerData(markerData)
+		: maxChromosomeSize(maxChromosomeSize), intercrossingHaplotypeProbabilities(intercrossingHaplotypeProbabilities), funnelHaplotypeProbabilities(funnelHaplotypeProbabilities), markerData(markerData)
 	{}
-	void apply(int start, int end)
+	/* Run the Viterbi algorithm for every line, on a set of chromosomes. 
+	 *
+	 * @param chromosomes The index of the first marker, and one past the index of the last marker, for every chromosome. The haplotype probabilities for all of these chromosomes must already have been computed. 
+	 */
+	void apply(const std::vector<std::pair<int, int> >& chromosomes)
 	{
 		minSelfingGenerations = *std::min_element(selfingGenerations->begin(), selfingGenerations->end());
 		maxSelfingGenerations = *std::max_element(selfingGenerations->begin(), selfingGenerations->end());
@@ -55,37 +61,148 @@ template<int nFounders> struct viterbiAlgorithm<nFounders, false>
 		{
 			for(int finalCounter = 0; finalCounter < nFinals; finalCounter++)
 			{
-				for(int markerCounter = start; markerCounter < end; markerCounter++)
+				for(std::vector<std::pair<int, int> >::const_iterator chromosome = chromosomes.begin(); chromosome != chromosomes.end(); chromosome++)
 				{
-					if(recodedFinals(finalCounter, markerCounter) == NA_INTEGER)
+					for(int markerCounter = chromosome->first; markerCounter < chromosome->second; markerCounter++)
 					{
-						throw std::runtime_error("Inputs heterozygoteMissingProb and homozygoteMissingProb imply that missing values are not allowed");
+						if(recodedFinals(finalCounter, markerCounter) == NA_INTEGER)
+						{
+							throw std::runtime_error("Inputs heterozygoteMissingProb and homozygoteMissingProb imply that missing values are not allowed");
+						}
 					}
 				}
 			}
 		}
-		for(int finalCounter = 0; finalCounter < nFinals; finalCounter++)
+		int nTasks = (int)chromosomes.size() * nFinals;
+		//If some line has impossible data, report the same line and marker as running the tasks in order would
+		int firstFailedTask = nTasks;
+		impossibleDataException firstFailure(0, 0);
+		//Every (chromosome, line) pair is independent, so these are processed in parallel, with thread-local working storage. The haplotype probabilities are shared. Each pair writes to its own entries of the results, so the output does not depend on the number of threads. 
+#ifdef USE_OPENMP
+		#pragma omp parallel
+#endif
 		{
-			if((*intercrossingGenerations)[finalCounter] == 0)
+			viterbiScratch scratch((nFounders*(nFounders+1))/2, nFounders*nFounders, maxChromosomeSize);
+#ifdef USE_OPENMP
+			#pragma omp for schedule(dynamic)
+#endif
+			for(int task = 0; task < nTasks; task++)
 			{
-				applyFunnel(start, end, finalCounter, (*lineFunnelIDs)[finalCounter], (*selfingGenerations)[finalCounter]);
+				int start = chromosomes[task / nFinals].first, end = chromosomes[task / nFinals].second, finalCounter = task % nFinals;
+				try
+				{
+					if((*intercrossingGenerations)[finalCounter] == 0)
+					{
+						applyFunnel(start, end, finalCounter, (*lineFunnelIDs)[finalCounter], (*selfingGenerations)[finalCounter], scratch);
+					}
+					else
+					{
+						applyIntercrossing(start, end, finalCounter, (*intercrossingGenerations)[finalCounter], (*selfingGenerations)[finalCounter], scratch);
+					}
+				}
+				catch(impossibleDataException& err)
+				{
+#ifdef USE_OPENMP
+					#pragma omp critical(viterbiImpossibleData)
+#endif
+					{
+						if(task < firstFailedTask)
+						{
+							firstFailedTask = task;
+							firstFailure = err;
+						}
+					}
+					continue;
+				}
+				std::vector<double>::iterator longestPath = std::max_element(scratch.pathLengths1.begin(), scratch.pathLengths1.end());
+				int longestIndex = (int)std::distance(scratch.pathLengths1.begin(), longestPath);
+				for(int i = 0; i < end - start; i++)
+				{
+					results(finalCounter, i+start) = scratch.intermediate1(longestIndex, i) + 1;
+				}
 			}
-			else
+		}
+		if(firstFailedTask < nTasks) throw firstFailure;
+	}
+	//A genotype at the previous marker which is consistent with the data
+	struct previousCandidate
+	{
+		//Path length to this genotype, plus the log of the factor for heterozygotes
+		double pathLength;
+		//Index as in finiteSelfingTransitionClasses, and encoding as in key
+		int genotype, encoding;
+	};
+	/* The path length terms are added in the same order as the dense sum, (path length + factor) + transition + missing. The factor is log(2) for every heterozygote among the two genotypes, so there's one candidate list for homozygotes and one for heterozygotes at the next marker. 
+	 */
+	static void addCandidate(int index, int genotype, int encoding, bool heterozygote, const std::vector<double>& pathLengths, previousCandidate* homozygoteCandidates, previousCandidate* heterozygoteCandidates)
+	{
+		double multiple = 0;
+		if(heterozygote) multiple += log(2);
+		homozygoteCandidates[index].pathLength = pathLengths[encoding] + multiple;
+		multiple = log(2);
+		if(heterozygote) multiple += log(2);
+		heterozygoteCandidates[index].pathLength = pathLengths[encoding] + multiple;
+		homozygoteCandidates[index].genotype = heterozygoteCandidates[index].genotype = genotype;
+		homozygoteCandidates[index].encoding = heterozygoteCandidates[index].encoding = encoding;
+	}
+	static bool longerPath(const previousCandidate& first, const previousCandidate& second)
+	{
+		return first.pathLength > second.pathLength;
+	}
+	//Sort the candidates by decreasing path length, and return the largest transition log-probability
+	static double sortCandidates(int nCandidates, const expandedProbabilitiesType& transitionProbabilities, previousCandidate* homozygoteCandidates, previousCandidate* heterozygoteCandidates)
+	{
+		if(!finiteSelfingRecursion::aggregateClasses(nFounders)) return 0;
+		std::sort(homozygoteCandidates, homozygoteCandidates + nCandidates, longerPath);
+		std::sort(heterozygoteCandidates, heterozygoteCandidates + nCandidates, longerPath);
+		return *std::max_element(transitionProbabilities.values, transitionProbabilities.values + compressedProbabilities<nFounders, false>::nDifferentProbs);
+	}
+	/* Find the previous genotype which gives the longest path to a genotype at the next marker. If several give the same path length the one with the smallest encoding is chosen, and if there are no paths the result is encoding 0 with length negative infinity, as for std::max_element over the dense vector of path lengths. 
+	 *
+	 * Every previous genotype in a transition class has the same transition probability, so the best in each class is the one with the longest path to it. So the candidates are visited in order of decreasing path length, and once the path length plus the largest transition log-probability is less than the best so far, no later candidate from any class can do better. Rounding is monotone, so this gives exactly the same result as the dense search. Unless finiteSelfingRecursion says to aggregate over the classes, every candidate is visited, as before. 
+	 */
+	static void findBestPrevious(const previousCandidate* candidates, int nCandidates, const unsigned char* classes, const expandedProbabilitiesType& transitionProbabilities, double maxLogProbability, bool missing, double logMissingProb, std::vector<double>& working, double& longest, int& bestPrevious)
+	{
+		if(!finiteSelfingRecursion::aggregateClasses(nFounders))
+		{
+			std::fill(working.begin(), working.end(), -std::numeric_limits<double>::infinity());
+			for(int candidate = 0; candidate < nCandidates; candidate++)
 			{
-				applyIntercrossing(start, end, finalCounter, (*intercrossingGenerations)[finalCounter], (*selfingGenerations)[finalCounter]);
+				double& value = working[candidates[candidate].encoding];
+				value = candidates[candidate].pathLength + transitionProbabilities.values[classes[candidates[candidate].genotype]];
+				if(missing) value += logMissingProb;
 			}
-			std::vector<double>::iterator longestPath = std::max_element(pathLengths1.begin(), pathLengths1.end());
-			int longestIndex = (int)std::distance(pathLengths1.begin(), longestPath);
-			for(int i = 0; i < end - start; i++)
+			//This may be negative infinity, because some states are impossible to ever be in - E.g. heterozygote {1,2} with funnel {1,2,3,4} and no intercrossing. It indicates that the state for the previous marker is impossible, not that there is no valid next state. 
+			std::vector<double>::iterator longestIterator = std::max_element(working.begin(), working.end());
+			bestPrevious = (int)std::distance(working.begin(), longestIterator);
+			longest = *longestIterator;
+			return;
+		}
+		longest = -std::numeric_limits<double>::infinity();
+		bestPrevious = 0;
+		for(int candidate = 0; candidate < nCandidates && candidates[candidate].pathLength != -std::numeric_limits<double>::infinity(); candidate++)
+		{
+			double bound = candidates[candidate].pathLength + maxLogProbability;
+			if(missing) bound += logMissingProb;
+			if(bound < longest) break;
+			double value = candidates[candidate].pathLength + transitionProbabilities.values[classes[candidates[candidate].genotype]];
+			if(missing) value += logMissingProb;
+			if(value > longest || (value == longest && candidates[candidate].encoding < bestPrevious))
 			{
-				results(finalCounter, i+start) = intermediate1(longestIndex, i) + 1;
+				longest = value;
+				bestPrevious = candidates[candidate].encoding;
 			}
 		}
+		if(longest == -std::numeric_limits<double>::infinity()) bestPrevious = 0;
 	}
-	void applyFunnel(int start, int end, int finalCounter, int funnelID, int selfingGenerations)
+	void applyFunnel(int start, int end, int finalCounter, int funnelID, int selfingGenerations, viterbiScratch& scratch)
 	{
+		rowMajorMatrix<int>& intermediate1 = scratch.intermediate1, &intermediate2 = scratch.intermediate2;
+		std::vector<double>& pathLengths1 = scratch.pathLengths1, &pathLengths2 = scratch.pathLengths2, &working = scratch.working;
 		double logHomozygoteMissingProb = log(homozygoteMissingProb);
 		double logHetrozygoteMissingProb = log(heterozygoteMissingProb);
+		const finiteSelfingTransitionClasses<nFounders>& transitionClasses = finiteSelfingTransitionClasses<nFounders>::get();
+		previousCandidate homozygoteCandidates[(nFounders*(nFounders+1))/2], heterozygoteCandidates[(nFounders*(nFounders+1))/2];
 		//Initialise the algorithm
 		funnelEncoding enc = (*lineFunnelEncodings)[(*lineFunnelIDs)[finalCounter]];
 		int funnel[16];
@@ -123,6 +240,23 @@ template<int nFounders> struct viterbiAlgorithm<nFounders, false>
 			int markerValue = recodedFinals(finalCounter, markerCounter+1);
 			::markerData& previousMarkerData = markerData.allMarkerPatterns[markerData.markerPatternIDs[markerCounter]];
 			::markerData& currentMarkerData = markerData.allMarkerPatterns[markerData.markerPatternIDs[markerCounter + 1]];
+			const expandedProbabilitiesType& transitionProbabilities = funnelHaplotypeProbabilities(markerCounter-transitionOffset, selfingGenerations - minSelfingGenerations);
+			//The genotypes at the previous marker which are consistent with the data, and their path lengths including the factor for heterozygotes. These don't depend on the genotype at the next marker, so they're computed once. 
+			int nCandidates = 0;
+			for(int founderPreviousCounter = 0; founderPreviousCounter < nFounders; founderPreviousCounter++)
+			{
+				for(int founderPreviousCounter2 = 0; founderPreviousCounter2 <= founderPreviousCounter; founderPreviousCounter2++)
+				{
+					int encodingPreviousMarker = previousMarkerData.hetData(funnel[founderPreviousCounter], funnel[founderPreviousCounter2]);
+					int encodingPreviousTheseFounders = key(funnel[founderPreviousCounter], funnel[founderPreviousCounter2])-1;
+					if(encodingPreviousMarker == previousMarkerValue || (previousMarkerValue == NA_INTEGER && ((recodedFounders(funnel[founderPreviousCounter2], markerCounter) == recodedFounders(funnel[founderPreviousCounter], markerCounter) && homozygoteMissingProb != 0) || (recodedFounders(funnel[founderPreviousCounter2], markerCounter) != recodedFounders(funnel[founderPreviousCounter], markerCounter) && heterozygoteMissingProb != 0))))
+					{
+						addCandidate(nCandidates, (founderPreviousCounter*(founderPreviousCounter+1))/2 + founderPreviousCounter2, encodingPreviousTheseFounders, founderPreviousCounter != founderPreviousCounter2, pathLengths1, homozygoteCandidates, heterozygoteCandidates);
+						nCandidates++;
+					}
+				}
+			}
+			double maxLogProbability = sortCandidates(nCandidates, transitionProbabilities, homozygoteCandidates, heterozygoteCandidates);
 			//The founder at the next marker
 			for(int founderCounter = 0; founderCounter < nFounders; founderCounter++)
 			{
@@ -132,43 +266,15 @@ template<int nFounders> struct viterbiAlgorithm<nFounders, false>
 					int encodingTheseFounders = key(funnel[founderCounter], funnel[founderCounter2])-1;
 					if(encodingMarker == markerValue || (markerValue == NA_INTEGER && ((recodedFounders(funnel[founderCounter2], markerCounter) == recodedFounders(funnel[founderCounter], markerCounter) && homozygoteMissingProb != 0) || (recodedFounders(funnel[founderCounter2], markerCounter) != recodedFounders(funnel[founderCounter], markerCounter) && heterozygoteMissingProb != 0))))
 					{
-						//Founder at the previous marker. 
-						std::fill(working.begin(), working.end(), -std::numeric_limits<double>::infinity());
-						for(int founderPreviousCounter = 0; founderPreviousCounter < nFounders; founderPreviousCounter++)
-						{
-							for(int founderPreviousCounter2 = 0; founderPreviousCounter2 <= founderPreviousCounter; founderPreviousCounter2++)
-							{
-								int encodingPreviousMarker = previousMarkerData.hetData(funnel[founderPreviousCounter], funnel[founderPreviousCounter2]);
-								int encodingPreviousTheseFounders = key(funnel[founderPreviousCounter], funnel[founderPreviousCounter2])-1;
-								if(encodingPreviousMarker == previousMarkerValue || (previousMarkerValue == NA_INTEGER && ((recodedFounders(funnel[founderPreviousCounter2], markerCounter) == recodedFounders(funnel[founderPreviousCounter], markerCounter) && homozygoteMissingProb != 0) || (recodedFounders(funnel[founderPreviousCounter2], markerCounter) != recodedFounders(funnel[founderPreviousCounter], markerCounter) && heterozygoteMissingProb != 0))))
-								{
-									double multiple = 0;
-									if(founderCounter != founderCounter2) multiple += log(2);
-									if(founderPreviousCounter != founderPreviousCounter2) multiple += log(2);
-									working[encodingPreviousTheseFounders] = pathLengths1[encodingPreviousTheseFounders] + multiple + funnelHaplotypeProbabilities(markerCounter-start, selfingGenerations - minSelfingGenerations).values[founderCounter][founderCounter2][founderPreviousCounter][founderPreviousCounter2];
-									if(markerValue == NA_INTEGER)
-									{
-										if(founderCounter2 == founderCounter)
-										{
-											working[encodingPreviousTheseFounders] += logHomozygoteMissingProb;
-										}
-										else
-										{
-											working[encodingPreviousTheseFounders] += logHetrozygoteMissingProb;
-										}
-									}
-								}
-							}
-						}
-						//Get the shortest one, and check that it's not negative infinity.
-						std::vector<double>::iterator longest = std::max_element(working.begin(), working.end());
-						//This error is no longer valid, because some states are impossible to ever be in - E.g. heterozygote {1,2} with funnel {1,2,3,4} and no intercrossing. In this case all the probabilities are zero and all the log probabilities are -inf. So *longest == -std::numeric_limits<double>::infinity() doesn't indicate that there is no valid next state. It indicates that the state for the previous marker is impossible. 
-						//if(*longest == -std::numeric_limits<double>::infinity()) throw std::runtime_error("Internal error");
-						int bestPrevious = (int)std::distance(working.begin(), longest);
+						const unsigned char* classes = transitionClasses.classes[(founderCounter*(founderCounter+1))/2 + founderCounter2];
+						double logMissingProb = founderCounter2 == founderCounter ? logHomozygoteMissingProb : logHetrozygoteMissingProb;
+						double longest;
+						int bestPrevious;
+						findBestPrevious(founderCounter != founderCounter2 ? heterozygoteCandidates : homozygoteCandidates, nCandidates, classes, transitionProbabilities, maxLogProbability, markerValue == NA_INTEGER, logMissingProb, working, longest, bestPrevious);
 						
 						memcpy(&(intermediate2(encodingTheseFounders, identicalIndex)), &(intermediate1(bestPrevious, identicalIndex)), sizeof(int)*(markerCounter - start + 1 - identicalIndex));
 						intermediate2(encodingTheseFounders, markerCounter-start+1) = encodingTheseFounders;
-						pathLengths2[encodingTheseFounders] = *longest;
+						pathLengths2[encodingTheseFounders] = longest;
 					}
 					else
 					{
@@ -204,10 +310,14 @@ stopIdenticalSearch:
 			;
 		}
 	}
-	void applyIntercrossing(int start, int end, int finalCounter, int intercrossingGeneration, int selfingGenerations)
+	void applyIntercrossing(int start, int end, int finalCounter, int intercrossingGeneration, int selfingGenerations, viterbiScratch& scratch)
 	{
+		rowMajorMatrix<int>& intermediate1 = scratch.intermediate1, &intermediate2 = scratch.intermediate2;
+		std::vector<double>& pathLengths1 = scratch.pathLengths1, &pathLengths2 = scratch.pathLengths2, &working = scratch.working;
 		double logHomozygoteMissingProb = log(homozygoteMissingProb);
 		double logHetrozygoteMissingProb = log(heterozygoteMissingProb);
+		const finiteSelfingTransitionClasses<nFounders>& transitionClasses = finiteSelfingTransitionClasses<nFounders>::get();
+		previousCandidate homozygoteCandidates[(nFounders*(nFounders+1))/2], heterozygoteCandidates[(nFounders*(nFounders+1))/2];
 		//Initialise the algorithm
 		int startMarkerValue = recodedFinals(finalCounter, start);
 		::markerData& startMarkerData = markerData.allMarkerPatterns[markerData.markerPatternIDs[start]];
@@ -239,6 +349,23 @@ stopIdenticalSearch:
 			int markerValue = recodedFinals(finalCounter, markerCounter+1);
 			::markerData& previousMarkerData = markerData.allMarkerPatterns[markerData.markerPatternIDs[markerCounter]];
 			::markerData& currentMarkerData = markerData.allMarkerPatterns[markerData.markerPatternIDs[markerCounter + 1]];
+			const expandedProbabilitiesType& transitionProbabilities = intercrossingHaplotypeProbabilities(markerCounter-transitionOffset, intercrossingGeneration - minAIGenerations, selfingGenerations - minSelfingGenerations);
+			//The genotypes at the previous marker which are consistent with the data, and their path lengths including the factor for heterozygotes. These don't depend on the genotype at the next marker, so they're computed once. 
+			int nCandidates = 0;
+			for(int founderPreviousCounter = 0; founderPreviousCounter < nFounders; founderPreviousCounter++)
+			{
+				for(int founderPreviousCounter2 = 0; founderPreviousCounter2 <= founderPreviousCounter; founderPreviousCounter2++)
+				{
+					int encodingPreviousMarker = previousMarkerData.hetData(founderPreviousCounter, founderPreviousCounter2);
+					int encodingPreviousTheseFounders = key(founderPreviousCounter, founderPreviousCounter2)-1;
+					if(encodingPreviousMarker == previousMarkerValue || (previousMarkerValue == NA_INTEGER && ((recodedFounders(founderPreviousCounter2, markerCounter) == recodedFounders(founderPreviousCounter, markerCounter) && homozygoteMissingProb != 0) || (recodedFounders(founderPreviousCounter2, markerCounter) != recodedFounders(founderPreviousCounter, markerCounter) && heterozygoteMissingProb != 0))))
+					{
+						addCandidate(nCandidates, (founderPreviousCounter*(founderPreviousCounter+1))/2 + founderPreviousCounter2, encodingPreviousTheseFounders, founderPreviousCounter != founderPreviousCounter2, pathLengths1, homozygoteCandidates, heterozygoteCandidates);
+						nCandidates++;
+					}
+				}
+			}
+			double maxLogProbability = sortCandidates(nCandidates, transitionProbabilities, homozygoteCandidates, heterozygoteCandidates);
 			//The founder at the next marker
 			for(int founderCounter = 0; founderCounter < nFounders; founderCounter++)
 			{
@@ -248,41 +375,15 @@ stopIdenticalSearch:
 					int encodingTheseFounders = key(founderCounter, founderCounter2)-1;
 					if(encodingMarker == markerValue || (markerValue == NA_INTEGER && ((recodedFounders(founderCounter2, markerCounter) == recodedFounders(founderCounter, markerCounter) && homozygoteMissingProb != 0) || (recodedFounders(founderCounter2, markerCounter) != recodedFounders(founderCounter, markerCounter) && heterozygoteMissingProb != 0))))
 					{
-						//Founder at the previous marker. 
-						std::fill(working.begin(), working.end(), -std::numeric_limits<double>::infinity());
-						for(int founderPreviousCounter = 0; founderPreviousCounter < nFounders; founderPreviousCounter++)
-						{
-							for(int founderPreviousCounter2 = 0; founderPreviousCounter2 <= founderPreviousCounter; founderPreviousCounter2++)
-							{
-								int encodingPreviousMarker = previousMarkerData.hetData(founderPreviousCounter, founderPreviousCounter2);
-								int encodingPreviousTheseFounders = key(founderPreviousCounter, founderPreviousCounter2)-1;
-								if(encodingPreviousMarker == previousMarkerValue || (previousMarkerValue == NA_INTEGER && ((recodedFounders(founderPreviousCounter2, markerCounter) == recodedFounders(founderPreviousCounter, markerCounter) && homozygoteMissingProb != 0) || (recodedFounders(founderPreviousCounter2, markerCounter) != recodedFounders(founderPreviousCounter, markerCounter) && heterozygoteMissingProb != 0))))
-								{
-									double multiple = 0;
-									if(founderCounter != founderCounter2) multiple += log(2);
-									if(founderPreviousCounter != founderPreviousCounter2) multiple += log(2);
-									working[encodingPreviousTheseFounders] = pathLengths1[encodingPreviousTheseFounders] + multiple + intercrossingHaplotypeProbabilities(markerCounter-start, intercrossingGeneration - minAIGenerations, selfingGenerations - minSelfingGenerations).values[founderCounter][founderCounter2][founderPreviousCounter][founderPreviousCounter2];
-									if(markerValue == NA_INTEGER)
-									{
-										if(founderCounter2 == founderCounter)
-										{
-											working[encodingPreviousTheseFounders] += logHomozygoteMissingProb;
-										}
-										else
-										{
-											working[encodingPreviousTheseFounders] += logHetrozygoteMissingProb;
-										}
-									}
-								}
-							}
-						}
-						//Get the shortest one, and check that it's not negative infinity.
-						std::vector<double>::iterator longest = std::max_element(working.begin(), working.end());
-						int bestPrevious = (int)std::distance(working.begin(), longest);
+						const unsigned char* classes = transitionClasses.classes[(founderCounter*(founderCounter+1))/2 + founderCounter2];
+						double logMissingProb = founderCounter2 == founderCounter ? logHomozygoteMissingProb : logHetrozygoteMissingProb;
+						double longest;
+						int bestPrevious;
+						findBestPrevious(founderCounter != founderCounter2 ? heterozygoteCandidates : homozygoteCandidates, nCandidates, classes, transitionProbabilities, maxLogProbability, markerValue == NA_INTEGER, logMissingProb, working, longest, bestPrevious);
 						
 						memcpy(&(intermediate2(encodingTheseFounders, identicalIndex)), &(intermediate1(bestPrevious, identicalIndex)), sizeof(int)*(markerCounter - start + 1 - identicalIndex));
 						intermediate2(encodingTheseFounders, markerCounter-start+1) = encodingTheseFounders;
-						pathLengths2[encodingTheseFounders] = *longest;
+						pathLengths2[encodingTheseFounders] = longest;
 					}
 					else
 					{
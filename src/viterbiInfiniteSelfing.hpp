@@ -19,10 +19,10 @@ template<int nFounders> struct viterbiAlgorithm<nFounders, true>
 	typedef typename expandedProbabilities<nFounders, true>::type expandedProbabilitiesType;
 	Rcpp::List recodedHetData;
 	Rcpp::IntegerMatrix recodedFounders, recodedFinals;
-	rowMajorMatrix<int> intermediate1, intermediate2;
 	Rcpp::IntegerMatrix results;
-	std::vector<double> pathLengths1, pathLengths2;
-	std::vector<double> working;
+	//The haplotype probabilities for the interval starting at marker m are stored in row m - transitionOffset
+	int transitionOffset;
+	int maxChromosomeSize;
 	xMajorMatrix<expandedProbabilitiesType>& intercrossingHaplotypeProbabilities;
 	rowMajorMatrix<expandedProbabilitiesType>& funnelHaplotypeProbabilities;
 	markerPatternsToUniqueValuesArgs& markerData;
@@ -38,34 +38,73 @@ template<int nFounders> struct viterbiAlgorithm<nFounders, true>
 	std::vector<array2<nFounders> >* intercrossingSingleLociHaplotypeProbabilities;
 	std::vector<array2<nFounders> >* funnelSingleLociHaplotypeProbabilities;
 	viterbiAlgorithm(markerPatternsToUniqueValuesArgs& markerData, xMajorMatrix<expandedProbabilitiesType>& intercrossingHaplotypeProbabilities, rowMajorMatrix<expandedProbabilitiesType>& funnelHaplotypeProbabilities, int maxChromosomeSize)
-		: intermediate1(nFounders, maxChromosomeSize), intermediate2(nFounders, maxChromosomeSize), pathLengths1(nFounders), pathLengths2(nFounders), working(nFounders), intercrossingHaplotypeProbabilities(intercrossingHaplotypeProbabilities), funnelHaplotypeProbabilities(funnelHaplotypeProbabilities), markerData(markerData)
+		: maxChromosomeSize(maxChromosomeSize), intercrossingHaplotypeProbabilities(intercrossingHaplotypeProbabilities), funnelHaplotypeProbabilities(funnelHaplotypeProbabilities), markerData(markerData)
 	{}
-	void apply(int start, int end)
+	/* Run the Viterbi algorithm for every line, on a set of chromosomes. 
+	 *
+	 * @param chromosomes The index of the first marker, and one past the index of the last marker, for every chromosome. The haplotype probabilities for all of these chromosomes must already have been computed. 
+	 */
+	void apply(const std::vector<std::pair<int, int> >& chromosomes)
 	{
 		minAIGenerations = *std::min_element(intercrossingGenerations->begin(), intercrossingGenerations->end());
 		maxAIGenerations = *std::max_element(intercrossingGenerations->begin(), intercrossingGenerations->end());
 		minAIGenerations = std::max(minAIGenerations, 1);
 		int nFinals = recodedFinals.nrow();
-		for(int finalCounter = 0; finalCounter < nFinals; finalCounter++)
+		int nTasks = (int)chromosomes.size() * nFinals;
+		//If some line has impossible data, report the same line and marker as running the tasks in order would
+		int firstFailedTask = nTasks;
+		impossibleDataException firstFailure(0, 0);
+		//Every (chromosome, line) pair is independent, so these are processed in parallel, with thread-local working storage. The haplotype probabilities are shared. Each pair writes to its own entries of the results, so the output does not depend on the number of threads. 
+#ifdef USE_OPENMP
+		#pragma omp parallel
+#endif
 		{
-			if((*intercrossingGenerations)[finalCounter] == 0)
-			{
-				applyFunnel(start, end, finalCounter, (*lineFunnelIDs)[finalCounter]);
-			}
-			else
-			{
-				applyIntercrossing(start, end, finalCounter, (*intercrossingGenerations)[finalCounter]);
-			}
-			std::vector<double>::iterator longestPath = std::max_element(pathLengths1.begin(), pathLengths1.end());
-			int longestIndex = (int)std::distance(pathLengths1.begin(), longestPath);
-			for(int i = 0; i < end - start; i++)
+			viterbiScratch scratch(nFounders, nFounders, maxChromosomeSize);
+#ifdef USE_OPENMP
+			#pragma omp for schedule(dynamic)
+#endif
+			for(int task = 0; task < nTasks; task++)
 			{
-				results(finalCounter, i+start) = intermediate1(longestIndex, i);
+				int start = chromosomes[task / nFinals].first, end = chromosomes[task / nFinals].second, finalCounter = task % nFinals;
+				try
+				{
+					if((*intercrossingGenerations)[finalCounter] == 0)
+					{
+						applyFunnel(start, end, finalCounter, (*lineFunnelIDs)[finalCounter], scratch);
+					}
+					else
+					{
+						applyIntercrossing(start, end, finalCounter, (*intercrossingGenerations)[finalCounter], scratch);
+					}
+				}
+				catch(impossibleDataException& err)
+				{
+#ifdef USE_OPENMP
+					#pragma omp critical(viterbiImpossibleData)
+#endif
+					{
+						if(task < firstFailedTask)
+						{
+							firstFailedTask = task;
+							firstFailure = err;
+						}
+					}
+					continue;
+				}
+				std::vector<double>::iterator longestPath = std::max_element(scratch.pathLengths1.begin(), scratch.pathLengths1.end());
+				int longestIndex = (int)std::distance(scratch.pathLengths1.begin(), longestPath);
+				for(int i = 0; i < end - start; i++)
+				{
+					results(finalCounter, i+start) = scratch.intermediate1(longestIndex, i);
+				}
 			}
 		}
+		if(firstFailedTask < nTasks) throw firstFailure;
 	}
-	void applyFunnel(int start, int end, int finalCounter, int funnelID)
+	void applyFunnel(int start, int end, int finalCounter, int funnelID, viterbiScratch& scratch)
 	{
+		rowMajorMatrix<int>& intermediate1 = scratch.intermediate1, &intermediate2 = scratch.intermediate2;
+		std::vector<double>& pathLengths1 = scratch.pathLengths1, &pathLengths2 = scratch.pathLengths2, &working = scratch.working;
 		//Initialise the algorithm. For infinite generations of selfing, we don't need to bother with the hetData object, as there are no hets
 		int markerValue = recodedFinals(finalCounter, start);
 		funnelEncoding enc = (*lineFunnelEncodings)[(*lineFunnelIDs)[finalCounter]];
@@ -99,7 +138,7 @@ template<int nFounders> struct viterbiAlgorithm<nFounders, true>
 					{
 						if(recodedFounders(funnel[founderCounter2], markerCounter) == previousMarkerValue || previousMarkerValue == NA_INTEGER)
 						{
-							working[funnel[founderCounter2]] = pathLengths1[funnel[founderCounter2]] + funnelHaplotypeProbabilities(markerCounter-start, 0).values[founderCounter2][founderCounter];
+							working[funnel[founderCounter2]] = pathLengths1[funnel[founderCounter2]] + funnelHaplotypeProbabilities(markerCounter-transitionOffset, 0).values[founderCounter2][founderCounter];
 						}
 					}
 					//Get the shortest one, and check that it's not negative infinity.
@@ -138,8 +177,10 @@ stopIdenticalSearch:
 			;
 		}
 	}
-	void applyIntercrossing(int start, int end, int finalCounter, int intercrossingGeneration)
+	void applyIntercrossing(int start, int end, int finalCounter, int intercrossingGeneration, viterbiScratch& scratch)
 	{
+		rowMajorMatrix<int>& intermediate1 = scratch.intermediate1, &intermediate2 = scratch.intermediate2;
+		std::vector<double>& pathLengths1 = scratch.pathLengths1, &pathLengths2 = scratch.pathLengths2, &working = scratch.working;
 		//Initialise the algorithm. For infinite generations of selfing, we don't need to bother with the hetData object, as there are no hets
 		int markerValue = recodedFinals(finalCounter, start);
 		for(int founderCounter = 0; founderCounter < nFounders; founderCounter++)
@@ -170,7 +211,7 @@ stopIdenticalSearch:
 						//NA corresponds to no restriction
 						if(recodedFounders(founderCounter2, markerCounter) == previousMarkerValue || previousMarkerValue == NA_INTEGER)
 						{
-							working[founderCounter2] = pathLengths1[founderCounter2] + intercrossingHaplotypeProbabilities(markerCounter-start, intercrossingGeneration - minAIGenerations, 0).values[founderCounter2][founderCounter];
+							working[founderCounter2] = pathLengths1[founderCounter2] + intercrossingHaplotypeProbabilities(markerCounter-transitionOffset, intercrossingGeneration - minAIGenerations, 0).values[founderCounter2][founderCounter];
 						}
 					}
 					//Get the longest one, and check that it's not negative infinity.